@@ -0,0 +1,518 @@
+/*
+ * Copyright 2015 Artem Savkov <artem.savkov@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+
+#include "discord-etf.h"
+
+#define ETF_VERSION 131
+#define ETF_MAX_DEPTH 128
+
+typedef enum {
+  ETF_NEW_FLOAT = 70,
+  ETF_SMALL_INTEGER = 97,
+  ETF_INTEGER = 98,
+  ETF_FLOAT = 99,
+  ETF_ATOM = 100,
+  ETF_SMALL_TUPLE = 104,
+  ETF_LARGE_TUPLE = 105,
+  ETF_NIL = 106,
+  ETF_STRING = 107,
+  ETF_LIST = 108,
+  ETF_BINARY = 109,
+  ETF_SMALL_BIG = 110,
+  ETF_LARGE_BIG = 111,
+  ETF_SMALL_ATOM = 115,
+  ETF_MAP = 116,
+  ETF_ATOM_UTF8 = 118,
+  ETF_SMALL_ATOM_UTF8 = 119
+} etf_tag;
+
+typedef struct {
+  const guchar *p;
+  const guchar *end;
+  guint depth;
+} etf_reader;
+
+static gboolean etf_need(etf_reader *r, gsize n)
+{
+  return (gsize)(r->end - r->p) >= n;
+}
+
+static guint8 etf_u8(etf_reader *r)
+{
+  return *r->p++;
+}
+
+static guint16 etf_u16(etf_reader *r)
+{
+  guint16 v;
+  memcpy(&v, r->p, sizeof(v));
+  r->p += sizeof(v);
+  return GUINT16_FROM_BE(v);
+}
+
+static guint32 etf_u32(etf_reader *r)
+{
+  guint32 v;
+  memcpy(&v, r->p, sizeof(v));
+  r->p += sizeof(v);
+  return GUINT32_FROM_BE(v);
+}
+
+static json_value *etf_new(json_type type, json_value *parent)
+{
+  json_value *js = g_new0(json_value, 1);
+  js->type = type;
+  js->parent = parent;
+  return js;
+}
+
+/* Unlike g_strndup() this keeps whatever follows a NUL. */
+static gchar *etf_strndup(const guchar *str, gsize len)
+{
+  gchar *s = g_malloc(len + 1);
+  memcpy(s, str, len);
+  s[len] = '\0';
+  return s;
+}
+
+static json_value *etf_new_string(const guchar *str, gsize len,
+                                  json_value *parent)
+{
+  json_value *js = etf_new(json_string, parent);
+  js->u.string.ptr = etf_strndup(str, len);
+  js->u.string.length = len;
+  return js;
+}
+
+static json_value *etf_decode_atom(const guchar *name, gsize len,
+                                   json_value *parent)
+{
+  json_value *js;
+
+  if (len == 3 && memcmp(name, "nil", 3) == 0) {
+    js = etf_new(json_null, parent);
+  } else if (len == 4 && memcmp(name, "true", 4) == 0) {
+    js = etf_new(json_boolean, parent);
+    js->u.boolean = TRUE;
+  } else if (len == 5 && memcmp(name, "false", 5) == 0) {
+    js = etf_new(json_boolean, parent);
+    js->u.boolean = FALSE;
+  } else {
+    js = etf_new_string(name, len, parent);
+  }
+
+  return js;
+}
+
+/* Snowflakes don't fit into 32 bits and are sent as bignums. JSON carries
+ * them as strings, so that's what handlers expect to find. */
+static json_value *etf_decode_big(etf_reader *r, gsize n, json_value *parent)
+{
+  guint8 sign = etf_u8(r);
+  guint64 v = 0;
+  json_value *js;
+
+  if (n > sizeof(v)) {
+    r->p += n;
+    return etf_new(json_null, parent);
+  }
+
+  for (gsize i = 0; i < n; i++) {
+    v |= (guint64)r->p[i] << (8 * i);
+  }
+  r->p += n;
+
+  js = etf_new(json_string, parent);
+  js->u.string.ptr = g_strdup_printf("%s%"G_GUINT64_FORMAT, sign ? "-" : "",
+                                     v);
+  js->u.string.length = strlen(js->u.string.ptr);
+  return js;
+}
+
+static json_value *etf_decode_value(etf_reader *r, json_value *parent);
+
+static json_value *etf_decode_array(etf_reader *r, guint32 n,
+                                    json_value *parent)
+{
+  json_value *js;
+
+  /* Every element takes at least one byte, don't let a bogus length make us
+     allocate more than that. */
+  if (!etf_need(r, n)) {
+    return NULL;
+  }
+
+  js = etf_new(json_array, parent);
+  js->u.array.values = g_new0(json_value*, MAX(n, 1));
+  for (guint32 i = 0; i < n; i++) {
+    json_value *v = etf_decode_value(r, js);
+    if (v == NULL) {
+      discord_etf_free(js);
+      return NULL;
+    }
+    js->u.array.values[js->u.array.length++] = v;
+  }
+
+  return js;
+}
+
+static gboolean etf_decode_key(etf_reader *r, json_object_entry *entry)
+{
+  gsize len;
+
+  if (!etf_need(r, 1)) {
+    return FALSE;
+  }
+
+  switch (etf_u8(r)) {
+    case ETF_ATOM:
+    case ETF_ATOM_UTF8:
+      if (!etf_need(r, 2)) {
+        return FALSE;
+      }
+      len = etf_u16(r);
+      break;
+    case ETF_SMALL_ATOM:
+    case ETF_SMALL_ATOM_UTF8:
+      if (!etf_need(r, 1)) {
+        return FALSE;
+      }
+      len = etf_u8(r);
+      break;
+    case ETF_BINARY:
+      if (!etf_need(r, 4)) {
+        return FALSE;
+      }
+      len = etf_u32(r);
+      break;
+    default:
+      return FALSE;
+  }
+
+  if (!etf_need(r, len)) {
+    return FALSE;
+  }
+
+  entry->name = etf_strndup(r->p, len);
+  entry->name_length = len;
+  r->p += len;
+  return TRUE;
+}
+
+static json_value *etf_decode_map(etf_reader *r, guint32 n, json_value *parent)
+{
+  json_value *js;
+
+  if (!etf_need(r, n)) {
+    return NULL;
+  }
+
+  js = etf_new(json_object, parent);
+  js->u.object.values = g_new0(json_object_entry, MAX(n, 1));
+  for (guint32 i = 0; i < n; i++) {
+    json_object_entry *entry = &js->u.object.values[i];
+
+    if (!etf_decode_key(r, entry)) {
+      g_free(entry->name);
+      discord_etf_free(js);
+      return NULL;
+    }
+
+    entry->value = etf_decode_value(r, js);
+    js->u.object.length++;
+    if (entry->value == NULL) {
+      discord_etf_free(js);
+      return NULL;
+    }
+  }
+
+  return js;
+}
+
+static json_value *etf_decode_value(etf_reader *r, json_value *parent)
+{
+  json_value *js = NULL;
+  gsize len;
+
+  if (!etf_need(r, 1) || r->depth >= ETF_MAX_DEPTH) {
+    return NULL;
+  }
+
+  r->depth++;
+  switch (etf_u8(r)) {
+    case ETF_SMALL_INTEGER:
+      if (etf_need(r, 1)) {
+        js = etf_new(json_integer, parent);
+        js->u.integer = etf_u8(r);
+      }
+      break;
+    case ETF_INTEGER:
+      if (etf_need(r, 4)) {
+        js = etf_new(json_integer, parent);
+        js->u.integer = (gint32)etf_u32(r);
+      }
+      break;
+    case ETF_NEW_FLOAT:
+      if (etf_need(r, 8)) {
+        guint64 bits;
+        memcpy(&bits, r->p, sizeof(bits));
+        bits = GUINT64_FROM_BE(bits);
+        r->p += sizeof(bits);
+        js = etf_new(json_double, parent);
+        memcpy(&js->u.dbl, &bits, sizeof(bits));
+      }
+      break;
+    case ETF_FLOAT:
+      if (etf_need(r, 31)) {
+        gchar fbuf[32] = "";
+        memcpy(fbuf, r->p, 31);
+        r->p += 31;
+        js = etf_new(json_double, parent);
+        js->u.dbl = g_ascii_strtod(fbuf, NULL);
+      }
+      break;
+    case ETF_ATOM:
+    case ETF_ATOM_UTF8:
+      if (etf_need(r, 2)) {
+        len = etf_u16(r);
+        if (etf_need(r, len)) {
+          js = etf_decode_atom(r->p, len, parent);
+          r->p += len;
+        }
+      }
+      break;
+    case ETF_SMALL_ATOM:
+    case ETF_SMALL_ATOM_UTF8:
+      if (etf_need(r, 1)) {
+        len = etf_u8(r);
+        if (etf_need(r, len)) {
+          js = etf_decode_atom(r->p, len, parent);
+          r->p += len;
+        }
+      }
+      break;
+    case ETF_STRING:
+      if (etf_need(r, 2)) {
+        len = etf_u16(r);
+        if (etf_need(r, len)) {
+          js = etf_new_string(r->p, len, parent);
+          r->p += len;
+        }
+      }
+      break;
+    case ETF_BINARY:
+      if (etf_need(r, 4)) {
+        len = etf_u32(r);
+        if (etf_need(r, len)) {
+          js = etf_new_string(r->p, len, parent);
+          r->p += len;
+        }
+      }
+      break;
+    case ETF_SMALL_BIG:
+      if (etf_need(r, 2)) {
+        len = etf_u8(r);
+        if (etf_need(r, len + 1)) {
+          js = etf_decode_big(r, len, parent);
+        }
+      }
+      break;
+    case ETF_LARGE_BIG:
+      if (etf_need(r, 5)) {
+        len = etf_u32(r);
+        /* Don't let len + 1 wrap around where gsize is 32 bits. */
+        if (len < G_MAXSIZE && etf_need(r, len + 1)) {
+          js = etf_decode_big(r, len, parent);
+        }
+      }
+      break;
+    case ETF_NIL:
+      js = etf_decode_array(r, 0, parent);
+      break;
+    case ETF_SMALL_TUPLE:
+      if (etf_need(r, 1)) {
+        js = etf_decode_array(r, etf_u8(r), parent);
+      }
+      break;
+    case ETF_LARGE_TUPLE:
+      if (etf_need(r, 4)) {
+        js = etf_decode_array(r, etf_u32(r), parent);
+      }
+      break;
+    case ETF_LIST:
+      if (etf_need(r, 4)) {
+        js = etf_decode_array(r, etf_u32(r), parent);
+        /* Proper lists end with NIL, there's nothing to keep in the tail. */
+        if (js != NULL && (!etf_need(r, 1) || etf_u8(r) != ETF_NIL)) {
+          discord_etf_free(js);
+          js = NULL;
+        }
+      }
+      break;
+    case ETF_MAP:
+      if (etf_need(r, 4)) {
+        js = etf_decode_map(r, etf_u32(r), parent);
+      }
+      break;
+    default:
+      break;
+  }
+  r->depth--;
+
+  return js;
+}
+
+json_value *discord_etf_decode(const gchar *buf, gsize size)
+{
+  etf_reader r = { (const guchar*)buf, (const guchar*)buf + size, 0 };
+
+  if (!etf_need(&r, 1) || etf_u8(&r) != ETF_VERSION) {
+    return NULL;
+  }
+
+  return etf_decode_value(&r, NULL);
+}
+
+void discord_etf_free(json_value *js)
+{
+  if (js == NULL) {
+    return;
+  }
+
+  switch (js->type) {
+    case json_object:
+      for (unsigned int i = 0; i < js->u.object.length; i++) {
+        g_free(js->u.object.values[i].name);
+        discord_etf_free(js->u.object.values[i].value);
+      }
+      g_free(js->u.object.values);
+      break;
+    case json_array:
+      for (unsigned int i = 0; i < js->u.array.length; i++) {
+        discord_etf_free(js->u.array.values[i]);
+      }
+      g_free(js->u.array.values);
+      break;
+    case json_string:
+      g_free(js->u.string.ptr);
+      break;
+    default:
+      break;
+  }
+
+  g_free(js);
+}
+
+static void etf_put_u32(GString *buf, guint32 v)
+{
+  v = GUINT32_TO_BE(v);
+  g_string_append_len(buf, (gchar*)&v, sizeof(v));
+}
+
+static void etf_put_atom(GString *buf, const gchar *name)
+{
+  g_string_append_c(buf, ETF_SMALL_ATOM_UTF8);
+  g_string_append_c(buf, strlen(name));
+  g_string_append(buf, name);
+}
+
+static void etf_put_binary(GString *buf, const gchar *str, gsize len)
+{
+  g_string_append_c(buf, ETF_BINARY);
+  etf_put_u32(buf, len);
+  g_string_append_len(buf, str, len);
+}
+
+static void etf_encode_value(GString *buf, const json_value *js)
+{
+  switch (js->type) {
+    case json_object:
+      g_string_append_c(buf, ETF_MAP);
+      etf_put_u32(buf, js->u.object.length);
+      for (unsigned int i = 0; i < js->u.object.length; i++) {
+        etf_put_binary(buf, js->u.object.values[i].name,
+                       js->u.object.values[i].name_length);
+        etf_encode_value(buf, js->u.object.values[i].value);
+      }
+      break;
+    case json_array:
+      if (js->u.array.length > 0) {
+        g_string_append_c(buf, ETF_LIST);
+        etf_put_u32(buf, js->u.array.length);
+        for (unsigned int i = 0; i < js->u.array.length; i++) {
+          etf_encode_value(buf, js->u.array.values[i]);
+        }
+      }
+      g_string_append_c(buf, ETF_NIL);
+      break;
+    case json_integer:
+      if (js->u.integer >= 0 && js->u.integer <= G_MAXUINT8) {
+        g_string_append_c(buf, ETF_SMALL_INTEGER);
+        g_string_append_c(buf, js->u.integer);
+      } else if (js->u.integer >= G_MININT32 && js->u.integer <= G_MAXINT32) {
+        g_string_append_c(buf, ETF_INTEGER);
+        etf_put_u32(buf, (guint32)js->u.integer);
+      } else {
+        guint64 v = js->u.integer < 0 ? -(guint64)js->u.integer :
+                                        (guint64)js->u.integer;
+        gsize sizepos;
+
+        g_string_append_c(buf, ETF_SMALL_BIG);
+        sizepos = buf->len;
+        g_string_append_c(buf, 0);
+        g_string_append_c(buf, js->u.integer < 0 ? 1 : 0);
+        for (; v > 0; v >>= 8) {
+          g_string_append_c(buf, v & 0xff);
+          buf->str[sizepos]++;
+        }
+      }
+      break;
+    case json_double:
+      {
+        guint64 bits;
+        memcpy(&bits, &js->u.dbl, sizeof(bits));
+        bits = GUINT64_TO_BE(bits);
+        g_string_append_c(buf, ETF_NEW_FLOAT);
+        g_string_append_len(buf, (gchar*)&bits, sizeof(bits));
+      }
+      break;
+    case json_string:
+      etf_put_binary(buf, js->u.string.ptr, js->u.string.length);
+      break;
+    case json_boolean:
+      etf_put_atom(buf, js->u.boolean ? "true" : "false");
+      break;
+    default:
+      etf_put_atom(buf, "nil");
+      break;
+  }
+}
+
+GString *discord_etf_encode(const json_value *js)
+{
+  GString *buf = g_string_new("");
+
+  g_string_append_c(buf, ETF_VERSION);
+  if (js != NULL) {
+    etf_encode_value(buf, js);
+  } else {
+    etf_put_atom(buf, "nil");
+  }
+
+  return buf;
+}
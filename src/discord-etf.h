@@ -0,0 +1,29 @@
+/*
+ * Copyright 2015 Artem Savkov <artem.savkov@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <glib.h>
+#include <json.h>
+
+/* Decodes an Erlang external term format payload into the same json_value
+ * tree json_parse() would produce for the JSON version of the event, so the
+ * handlers don't need to care about the gateway encoding. Snowflakes arrive
+ * as bignums and are turned into decimal strings, the atoms nil/true/false
+ * into null and booleans. The result must be freed with discord_etf_free(). */
+json_value *discord_etf_decode(const gchar *buf, gsize size);
+void discord_etf_free(json_value *js);
+
+/* Encodes a json_value tree as an ETF payload for sending to the gateway. */
+GString *discord_etf_encode(const json_value *js);
@@ -19,12 +19,43 @@
 #include <json_util.h>
 
 #include "discord-util.h"
+#include "discord-etf.h"
+#include "discord-json.h"
+#include "discord-reconnect.h"
 #include "discord-handlers.h"
+#include "discord-session.h"
 #include "discord-http.h"
 #include "discord-websockets.h"
 
 #define GLOBAL_SERVER_ID "0"
 
+/* With the DEDUPE_USER_OBJECTS capability READY carries every user object
+ * only once, in a top level "users" table, and refers to them by id
+ * everywhere else. Returns the user object for either form. */
+static json_value *discord_ready_user(discord_data *dd, json_value *ref)
+{
+  if (ref == NULL) {
+    return NULL;
+  }
+  if (ref->type == json_object) {
+    return ref;
+  }
+  if (ref->type == json_string && dd->ready_users != NULL) {
+    return g_hash_table_lookup(dd->ready_users, ref->u.string.ptr);
+  }
+  return NULL;
+}
+
+static json_value *discord_recipients(json_value *cinfo)
+{
+  json_value *rcplist = json_o_get(cinfo, "recipients");
+
+  if (rcplist == NULL) {
+    rcplist = json_o_get(cinfo, "recipient_ids");
+  }
+  return rcplist;
+}
+
 static void discord_handle_voice_state(struct im_connection *ic,
                                        json_value *vsinfo,
                                        const char *server_id)
@@ -76,8 +107,12 @@ static void discord_handle_presence(struct im_connection *ic,
     return;
   }
 
-  user_info *uinfo = get_user(dd, json_o_str(json_o_get(pinfo, "user"), "id"),
-                              server_id, SEARCH_ID);
+  const char *user_id = json_o_str(json_o_get(pinfo, "user"), "id");
+  if (user_id == NULL) {
+    user_id = json_o_str(pinfo, "user_id");
+  }
+
+  user_info *uinfo = get_user(dd, user_id, server_id, SEARCH_ID);
 
   if (uinfo == NULL) {
     return;
@@ -138,7 +173,11 @@ static void discord_handle_user(struct im_connection *ic, json_value *uinfo,
   char *name = discord_canonize_name(json_o_str(uinfo, "username"));
 
   if (action == ACTION_CREATE) {
-    if (name) {
+    user_info *known = get_user(dd, id, server_id, SEARCH_ID);
+
+    if (known != NULL) {
+      known->stale = FALSE;
+    } else if (name) {
       guint32 flags = 0;
       user_info *ui = NULL;
       bee_user_t *bu = bee_user_by_handle(ic->bee, ic, name);
@@ -198,7 +237,10 @@ static void discord_handle_relationship(struct im_connection *ic, json_value *ri
   json_value *tjs = json_o_get(rinfo, "type");
 
   if (action == ACTION_CREATE) {
-    uinfo = json_o_get(rinfo, "user");
+    uinfo = discord_ready_user(dd, json_o_get(rinfo, "user"));
+    if (uinfo == NULL) {
+      uinfo = discord_ready_user(dd, json_o_get(rinfo, "id"));
+    }
     name = discord_canonize_name(json_o_str(uinfo, "username"));
     bu = bee_user_by_handle(ic->bee, ic, name);
     rtype = (tjs && tjs->type == json_integer) ? tjs->u.integer : 0;
@@ -260,6 +302,66 @@ static void discord_channel_auto_join(struct im_connection *ic,
   }
 }
 
+static void discord_drop_channel(struct im_connection *ic, GSList **clist,
+                                 channel_info *cdata)
+{
+  if (cdata->type == CHANNEL_TEXT) {
+    discord_ws_unsubscribe(ic, cdata);
+    ic->chatlist = g_slist_remove(ic->chatlist, cdata->to.channel.bci);
+  } else if (cdata->type == CHANNEL_GROUP_PRIVATE) {
+    ic->chatlist = g_slist_remove(ic->chatlist, cdata->to.group.bci);
+  }
+
+  *clist = g_slist_remove(*clist, cdata);
+  free_channel_info(cdata);
+}
+
+/* Brings a channel we already know up to date with what READY says about it
+ * after a re-IDENTIFY. */
+static void discord_refresh_channel(struct im_connection *ic,
+                                    channel_info *cdata, json_value *cinfo)
+{
+  discord_data *dd = ic->proto_data;
+  const char *lmid = json_o_str(cinfo, "last_message_id");
+  const char *topic = json_o_str(cinfo, "topic");
+  json_value *rcplist = discord_recipients(cinfo);
+
+  cdata->stale = FALSE;
+  if (lmid != NULL) {
+    cdata->last_msg = g_ascii_strtoull(lmid, NULL, 10);
+  }
+
+  if (rcplist != NULL && rcplist->type == json_array) {
+    if (cdata->type == CHANNEL_GROUP_PRIVATE) {
+      g_slist_free(cdata->to.group.users);
+      cdata->to.group.users = NULL;
+    }
+
+    for (int ridx = 0; ridx < rcplist->u.array.length; ridx++) {
+      json_value *rcp = discord_ready_user(dd, rcplist->u.array.values[ridx]);
+
+      if (rcp == NULL) {
+        continue;
+      }
+      discord_handle_user(ic, rcp, GLOBAL_SERVER_ID, ACTION_CREATE);
+      if (cdata->type == CHANNEL_GROUP_PRIVATE) {
+        user_info *ui = get_user(dd, json_o_str(rcp, "id"), GLOBAL_SERVER_ID,
+                                 SEARCH_ID);
+        cdata->to.group.users = g_slist_prepend(cdata->to.group.users, ui);
+      }
+    }
+  }
+
+  if (cdata->type == CHANNEL_TEXT && topic != NULL && strlen(topic) > 0 &&
+      g_strcmp0(topic, cdata->to.channel.bci->topic) != 0) {
+    g_free(cdata->to.channel.bci->topic);
+    cdata->to.channel.bci->topic = g_strdup(topic);
+    if (cdata->to.channel.gc != NULL) {
+      imcb_chat_topic(cdata->to.channel.gc, "root", (char*)topic, 0);
+    }
+  }
+}
+
 void discord_handle_channel(struct im_connection *ic, json_value *cinfo,
                             const char *server_id, handler_action action)
 {
@@ -284,6 +386,13 @@ void discord_handle_channel(struct im_connection *ic, json_value *cinfo,
   }
 
   if (action == ACTION_CREATE) {
+    channel_info *known = get_channel(dd, id, server_id, SEARCH_ID);
+
+    if (known != NULL) {
+      discord_refresh_channel(ic, known, cinfo);
+      return;
+    }
+
     switch(ctype) {
       case CHANNEL_PRIVATE:
       {
@@ -293,9 +402,13 @@ void discord_handle_channel(struct im_connection *ic, json_value *cinfo,
           ci->last_msg = g_ascii_strtoull(lmid, NULL, 10);
         }
 
-        json_value *rcplist = json_o_get(cinfo, "recipients");
-        if (rcplist != NULL && rcplist->type == json_array) {
-          json_value *rcp = rcplist->u.array.values[0];
+        json_value *rcplist = discord_recipients(cinfo);
+        json_value *rcp = NULL;
+        if (rcplist != NULL && rcplist->type == json_array &&
+            rcplist->u.array.length > 0) {
+          rcp = discord_ready_user(dd, rcplist->u.array.values[0]);
+        }
+        if (rcp != NULL) {
 
           ci->to.handle.name = discord_canonize_name(json_o_str(rcp, "username"));
           ci->id = json_o_strdup(cinfo, "id");
@@ -396,10 +509,15 @@ void discord_handle_channel(struct im_connection *ic, json_value *cinfo,
           ci->last_msg = g_ascii_strtoull(lmid, NULL, 10);
         }
 
-        json_value *rcplist = json_o_get(cinfo, "recipients");
+        json_value *rcplist = discord_recipients(cinfo);
         if (rcplist != NULL && rcplist->type == json_array) {
           for (int ridx = 0; ridx < rcplist->u.array.length; ridx++) {
-            json_value *rcp = rcplist->u.array.values[ridx];
+            json_value *rcp = discord_ready_user(dd,
+                                                rcplist->u.array.values[ridx]);
+
+            if (rcp == NULL) {
+              continue;
+            }
 
             discord_handle_user(ic, rcp, GLOBAL_SERVER_ID, ACTION_CREATE);
 
@@ -445,14 +563,7 @@ void discord_handle_channel(struct im_connection *ic, json_value *cinfo,
         clist = &sinfo->channels;
       }
 
-      if (cdata->type == CHANNEL_TEXT) {
-        ic->chatlist = g_slist_remove(ic->chatlist, cdata->to.channel.bci);
-      } else if (cdata->type == CHANNEL_GROUP_PRIVATE) {
-        ic->chatlist = g_slist_remove(ic->chatlist, cdata->to.group.bci);
-      }
-
-      *clist = g_slist_remove(*clist, cdata);
-      free_channel_info(cdata);
+      discord_drop_channel(ic, clist, cdata);
     } else if (action == ACTION_UPDATE) {
       if (cdata->type == CHANNEL_TEXT && cdata->to.channel.gc != NULL) {
         if (g_strcmp0(topic, cdata->to.channel.gc->topic) != 0) {
@@ -465,7 +576,14 @@ void discord_handle_channel(struct im_connection *ic, json_value *cinfo,
 
 static void discord_add_global_server(struct im_connection *ic) {
   discord_data *dd = ic->proto_data;
-  server_info *sinfo = g_new0(server_info, 1);
+  server_info *sinfo = get_server_by_id(dd, GLOBAL_SERVER_ID);
+
+  if (sinfo != NULL) {
+    sinfo->stale = FALSE;
+    return;
+  }
+
+  sinfo = g_new0(server_info, 1);
 
   sinfo->name = g_strdup("_global");
   sinfo->id = g_strdup(GLOBAL_SERVER_ID);
@@ -473,7 +591,10 @@ static void discord_add_global_server(struct im_connection *ic) {
   dd->servers = g_slist_prepend(dd->servers, sinfo);
 }
 
+/* members and presences override the ones in sinfo, READY may send them
+ * separately (merged_members/merged_presences). */
 static void discord_handle_server(struct im_connection *ic, json_value *sinfo,
+                                  json_value *members, json_value *presences,
                                   handler_action action)
 {
   discord_data *dd = ic->proto_data;
@@ -482,12 +603,17 @@ static void discord_handle_server(struct im_connection *ic, json_value *sinfo,
   const char *name = json_o_str(sinfo, "name");
 
   if (action == ACTION_CREATE) {
-    server_info *sdata = g_new0(server_info, 1);
+    server_info *sdata = get_server_by_id(dd, id);
 
-    sdata->name = g_strdup(name);
-    sdata->id = g_strdup(id);
-    sdata->ic = ic;
-    dd->servers = g_slist_prepend(dd->servers, sdata);
+    if (sdata != NULL) {
+      sdata->stale = FALSE;
+    } else {
+      sdata = g_new0(server_info, 1);
+      sdata->name = g_strdup(name);
+      sdata->id = g_strdup(id);
+      sdata->ic = ic;
+      dd->servers = g_slist_prepend(dd->servers, sdata);
+    }
 
     json_value *channels = json_o_get(sinfo, "channels");
     if (channels != NULL && channels->type == json_array) {
@@ -497,16 +623,23 @@ static void discord_handle_server(struct im_connection *ic, json_value *sinfo,
       }
     }
 
-    json_value *members = json_o_get(sinfo, "members");
+    if (members == NULL) {
+      members = json_o_get(sinfo, "members");
+    }
     if (members != NULL && members->type == json_array) {
       for (int midx = 0; midx < members->u.array.length; midx++) {
-        json_value *uinfo = json_o_get(members->u.array.values[midx],
-                                       "user");
+        json_value *member = members->u.array.values[midx];
+        json_value *uinfo = discord_ready_user(dd, json_o_get(member, "user"));
+        if (uinfo == NULL) {
+          uinfo = discord_ready_user(dd, json_o_get(member, "user_id"));
+        }
         discord_handle_user(ic, uinfo, sdata->id, ACTION_CREATE);
       }
     }
 
-    json_value *presences = json_o_get(sinfo, "presences");
+    if (presences == NULL) {
+      presences = json_o_get(sinfo, "presences");
+    }
     if (presences != NULL && presences->type == json_array) {
       for (int pidx = 0; pidx < presences->u.array.length; pidx++) {
         json_value *pinfo = presences->u.array.values[pidx];
@@ -822,266 +955,877 @@ static void parse_list_update_item(struct im_connection *ic,
   }
 }
 
-gboolean discord_parse_message(struct im_connection *ic, gchar *buf, guint64 size)
+/* A READY after a re-IDENTIFY is applied on top of what we already have:
+ * everything is marked stale first, whatever READY mentions is refreshed,
+ * and only what it doesn't mention any more gets dropped. */
+static void discord_mark_stale(discord_data *dd)
 {
-  discord_data *dd = ic->proto_data;
-  json_value *js = json_parse((gchar*)buf, size);
-  gboolean disconnected = FALSE;
+  for (GSList *sl = dd->servers; sl; sl = g_slist_next(sl)) {
+    server_info *sinfo = sl->data;
 
-  discord_debug("<<< (%s) %s %"G_GUINT64_FORMAT"\n%s\n", dd->uname, __func__, size, buf);
+    /* Servers of the other shards aren't in this READY. */
+    if (dd->shard_count > 1 &&
+        (g_ascii_strtoull(sinfo->id, NULL, 10) >> 22) % dd->shard_count != 0) {
+      continue;
+    }
 
-  if (!js || js->type != json_object) {
-    imcb_error(ic, "Failed to parse json reply (%s)", __func__);
-    imc_logout(ic, TRUE);
-    disconnected = TRUE;
-    goto exit;
+    sinfo->stale = TRUE;
+    for (GSList *cl = sinfo->channels; cl; cl = g_slist_next(cl)) {
+      ((channel_info*)cl->data)->stale = TRUE;
+    }
+    for (GSList *ul = sinfo->users; ul; ul = g_slist_next(ul)) {
+      ((user_info*)ul->data)->stale = TRUE;
+    }
   }
 
-  const char *event = json_o_str(js, "t");
-  gint op = 0;
-  json_value *jsop = json_o_get(js, "op");
-  if (jsop != NULL && jsop->type == json_integer) {
-    op = jsop->u.integer;
+  for (GSList *cl = dd->pchannels; cl; cl = g_slist_next(cl)) {
+    ((channel_info*)cl->data)->stale = TRUE;
   }
-  json_value *seq = json_o_get(js, "s");
-  if (seq != NULL && seq->type == json_integer) {
-    dd->seq = seq->u.integer;
+}
+
+static void discord_drop_user(struct im_connection *ic, server_info *sinfo,
+                              user_info *uinfo)
+{
+  discord_data *dd = ic->proto_data;
+
+  sinfo->users = g_slist_remove(sinfo->users, uinfo);
+  for (GSList *cl = dd->pchannels; cl; cl = g_slist_next(cl)) {
+    channel_info *cinfo = cl->data;
+    if (cinfo->type == CHANNEL_GROUP_PRIVATE) {
+      cinfo->to.group.users = g_slist_remove(cinfo->to.group.users, uinfo);
+    }
   }
 
-  if (op == OPCODE_HELLO) {
-    json_value *data = json_o_get(js, "d");
-    json_value *hbeat = json_o_get(data, "heartbeat_interval");
-    if (hbeat != NULL && hbeat->type == json_integer) {
-      dd->keepalive_interval = hbeat->u.integer;
-      if (dd->keepalive_interval == 0) {
-        dd->keepalive_interval = DEFAULT_KEEPALIVE_INTERVAL;
-      }
+  if (get_user(dd, uinfo->name, NULL, SEARCH_NAME) == NULL) {
+    imcb_remove_buddy(ic, uinfo->name, NULL);
+  }
+  free_user_info(uinfo);
+}
+
+static void discord_sweep_stale(struct im_connection *ic)
+{
+  discord_data *dd = ic->proto_data;
+  GSList *next;
+
+  for (GSList *cl = dd->pchannels; cl; cl = next) {
+    channel_info *cinfo = cl->data;
+    next = g_slist_next(cl);
+    if (cinfo->stale) {
+      discord_drop_channel(ic, &dd->pchannels, cinfo);
     }
+  }
 
-    dd->keepalive_loop_id = b_timeout_add(dd->keepalive_interval,
-                                          discord_ws_keepalive_loop, ic);
-  } else if (op == OPCODE_HEARTBEAT) {
-    discord_ws_keepalive_loop(ic, 0, 0);
-  } else if (op == OPCODE_HEARTBEAT_ACK) {
-    if (dd->heartbeat_timeout_id > 0) {
-      b_event_remove(dd->heartbeat_timeout_id);
-      dd->heartbeat_timeout_id = 0;
+  for (GSList *sl = dd->servers; sl; sl = next) {
+    server_info *sinfo = sl->data;
+    next = g_slist_next(sl);
+
+    for (GSList *cl = sinfo->channels, *cnext; cl; cl = cnext) {
+      channel_info *cinfo = cl->data;
+      cnext = g_slist_next(cl);
+      if (!cinfo->stale) {
+        continue;
+      }
+      for (GSList *ul = sinfo->users; ul; ul = g_slist_next(ul)) {
+        user_info *uinfo = ul->data;
+        if (uinfo->voice_channel == cinfo) {
+          uinfo->voice_channel = NULL;
+        }
+      }
+      discord_drop_channel(ic, &sinfo->channels, cinfo);
     }
-  } else if (op == OPCODE_RECONNECT) {
-    if (set_getbool(&ic->acc->set, "verbose")) {
-      imcb_log(ic, "Reconnect requested");
+
+    /* READY doesn't list every member of a server, only the ones from
+       servers we left and from DMs/friends are known to be gone. */
+    for (GSList *ul = sinfo->users, *unext; ul; ul = unext) {
+      user_info *uinfo = ul->data;
+      unext = g_slist_next(ul);
+      if (uinfo->stale && (sinfo->stale ||
+                           g_strcmp0(sinfo->id, GLOBAL_SERVER_ID) == 0)) {
+        discord_drop_user(ic, sinfo, uinfo);
+      }
     }
-    discord_soft_reconnect(ic);
-  } else if (op == OPCODE_INVALID_SESSION) {
-    imcb_error(ic, "Invalid session, reconnecting");
-    imc_logout(ic, TRUE);
-    disconnected = TRUE;
-  } else if (g_strcmp0(event, "READY") == 0) {
-    dd->state = WS_ALMOST_READY;
-    json_value *data = json_o_get(js, "d");
 
-    if (data == NULL || data->type != json_object) {
-      goto exit;
+    if (sinfo->stale) {
+      dd->servers = g_slist_remove(dd->servers, sinfo);
+      free_server_info(sinfo);
     }
+  }
+}
+
+/* The part of READY everything else in it depends on. When READY is
+ * streamed this runs as soon as the first server, private channel or
+ * relationship can be handled, see discord_stream_item(). */
+static void discord_ready_start(struct im_connection *ic, json_value *user,
+                                json_value *users)
+{
+  discord_data *dd = ic->proto_data;
 
-    json_value *user = json_o_get(data, "user");
-    if (user != NULL && user->type == json_object) {
-      dd->id = json_o_strdup(user, "id");
-      dd->uname = discord_canonize_name(json_o_str(user, "username"));
+  dd->state = WS_ALMOST_READY;
+  dd->ready_started = TRUE;
+  dd->ready_resync = dd->servers != NULL;
+  if (dd->ready_resync) {
+    discord_mark_stale(dd);
+  }
+
+  if (user != NULL && user->type == json_object) {
+    g_free(dd->id);
+    g_free(dd->uname);
+    dd->id = json_o_strdup(user, "id");
+    dd->uname = discord_canonize_name(json_o_str(user, "username"));
+  }
+
+  if (users != NULL && users->type == json_array) {
+    dd->ready_users = g_hash_table_new(g_str_hash, g_str_equal);
+    for (int uidx = 0; uidx < users->u.array.length; uidx++) {
+      json_value *uinfo = users->u.array.values[uidx];
+      const char *uid = json_o_str(uinfo, "id");
+      if (uid != NULL) {
+        g_hash_table_insert(dd->ready_users, (gpointer)uid, uinfo);
+      }
     }
-    dd->session_id = json_o_strdup(data, "session_id");
-
-    discord_add_global_server(ic);
-    json_value *guilds = json_o_get(data, "guilds");
-    if (guilds != NULL && guilds->type == json_array &&
-        guilds->u.array.length > 0) {
-      for (int gidx = 0; gidx < guilds->u.array.length; gidx++) {
-        if (guilds->u.array.values[gidx]->type == json_object) {
-          json_value *ginfo = guilds->u.array.values[gidx];
-          discord_handle_server(ic, ginfo, ACTION_CREATE);
-        }
+  }
+
+  discord_add_global_server(ic);
+}
+
+static void discord_ready_guild(struct im_connection *ic, json_value *data,
+                                guint gidx, json_value *ginfo)
+{
+  discord_data *dd = ic->proto_data;
+  json_value *unavailable = json_o_get(ginfo, "unavailable");
+  json_value *mmembers = json_o_get(data, "merged_members");
+  json_value *mpresences = json_o_get(json_o_get(data, "merged_presences"),
+                                      "guilds");
+  json_value *members = NULL;
+  json_value *presences = NULL;
+
+  /* Bots only get ids here, the rest comes with GUILD_CREATE which
+     also refreshes what we already know. */
+  if (unavailable != NULL && unavailable->type == json_boolean &&
+      unavailable->u.boolean) {
+    server_info *sdata = get_server_by_id(dd, json_o_str(ginfo, "id"));
+    if (sdata != NULL) {
+      sdata->stale = FALSE;
+      for (GSList *cl = sdata->channels; cl; cl = g_slist_next(cl)) {
+        ((channel_info*)cl->data)->stale = FALSE;
       }
     }
+    return;
+  }
+  if (ginfo->type != json_object) {
+    return;
+  }
 
-    json_value *pcs = json_o_get(data, "private_channels");
-    if (pcs != NULL && pcs->type == json_array) {
-      for (int pcidx = 0; pcidx < pcs->u.array.length; pcidx++) {
-        if (pcs->u.array.values[pcidx]->type == json_object) {
-          json_value *pcinfo = pcs->u.array.values[pcidx];
-          discord_handle_channel(ic, pcinfo, NULL, ACTION_CREATE);
-        }
+  if (mmembers != NULL && mmembers->type == json_array &&
+      gidx < mmembers->u.array.length) {
+    members = mmembers->u.array.values[gidx];
+  }
+  if (mpresences != NULL && mpresences->type == json_array &&
+      gidx < mpresences->u.array.length) {
+    presences = mpresences->u.array.values[gidx];
+  }
+  discord_handle_server(ic, ginfo, members, presences, ACTION_CREATE);
+}
+
+/* Drops what the READY (or what stood in for it) didn't mention and lets
+ * everything that waited for it go. */
+static void discord_ready_finish(struct im_connection *ic)
+{
+  discord_data *dd = ic->proto_data;
+
+  if (dd->ready_users != NULL) {
+    g_hash_table_destroy(dd->ready_users);
+    dd->ready_users = NULL;
+  }
+
+  if (dd->ready_resync) {
+    discord_sweep_stale(ic);
+  }
+
+  dd->ready_started = FALSE;
+  dd->state = WS_READY;
+  discord_ws_queue_flush(ic);
+  discord_ws_resubscribe(ic, TRUE);
+  discord_reconnect_done(ic);
+  imcb_connected(ic);
+}
+
+static void discord_event_ready(struct im_connection *ic, discord_ws *ws,
+                                json_value *data)
+{
+  discord_data *dd = ic->proto_data;
+
+  dd->state = WS_ALMOST_READY;
+  if (data == NULL || data->type != json_object) {
+    return;
+  }
+
+  if (!dd->ready_started) {
+    discord_ready_start(ic, json_o_get(data, "user"),
+                        json_o_get(data, "users"));
+  }
+
+  dd->restoring = FALSE;
+  g_free(dd->session_id);
+  dd->session_id = json_o_strdup(data, "session_id");
+  free_gw_data(dd->resume_gateway);
+  dd->resume_gateway = discord_parse_gateway_url(ic,
+                         json_o_str(data, "resume_gateway_url"));
+
+  json_value *guilds = json_o_get(data, "guilds");
+  if (guilds != NULL && guilds->type == json_array) {
+    for (int gidx = 0; gidx < guilds->u.array.length; gidx++) {
+      discord_ready_guild(ic, data, gidx, guilds->u.array.values[gidx]);
+    }
+  }
+
+  json_value *pcs = json_o_get(data, "private_channels");
+  if (pcs != NULL && pcs->type == json_array) {
+    for (int pcidx = 0; pcidx < pcs->u.array.length; pcidx++) {
+      if (pcs->u.array.values[pcidx]->type == json_object) {
+        json_value *pcinfo = pcs->u.array.values[pcidx];
+        discord_handle_channel(ic, pcinfo, NULL, ACTION_CREATE);
       }
     }
+  }
 
-    json_value *rels = json_o_get(data, "relationships");
-    if (rels != NULL && rels->type == json_array) {
-      for (int relidx = 0; relidx < rels->u.array.length; relidx++) {
-        if (rels->u.array.values[relidx]->type == json_object) {
-          json_value *rinfo = rels->u.array.values[relidx];
-          discord_handle_relationship(ic, rinfo, ACTION_CREATE);
-        }
+  json_value *rels = json_o_get(data, "relationships");
+  if (rels != NULL && rels->type == json_array) {
+    for (int relidx = 0; relidx < rels->u.array.length; relidx++) {
+      if (rels->u.array.values[relidx]->type == json_object) {
+        json_value *rinfo = rels->u.array.values[relidx];
+        discord_handle_relationship(ic, rinfo, ACTION_CREATE);
       }
     }
+  }
 
-    if (set_getint(&ic->acc->set, "max_backlog") > 0) {
-      json_value *rs = json_o_get(data, "read_state");
-      if (rs != NULL && rs->type == json_array) {
-        for (int rsidx = 0; rsidx < rs->u.array.length; rsidx++) {
-          if (rs->u.array.values[rsidx]->type == json_object) {
-            json_value *rsinfo = rs->u.array.values[rsidx];
-
-            const char *channel_id = json_o_str(rsinfo, "id");
-            const char *lmsg = json_o_str(rsinfo, "last_message_id");
-            guint64 lm = 0;
-            if (lmsg != NULL) {
-              lm = g_ascii_strtoull(lmsg, NULL, 10);
-            }
-            channel_info *cinfo = get_channel(dd, channel_id, NULL, SEARCH_ID);
-            if (cinfo != NULL) {
-              cinfo->last_read = lm;
-            }
+  if (set_getint(&ic->acc->set, "max_backlog") > 0) {
+    json_value *rs = json_o_get(data, "read_state");
+    if (rs != NULL && rs->type == json_array) {
+      for (int rsidx = 0; rsidx < rs->u.array.length; rsidx++) {
+        if (rs->u.array.values[rsidx]->type == json_object) {
+          json_value *rsinfo = rs->u.array.values[rsidx];
+
+          const char *channel_id = json_o_str(rsinfo, "id");
+          const char *lmsg = json_o_str(rsinfo, "last_message_id");
+          guint64 lm = 0;
+          if (lmsg != NULL) {
+            lm = g_ascii_strtoull(lmsg, NULL, 10);
+          }
+          channel_info *cinfo = get_channel(dd, channel_id, NULL, SEARCH_ID);
+          if (cinfo != NULL) {
+            cinfo->last_read = lm;
           }
         }
       }
     }
+  }
 
-    dd->state = WS_READY;
-    imcb_connected(ic);
+  discord_ready_finish(ic);
+  discord_save_session(ic);
+  if (ws != NULL) {
+    discord_ws_shards_start(ic);
+  }
+}
 
-  } else if (g_strcmp0(event, "GUILD_SYNC") == 0) {
-    json_value *data = json_o_get(js, "d");
-    const char *id   = json_o_str(data, "id");
+static void discord_event_resumed(struct im_connection *ic, discord_ws *ws,
+                                  json_value *data)
+{
+  discord_data *dd = ic->proto_data;
 
-    json_value *members = json_o_get(data, "members");
-    if (members != NULL && members->type == json_array) {
-      for (int midx = 0; midx < members->u.array.length; midx++) {
-        json_value *uinfo = json_o_get(members->u.array.values[midx],
-                                       "user");
-        discord_handle_user(ic, uinfo, id, ACTION_CREATE);
-      }
+  if (dd->resume_start > 0) {
+    gint64 elapsed = g_get_monotonic_time() - dd->resume_start;
+
+    dd->stats.resumes++;
+    dd->stats.resume_us_last = elapsed;
+    dd->stats.resume_us_total += elapsed;
+    dd->resume_start = 0;
+    if (set_getbool(&ic->acc->set, "verbose")) {
+      imcb_log(ic, "Resumed in %"G_GINT64_FORMAT" ms", elapsed / 1000);
     }
+  }
+  dd->reconnecting = FALSE;
+  if (dd->restoring) {
+    /* Nothing to resume into yet, see discord_restore_start(). */
+    dd->state = WS_ALMOST_READY;
+    discord_http_restore(ic);
+    return;
+  }
+  dd->state = WS_READY;
+  if (ws != NULL && ws == dd->ws_next) {
+    discord_ws_handover_complete(dd);
+  }
+  discord_ws_queue_flush(ic);
+  discord_ws_resubscribe(ic, FALSE);
+  discord_reconnect_done(ic);
+  if (ws != NULL) {
+    discord_ws_shards_start(ic);
+  }
+}
 
-    json_value *presences = json_o_get(data, "presences");
-    if (presences != NULL && presences->type == json_array) {
-      for (int pidx = 0; pidx < presences->u.array.length; pidx++) {
-        json_value *pinfo = presences->u.array.values[pidx];
-        discord_handle_presence(ic, pinfo, id);
-      }
+/* A session restored from the resume_state setting RESUMEs without a READY
+ * to build servers, channels and users from. The REST replies
+ * discord_http_restore() asks for stand in for it: each one is handled like
+ * its part of READY, between the same stale marking and sweeping a READY
+ * after a re-IDENTIFY gets. */
+void discord_restore_start(struct im_connection *ic, json_value *user)
+{
+  discord_ready_start(ic, user, NULL);
+}
+
+void discord_restore_server(struct im_connection *ic, json_value *sinfo)
+{
+  discord_handle_server(ic, sinfo, NULL, NULL, ACTION_CREATE);
+}
+
+void discord_restore_relationship(struct im_connection *ic,
+                                  json_value *rinfo)
+{
+  discord_handle_relationship(ic, rinfo, ACTION_CREATE);
+}
+
+void discord_restore_done(struct im_connection *ic)
+{
+  discord_data *dd = ic->proto_data;
+
+  dd->restoring = FALSE;
+  discord_ready_finish(ic);
+  discord_save_session(ic);
+}
+
+/* Gives up on the restored session and starts a new one on the same
+ * connection. Whatever was restored so far is kept and refreshed by the
+ * READY like after any other re-IDENTIFY. */
+void discord_restore_abort(struct im_connection *ic)
+{
+  discord_data *dd = ic->proto_data;
+
+  imcb_log(ic, "Failed to restore the session, starting a new one");
+  dd->restoring = FALSE;
+  dd->ready_started = FALSE;
+  discord_ws_reidentify(dd->ws);
+}
+
+static void discord_event_guild_sync(struct im_connection *ic, discord_ws *ws,
+                                     json_value *data)
+{
+  const char *id   = json_o_str(data, "id");
+
+  json_value *members = json_o_get(data, "members");
+  if (members != NULL && members->type == json_array) {
+    for (int midx = 0; midx < members->u.array.length; midx++) {
+      json_value *uinfo = json_o_get(members->u.array.values[midx],
+                                     "user");
+      discord_handle_user(ic, uinfo, id, ACTION_CREATE);
     }
-  } else if (g_strcmp0(event, "GUILD_MEMBER_LIST_UPDATE") == 0) {
-    json_value *data = json_o_get(js, "d");
-    json_value *ops = json_o_get(data, "ops");
-    const char *guild_id = json_o_str(data, "guild_id");
-
-    if (ops != NULL && ops->type == json_array) {
-      for (int oidx = 0; oidx < ops->u.array.length; oidx++) {
-        const char *op = json_o_str(ops->u.array.values[oidx], "op");
-
-        if (g_strcmp0(op, "SYNC") == 0) {
-          json_value *items = json_o_get(ops->u.array.values[oidx], "items");
-          if (items != NULL && items->type == json_array) {
-            for (int iidx = 0; iidx < items->u.array.length; iidx++) {
-              json_value *item = items->u.array.values[iidx];
-              if (item != NULL && json_o_get(item, "member") != NULL) {
-                parse_list_update_item(ic, guild_id, op, item);
-              }
+  }
+
+  json_value *presences = json_o_get(data, "presences");
+  if (presences != NULL && presences->type == json_array) {
+    for (int pidx = 0; pidx < presences->u.array.length; pidx++) {
+      json_value *pinfo = presences->u.array.values[pidx];
+      discord_handle_presence(ic, pinfo, id);
+    }
+  }
+}
+
+static void discord_event_guild_member_list_update(struct im_connection *ic,
+                                                   discord_ws *ws,
+                                                   json_value *data)
+{
+  json_value *ops = json_o_get(data, "ops");
+  const char *guild_id = json_o_str(data, "guild_id");
+
+  if (ops != NULL && ops->type == json_array) {
+    for (int oidx = 0; oidx < ops->u.array.length; oidx++) {
+      const char *op = json_o_str(ops->u.array.values[oidx], "op");
+
+      if (g_strcmp0(op, "SYNC") == 0) {
+        json_value *items = json_o_get(ops->u.array.values[oidx], "items");
+        json_value *range = json_o_get(ops->u.array.values[oidx], "range");
+        if (items != NULL && items->type == json_array) {
+          /* Group headers take up rows of the range as well, only members
+             tell whether the page was full. */
+          guint members = 0;
+
+          for (int iidx = 0; iidx < items->u.array.length; iidx++) {
+            json_value *item = items->u.array.values[iidx];
+            if (item != NULL && json_o_get(item, "member") != NULL) {
+              parse_list_update_item(ic, guild_id, op, item);
+              members++;
             }
           }
-        } else {
-          json_value *item = json_o_get(ops->u.array.values[oidx], "item");
-          if (item != NULL && json_o_get(item, "member") != NULL) {
-            parse_list_update_item(ic, guild_id, op, item);
+
+          if (range != NULL && range->type == json_array &&
+              range->u.array.length == 2 &&
+              range->u.array.values[0]->type == json_integer &&
+              range->u.array.values[1]->type == json_integer) {
+            discord_ws_subscriptions_page(ic, guild_id,
+                range->u.array.values[0]->u.integer,
+                range->u.array.values[1]->u.integer, members);
           }
         }
+      } else {
+        json_value *item = json_o_get(ops->u.array.values[oidx], "item");
+        if (item != NULL && json_o_get(item, "member") != NULL) {
+          parse_list_update_item(ic, guild_id, op, item);
+        }
       }
     }
-  } else if (g_strcmp0(event, "VOICE_STATE_UPDATE") == 0) {
-    json_value *vsinfo = json_o_get(js, "d");
-    discord_handle_voice_state(ic, vsinfo, json_o_str(vsinfo, "guild_id"));
-  } else if (g_strcmp0(event, "PRESENCE_UPDATE") == 0) {
-    json_value *pinfo = json_o_get(js, "d");
-    discord_handle_presence(ic, pinfo, json_o_str(pinfo, "guild_id"));
-  } else if (g_strcmp0(event, "CHANNEL_CREATE") == 0) {
-    json_value *cinfo = json_o_get(js, "d");
-    discord_handle_channel(ic, cinfo, json_o_str(cinfo, "guild_id"),
-                           ACTION_CREATE);
-  } else if (g_strcmp0(event, "CHANNEL_DELETE") == 0) {
-    json_value *cinfo = json_o_get(js, "d");
-    discord_handle_channel(ic, cinfo, json_o_str(cinfo, "guild_id"),
-                           ACTION_DELETE);
-  } else if (g_strcmp0(event, "CHANNEL_UPDATE") == 0) {
-    json_value *cinfo = json_o_get(js, "d");
-    discord_handle_channel(ic, cinfo, json_o_str(cinfo, "guild_id"),
-                           ACTION_UPDATE);
-  } else if (g_strcmp0(event, "GUILD_MEMBER_ADD") == 0) {
-    json_value *data = json_o_get(js, "d");
-    discord_handle_user(ic, json_o_get(data, "user"),
-                        json_o_str(data, "guild_id"), ACTION_CREATE);
-  } else if (g_strcmp0(event, "GUILD_MEMBER_REMOVE") == 0) {
+  }
+}
+
+static void discord_event_voice_state_update(struct im_connection *ic,
+                                             discord_ws *ws,
+                                             json_value *data)
+{
+  discord_handle_voice_state(ic, data, json_o_str(data, "guild_id"));
+}
+
+static void discord_event_presence_update(struct im_connection *ic,
+                                          discord_ws *ws,
+                                          json_value *data)
+{
+  discord_handle_presence(ic, data, json_o_str(data, "guild_id"));
+}
+
+static void discord_event_channel_create(struct im_connection *ic,
+                                         discord_ws *ws,
+                                         json_value *data)
+{
+  discord_handle_channel(ic, data, json_o_str(data, "guild_id"),
+                         ACTION_CREATE);
+}
+
+static void discord_event_channel_delete(struct im_connection *ic,
+                                         discord_ws *ws,
+                                         json_value *data)
+{
+  discord_handle_channel(ic, data, json_o_str(data, "guild_id"),
+                         ACTION_DELETE);
+}
+
+static void discord_event_channel_update(struct im_connection *ic,
+                                         discord_ws *ws,
+                                         json_value *data)
+{
+  discord_handle_channel(ic, data, json_o_str(data, "guild_id"),
+                         ACTION_UPDATE);
+}
+
+static void discord_event_guild_member_add(struct im_connection *ic,
+                                           discord_ws *ws,
+                                           json_value *data)
+{
+  discord_handle_user(ic, json_o_get(data, "user"),
+                      json_o_str(data, "guild_id"), ACTION_CREATE);
+}
+
+static void discord_event_guild_member_remove(struct im_connection *ic,
+                                              discord_ws *ws,
+                                              json_value *data)
+{
+  discord_handle_user(ic, json_o_get(data, "user"),
+                      json_o_str(data, "guild_id"), ACTION_DELETE);
+}
+
+static void discord_event_guild_create(struct im_connection *ic, discord_ws *ws,
+                                       json_value *data)
+{
+  discord_handle_server(ic, data, NULL, NULL, ACTION_CREATE);
+}
+
+static void discord_event_guild_delete(struct im_connection *ic, discord_ws *ws,
+                                       json_value *data)
+{
+  discord_handle_server(ic, data, NULL, NULL, ACTION_DELETE);
+}
+
+static void discord_event_message_create(struct im_connection *ic,
+                                         discord_ws *ws,
+                                         json_value *data)
+{
+  discord_handle_message(ic, data, ACTION_CREATE, FALSE);
+}
+
+static void discord_event_message_update(struct im_connection *ic,
+                                         discord_ws *ws,
+                                         json_value *data)
+{
+  discord_handle_message(ic, data, ACTION_UPDATE, TRUE);
+}
+
+static void discord_event_relationship_add(struct im_connection *ic,
+                                           discord_ws *ws,
+                                           json_value *data)
+{
+  discord_handle_relationship(ic, data, ACTION_CREATE);
+}
+
+static void discord_event_relationship_remove(struct im_connection *ic,
+                                              discord_ws *ws,
+                                              json_value *data)
+{
+  discord_handle_relationship(ic, data, ACTION_DELETE);
+}
+
+typedef void (*discord_event_func)(struct im_connection *ic, discord_ws *ws,
+                                   json_value *data);
+
+typedef enum {
+  /* Nothing is done with it. JSON payloads are dropped before they are
+     parsed, see discord_skip_ignored(). */
+  EVENT_IGNORED = 1 << 0,
+  /* Refers to what READY set up, anything arriving before it is dropped. */
+  EVENT_NEEDS_READY = 1 << 1,
+} discord_event_flags;
+
+typedef struct {
+  const char         *name;
+  discord_event_func func;
+  guint              flags;
+} discord_event;
+
+/* Every dispatch we know about, new ones go here. Anything else ends up in
+ * the debug output as unhandled. */
+static const discord_event discord_events[] = {
+  {"READY", discord_event_ready, 0},
+  {"RESUMED", discord_event_resumed, 0},
+  {"MESSAGE_CREATE", discord_event_message_create, EVENT_NEEDS_READY},
+  {"MESSAGE_UPDATE", discord_event_message_update, EVENT_NEEDS_READY},
+  {"PRESENCE_UPDATE", discord_event_presence_update, EVENT_NEEDS_READY},
+  {"GUILD_MEMBER_LIST_UPDATE", discord_event_guild_member_list_update,
+   EVENT_NEEDS_READY},
+  {"GUILD_SYNC", discord_event_guild_sync, EVENT_NEEDS_READY},
+  {"VOICE_STATE_UPDATE", discord_event_voice_state_update, EVENT_NEEDS_READY},
+  {"CHANNEL_CREATE", discord_event_channel_create, EVENT_NEEDS_READY},
+  {"CHANNEL_UPDATE", discord_event_channel_update, EVENT_NEEDS_READY},
+  {"CHANNEL_DELETE", discord_event_channel_delete, EVENT_NEEDS_READY},
+  {"GUILD_CREATE", discord_event_guild_create, EVENT_NEEDS_READY},
+  {"GUILD_DELETE", discord_event_guild_delete, EVENT_NEEDS_READY},
+  {"GUILD_MEMBER_ADD", discord_event_guild_member_add, EVENT_NEEDS_READY},
+  {"GUILD_MEMBER_REMOVE", discord_event_guild_member_remove, EVENT_NEEDS_READY},
+  {"RELATIONSHIP_ADD", discord_event_relationship_add, EVENT_NEEDS_READY},
+  {"RELATIONSHIP_REMOVE", discord_event_relationship_remove, EVENT_NEEDS_READY},
+  {"TYPING_START", NULL, EVENT_IGNORED},
+  {"USER_UPDATE", NULL, EVENT_IGNORED},
+  {"USER_SETTINGS_UPDATE", NULL, EVENT_IGNORED},
+  {"MESSAGE_ACK", NULL, EVENT_IGNORED},
+  {"MESSAGE_DELETE", NULL, EVENT_IGNORED},
+  {"MESSAGE_REACTION_ADD", NULL, EVENT_IGNORED},
+  {"MESSAGE_REACTION_REMOVE", NULL, EVENT_IGNORED},
+  {"MESSAGE_REACTION_REMOVE_ALL", NULL, EVENT_IGNORED},
+  {"MESSAGE_REACTION_REMOVE_EMOJI", NULL, EVENT_IGNORED},
+  {"GUILD_MEMBER_UPDATE", NULL, EVENT_IGNORED},
+  {"GUILD_ROLE_DELETE", NULL, EVENT_IGNORED},
+  {"GUILD_ROLE_CREATE", NULL, EVENT_IGNORED},
+  {"GUILD_ROLE_UPDATE", NULL, EVENT_IGNORED},
+  {"GUILD_BAN_ADD", NULL, EVENT_IGNORED},
+  {"GUILD_BAN_REMOVE", NULL, EVENT_IGNORED},
+  {"GUILD_EMOJIS_UPDATE", NULL, EVENT_IGNORED},
+  {"GUILD_INTEGRATIONS_UPDATE", NULL, EVENT_IGNORED},
+  {"WEBHOOKS_UPDATE", NULL, EVENT_IGNORED},
+  {"PRESENCES_REPLACE", NULL, EVENT_IGNORED},
+  {"CHANNEL_PINS_ACK", NULL, EVENT_IGNORED},
+  {"CHANNEL_PINS_UPDATE", NULL, EVENT_IGNORED},
+};
+
+static const discord_event *discord_event_lookup(const char *name)
+{
+  static GHashTable *events = NULL;
+
+  if (events == NULL) {
+    events = g_hash_table_new(g_str_hash, g_str_equal);
+    for (int i = 0; i < G_N_ELEMENTS(discord_events); i++) {
+      g_hash_table_insert(events, (gpointer)discord_events[i].name,
+                          (gpointer)&discord_events[i]);
+    }
+  }
+  return name != NULL ? g_hash_table_lookup(events, name) : NULL;
+}
+
+static gboolean discord_event_ignored(const char *event)
+{
+  const discord_event *ev = discord_event_lookup(event);
+
+  return ev != NULL && (ev->flags & EVENT_IGNORED);
+}
+
+static discord_event_stats *discord_event_count(discord_data *dd,
+                                                discord_ws *ws,
+                                                const char *event,
+                                                guint64 size)
+{
+  discord_event_stats *es = g_hash_table_lookup(dd->event_stats, event);
+
+  if (es == NULL) {
+    gchar *name = g_strdup(event);
+    es = g_new0(discord_event_stats, 1);
+    es->name = name;
+    g_hash_table_insert(dd->event_stats, name, es);
+  }
+  es->count++;
+  es->bytes += size;
+  dd->stats.dispatches++;
+  if (ws->shard != NULL) {
+    ws->shard->events++;
+  }
+  return es;
+}
+
+/* The only thing an ignored event is good for is its sequence number, which
+ * the envelope has as well. Returns TRUE if the payload was dealt with. */
+static gboolean discord_skip_ignored(discord_data *dd, discord_ws *ws,
+                                     const gchar *buf, guint64 size)
+{
+  gint64 tstart = g_get_monotonic_time();
+  discord_envelope env;
+  discord_event_stats *es;
+  gint64 elapsed;
+
+  if (!discord_json_envelope(buf, size, &env) ||
+      env.op != OPCODE_DISPATCH || !discord_event_ignored(env.t)) {
+    dd->stats.scan_us += g_get_monotonic_time() - tstart;
+    return FALSE;
+  }
+
+  if (env.s >= 0 && !(ws->shard == NULL && dd->ws_next != NULL &&
+                      env.s <= dd->seq)) {
+    *discord_ws_seq(ws) = env.s;
+  }
+
+  elapsed = g_get_monotonic_time() - tstart;
+  dd->stats.scan_us += elapsed;
+  dd->stats.skipped_bytes += size;
+  es = discord_event_count(dd, ws, env.t, size);
+  es->skipped++;
+  es->skipped_bytes += size;
+  es->scan_us += elapsed;
+
+  discord_debug("<<< (%s) %s %"G_GUINT64_FORMAT" %s skipped\n", dd->uname,
+                __func__, size, env.t);
+  return TRUE;
+}
+
+/* Applies a dispatch to one account. ws is the connection it came in on, or
+ * NULL for an account following another one's session, see
+ * discord_session_dispatch(). text is the payload for debug output. */
+void discord_handle_event(struct im_connection *ic, discord_ws *ws,
+                          json_value *js, const char *event,
+                          const gchar *text)
+{
+  discord_data *dd = ic->proto_data;
+  const discord_event *ev = discord_event_lookup(event);
+
+  if (ev == NULL) {
+    discord_debug("(%s) %s: unhandled event: %s\n%s\n", dd->uname, __func__,
+                  event, text);
+  } else if ((ev->flags & EVENT_NEEDS_READY) && dd->session_id == NULL) {
+    discord_debug("(%s) %s: %s before READY, dropping it\n", dd->uname,
+                  __func__, event);
+  } else if (ev->func != NULL) {
+    ev->func(ic, ws, json_o_get(js, "d"));
+  }
+}
+
+/* Acts on a decoded gateway message. buf is the payload as received, NULL
+ * if it was streamed. Returns TRUE if it called imc_logout(). */
+static gboolean discord_process_message(struct im_connection *ic,
+                                        discord_ws *ws, json_value *js,
+                                        const gchar *buf, guint64 size)
+{
+  discord_data *dd = ic->proto_data;
+
+  if (!js || js->type != json_object) {
+    imcb_error(ic, "Failed to parse %s reply (%s)", dd->etf ? "etf" : "json",
+               __func__);
+    imc_logout(ic, TRUE);
+    return TRUE;
+  }
+
+  const char *event = json_o_str(js, "t");
+  gint op = 0;
+  json_value *jsop = json_o_get(js, "op");
+  if (jsop != NULL && jsop->type == json_integer) {
+    op = jsop->u.integer;
+  }
+
+  if (event != NULL) {
+    discord_event_count(dd, ws, event, size);
+  }
+  json_value *seq = json_o_get(js, "s");
+  if (seq != NULL && seq->type == json_integer) {
+    if (ws->shard == NULL && dd->ws_next != NULL && op == OPCODE_DISPATCH &&
+        seq->u.integer <= dd->seq) {
+      /* During a handover the new connection replays what the old one may
+         have delivered already. */
+      discord_debug("=== (%s) %s skipping replayed event %"G_GINT64_FORMAT"\n",
+                    dd->uname, __func__, (gint64)seq->u.integer);
+      return FALSE;
+    }
+    *discord_ws_seq(ws) = seq->u.integer;
+  }
+
+  if (op == OPCODE_HELLO) {
     json_value *data = json_o_get(js, "d");
-    discord_handle_user(ic, json_o_get(data, "user"),
-                        json_o_str(data, "guild_id"), ACTION_DELETE);
-  } else if (g_strcmp0(event, "GUILD_CREATE") == 0) {
-    json_value *sinfo = json_o_get(js, "d");
-    discord_handle_server(ic, sinfo, ACTION_CREATE);
-  } else if (g_strcmp0(event, "GUILD_DELETE") == 0) {
-    json_value *sinfo = json_o_get(js, "d");
-    discord_handle_server(ic, sinfo, ACTION_DELETE);
-  } else if (g_strcmp0(event, "MESSAGE_CREATE") == 0) {
-    json_value *minfo = json_o_get(js, "d");
-    discord_handle_message(ic, minfo, ACTION_CREATE, FALSE);
-  } else if (g_strcmp0(event, "MESSAGE_UPDATE") == 0) {
-    json_value *minfo = json_o_get(js, "d");
-    discord_handle_message(ic, minfo, ACTION_UPDATE, TRUE);
-  } else if (g_strcmp0(event, "RELATIONSHIP_ADD") == 0) {
-    json_value *rinfo = json_o_get(js, "d");
-    discord_handle_relationship(ic, rinfo, ACTION_CREATE);
-  } else if (g_strcmp0(event, "RELATIONSHIP_REMOVE") == 0) {
-    json_value *rinfo = json_o_get(js, "d");
-    discord_handle_relationship(ic, rinfo, ACTION_DELETE);
-  } else if (g_strcmp0(event, "RESUMED") == 0) {
-    dd->reconnecting = FALSE;
-    dd->state = WS_READY;
-  } else if (g_strcmp0(event, "TYPING_START") == 0) {
-    // Ignoring those for now
-  } else if (g_strcmp0(event, "USER_UPDATE") == 0) {
-    // Ignoring those for now
-  } else if (g_strcmp0(event, "USER_SETTINGS_UPDATE") == 0) {
-    // Ignoring those for now
-  } else if (g_strcmp0(event, "MESSAGE_ACK") == 0) {
-    // Ignoring those for now
-  } else if (g_strcmp0(event, "MESSAGE_DELETE") == 0) {
-    // Ignoring those for now
-  } else if (g_strcmp0(event, "MESSAGE_REACTION_ADD") == 0) {
-    // Ignoring those for now
-  } else if (g_strcmp0(event, "MESSAGE_REACTION_REMOVE") == 0) {
-    // Ignoring those for now
-  } else if (g_strcmp0(event, "GUILD_MEMBER_UPDATE") == 0) {
-    // Ignoring those for now
-  } else if (g_strcmp0(event, "GUILD_ROLE_DELETE") == 0) {
-    // Ignoring those for now
-  } else if (g_strcmp0(event, "GUILD_ROLE_CREATE") == 0) {
-    // Ignoring those for now
-  } else if (g_strcmp0(event, "GUILD_BAN_ADD") == 0) {
-    // Ignoring those for now
-  } else if (g_strcmp0(event, "GUILD_EMOJIS_UPDATE") == 0) {
-    // Ignoring those for now
-  } else if (g_strcmp0(event, "GUILD_INTEGRATIONS_UPDATE") == 0) {
-    // Ignoring those for now
-  } else if (g_strcmp0(event, "WEBHOOKS_UPDATE") == 0) {
-    // Ignoring those for now
-  } else if (g_strcmp0(event, "PRESENCES_REPLACE") == 0) {
-    // Ignoring those for now
-  } else if (g_strcmp0(event, "CHANNEL_PINS_ACK") == 0) {
-    // Ignoring those for now
-  } else if (g_strcmp0(event, "CHANNEL_PINS_UPDATE") == 0) {
-    // Ignoring those for now
+    json_value *hbeat = json_o_get(data, "heartbeat_interval");
+    if (hbeat != NULL && hbeat->type == json_integer) {
+      ws->keepalive_interval = hbeat->u.integer;
+      if (ws->keepalive_interval == 0) {
+        ws->keepalive_interval = DEFAULT_KEEPALIVE_INTERVAL;
+      }
+    }
+
+    ws->keepalive_loop_id = b_timeout_add(ws->keepalive_interval,
+                                          discord_ws_keepalive_loop, ws);
+  } else if (op == OPCODE_HEARTBEAT) {
+    discord_ws_keepalive_loop(ws, 0, 0);
+  } else if (op == OPCODE_HEARTBEAT_ACK) {
+    discord_ws_heartbeat_ack(ws);
+  } else if (op == OPCODE_RECONNECT) {
+    if (set_getbool(&ic->acc->set, "verbose")) {
+      imcb_log(ic, "Reconnect requested");
+    }
+    if (ws->shard != NULL) {
+      discord_ws_shard_reconnect(ws->shard);
+    } else {
+      discord_ws_handover(ic);
+    }
+  } else if (op == OPCODE_INVALID_SESSION) {
+    imcb_log(ic, "Invalid session, starting a new one");
+    discord_ws_reidentify(ws);
+  } else if (ws->shard != NULL && (g_strcmp0(event, "READY") == 0 ||
+                                   g_strcmp0(event, "RESUMED") == 0)) {
+    discord_ws_shard_ready(ws, json_o_get(js, "d"));
+  } else if (event != NULL) {
+    if (buf != NULL) {
+      discord_session_record(dd, ws, event, buf, size);
+    }
+    discord_session_dispatch(dd, js, event);
+    discord_handle_event(ic, ws, js, event,
+                         dd->etf || buf == NULL ? "" : buf);
   } else {
-    discord_debug("(%s) %s: unhandled event: %s\n%s\n", dd->uname, __func__,
-                  event, buf);
+    discord_debug("(%s) %s: unhandled op: %d\n", dd->uname, __func__, op);
   }
 
-exit:
-  json_value_free(js);
+  return FALSE;
+}
+
+gboolean discord_parse_message(struct im_connection *ic, discord_ws *ws,
+                               gchar *buf, guint64 size)
+{
+  discord_data *dd = ic->proto_data;
+  gboolean etf = dd->etf;
+  gboolean indexed = dd->json_indexed;
+  gboolean disconnected;
+
+  if (!etf && discord_skip_ignored(dd, ws, buf, size)) {
+    return FALSE;
+  }
+
+  gint64 tstart = g_get_monotonic_time();
+  json_value *js = etf ? discord_etf_decode(buf, size) :
+                         discord_json_decode(dd, buf, size);
+
+  dd->stats.decode_bytes += size;
+  dd->stats.decode_us += g_get_monotonic_time() - tstart;
+
+  if (etf) {
+    discord_debug("<<< (%s) %s %"G_GUINT64_FORMAT" (etf)\n", dd->uname, __func__, size);
+  } else {
+    discord_debug("<<< (%s) %s %"G_GUINT64_FORMAT"\n%s\n", dd->uname, __func__, size, buf);
+  }
+
+  disconnected = discord_process_message(ic, ws, js, buf, size);
+
+  if (etf) {
+    discord_etf_free(js);
+  } else if (indexed) {
+    discord_json_free(js);
+  } else {
+    json_value_free(js);
+  }
   return disconnected;
 }
+
+/* Finishes a message the streaming parser was fed while it came in. What
+ * discord_stream_item() took care of already is gone from js. */
+gboolean discord_parse_streamed(struct im_connection *ic, discord_ws *ws,
+                                json_value *js, guint64 size)
+{
+  discord_data *dd = ic->proto_data;
+  gboolean disconnected;
+
+  discord_debug("<<< (%s) %s %"G_GUINT64_FORMAT" (streamed)\n", dd->uname,
+                __func__, size);
+
+  disconnected = discord_process_message(ic, ws, js, NULL, size);
+  if (!disconnected && dd->ready_started) {
+    /* Never got to discord_event_ready(). */
+    discord_stream_abort(ic);
+  }
+  discord_json_free(js);
+  return disconnected;
+}
+
+/* Called by the streaming parser for the values near the top of a gateway
+ * message. Servers, private channels and relationships of a READY are
+ * handled right away, as long as what they need from READY came before
+ * them. Returns TRUE if the value was handled and can be dropped. */
+static gboolean discord_stream_item(gpointer data, json_value *root,
+                                    guint depth, const gchar *key,
+                                    guint index, json_value *value)
+{
+  discord_ws *ws = data;
+  struct im_connection *ic = ws->ic;
+  discord_data *dd = ic->proto_data;
+  json_value *d = json_o_get(root, "d");
+  gboolean guild = g_strcmp0(key, "guilds") == 0;
+
+  if (depth != 3 || value->type != json_object ||
+      value->parent->type != json_array || ws != dd->ws ||
+      g_strcmp0(json_o_str(root, "t"), "READY") != 0 ||
+      json_o_get(d, "user") == NULL || json_o_get(d, "users") == NULL) {
+    return FALSE;
+  }
+  if (guild && (json_o_get(d, "merged_members") == NULL ||
+                json_o_get(d, "merged_presences") == NULL)) {
+    return FALSE;
+  }
+  if (!guild && g_strcmp0(key, "private_channels") != 0 &&
+      g_strcmp0(key, "relationships") != 0) {
+    return FALSE;
+  }
+
+  if (!dd->ready_started) {
+    discord_ready_start(ic, json_o_get(d, "user"), json_o_get(d, "users"));
+  }
+  if (guild) {
+    discord_ready_guild(ic, d, index, value);
+  } else if (g_strcmp0(key, "private_channels") == 0) {
+    discord_handle_channel(ic, value, NULL, ACTION_CREATE);
+  } else {
+    discord_handle_relationship(ic, value, ACTION_CREATE);
+  }
+
+  dd->stats.stream_items++;
+  return TRUE;
+}
+
+discord_json_stream *discord_stream_new(discord_ws *ws)
+{
+  /* Elements of the arrays in d are three levels down. */
+  return discord_json_stream_new(3, discord_stream_item, ws);
+}
+
+/* A streamed READY was cut off, the users it referred to are gone. */
+void discord_stream_abort(struct im_connection *ic)
+{
+  discord_data *dd = ic->proto_data;
+
+  if (dd->ready_users != NULL) {
+    g_hash_table_destroy(dd->ready_users);
+    dd->ready_users = NULL;
+  }
+  dd->ready_started = FALSE;
+}
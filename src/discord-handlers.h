@@ -15,6 +15,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "discord.h"
+#include "discord-json.h"
 #include <json.h>
 
 typedef enum {
@@ -27,5 +28,19 @@ void discord_handle_message(struct im_connection *ic, json_value *minfo,
                             handler_action action, gboolean use_tstamp);
 void discord_handle_channel(struct im_connection *ic, json_value *cinfo,
                             const char *server_id, handler_action action);
+void discord_restore_start(struct im_connection *ic, json_value *user);
+void discord_restore_server(struct im_connection *ic, json_value *sinfo);
+void discord_restore_relationship(struct im_connection *ic,
+                                  json_value *rinfo);
+void discord_restore_done(struct im_connection *ic);
+void discord_restore_abort(struct im_connection *ic);
+void discord_handle_event(struct im_connection *ic, discord_ws *ws,
+                          json_value *js, const char *event,
+                          const gchar *text);
 /* Returns TRUE if it called iwc_logout() */
-gboolean discord_parse_message(struct im_connection *ic, gchar *buf, guint64 size);
+gboolean discord_parse_message(struct im_connection *ic, discord_ws *ws,
+                               gchar *buf, guint64 size);
+gboolean discord_parse_streamed(struct im_connection *ic, discord_ws *ws,
+                                json_value *js, guint64 size);
+discord_json_stream *discord_stream_new(discord_ws *ws);
+void discord_stream_abort(struct im_connection *ic);
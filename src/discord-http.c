@@ -22,6 +22,7 @@
 #include "discord.h"
 #include "discord-http.h"
 #include "discord-handlers.h"
+#include "discord-json.h"
 #include "discord-websockets.h"
 #include "discord-util.h"
 
@@ -64,10 +65,10 @@ static void discord_http_get(struct im_connection *ic, const char *api_path,
                   "Host: %s\r\n"
                   "User-Agent: Bitlbee-Discord\r\n"
                   "Content-Type: application/json\r\n"
-                  "authorization: %s\r\n\r\n",
+                  "authorization: %s%s\r\n\r\n",
                   api_path,
                   set_getstr(&ic->acc->set, "host"),
-                  dd->token);
+                  dd->bot ? "Bot " : "", dd->token);
 
   discord_debug(">>> (%s) %s %lu", dd->uname, __func__, request->len);
   _discord_http_get(ic, request->str, cb_func, data);
@@ -144,49 +145,31 @@ static void discord_http_gateway_cb(struct http_request *req)
       json_value_free(js);
       return;
     }
-    discord_data *dd = ic->proto_data;
-
     const char *gw = json_o_str(js, "url");
-    GMatchInfo *match = NULL;
-    GRegex *gwregex = g_regex_new("^(wss?://)?([^/]+)(/.*)?$", 0, 0, NULL);
 
-    g_regex_match(gwregex, gw, 0, &match);
+    free_gw_data(dd->gateway);
+    dd->gateway = discord_parse_gateway_url(ic, gw);
 
-    if (match == NULL) {
+    if (dd->gateway == NULL) {
       imcb_error(ic, "Failed to get gateway (%s).", gw);
       json_value_free(js);
-      g_regex_unref(gwregex);
       imc_logout(ic, TRUE);
       return;
     }
+    set_setstr(&ic->acc->set, "gateway_cache", (char*)gw);
 
-    dd->gateway = g_new0(gw_data, 1);
-
-    gchar *wss = g_match_info_fetch(match, 1);
-    if (g_strcmp0(wss, "wss://") == 0) {
-      dd->gateway->wss = 1;
-    } else {
-      dd->gateway->wss = 0;
-    }
-    g_free(wss);
-
-    dd->gateway->addr = g_match_info_fetch(match, 2);
-    dd->gateway->path = g_match_info_fetch(match, 3);
-
-    if (dd->gateway->path == NULL) {
-      dd->gateway->path = g_strdup("/?encoding=json&v=6");
+    json_value *shards = json_o_get(js, "shards");
+    if (dd->bot && set_getint(&ic->acc->set, "shards") <= 0 &&
+        shards != NULL && shards->type == json_integer) {
+      dd->shard_count = MAX(shards->u.integer, 1);
     }
 
-    g_match_info_free(match);
-    g_regex_unref(gwregex);
-
     if (discord_ws_init(ic, dd) < 0) {
       imcb_error(ic, "Failed to create websockets context.");
       imc_logout(ic, TRUE);
       json_value_free(js);
       return;
     }
-    dd->state = WS_CONNECTING;
 
     json_value_free(js);
   } else {
@@ -201,9 +184,177 @@ void discord_http_get_gateway(struct im_connection *ic, const char *token)
 {
   discord_data *dd = ic->proto_data;
 
-  dd->token = g_strdup(token);
-  set_setstr(&ic->acc->set, "token_cache", dd->token);
-  discord_http_get(ic, "gateway", discord_http_gateway_cb, ic);
+  if (dd->token != token) {
+    g_free(dd->token);
+    dd->token = g_strdup(token);
+  }
+  /* A bot token is the account password already, it isn't written out a
+     second time. */
+  if (!dd->bot) {
+    set_setstr(&ic->acc->set, "token_cache", dd->token);
+  }
+  dd->stats.gateway_lookups++;
+  discord_http_get(ic, dd->bot ? "gateway/bot" : "gateway",
+                   discord_http_gateway_cb, ic);
+}
+
+/* Decodes the reply to one of the requests of discord_http_restore().
+ * Returns NULL if there is nothing to handle: the restore was given up on
+ * already, the request is retried later or it failed, which gives up on
+ * the restore now. */
+static json_value *discord_http_restore_reply(struct http_request *req,
+                                              json_type type)
+{
+  struct im_connection *ic = req->data;
+  discord_data *dd = ic->proto_data;
+  json_value *js;
+
+  dd->pending_reqs = g_slist_remove(dd->pending_reqs, req);
+
+  discord_debug("<<< (%s) %s [%d] %d\n%s\n", dd->uname, __func__,
+                req->status_code, req->body_size, req->reply_body);
+
+  if (!dd->restoring) {
+    return NULL;
+  }
+  if (req->status_code != 200) {
+    if (discord_http_check_retry(req) == 0) {
+      discord_restore_abort(ic);
+    }
+    return NULL;
+  }
+
+  js = discord_json_decode(dd, req->reply_body, req->body_size);
+  if (js == NULL || js->type != type) {
+    discord_json_decode_free(dd, js);
+    discord_restore_abort(ic);
+    return NULL;
+  }
+  return js;
+}
+
+static void discord_http_restore_get(struct im_connection *ic,
+                                     const char *api_path,
+                                     http_input_function cb_func)
+{
+  discord_data *dd = ic->proto_data;
+
+  dd->restore_pending++;
+  discord_http_get(ic, api_path, cb_func, ic);
+}
+
+/* One more reply handled, the last one finishes the restore. */
+static void discord_http_restore_next(struct im_connection *ic)
+{
+  discord_data *dd = ic->proto_data;
+
+  if (--dd->restore_pending == 0) {
+    discord_restore_done(ic);
+  }
+}
+
+/* Both the channels of a server and the private ones. */
+static void discord_http_restore_channels_cb(struct http_request *req)
+{
+  struct im_connection *ic = req->data;
+  discord_data *dd = ic->proto_data;
+  json_value *channels = discord_http_restore_reply(req, json_array);
+
+  if (channels == NULL) {
+    return;
+  }
+
+  for (int cidx = 0; cidx < channels->u.array.length; cidx++) {
+    json_value *cinfo = channels->u.array.values[cidx];
+    discord_handle_channel(ic, cinfo, json_o_str(cinfo, "guild_id"),
+                           ACTION_CREATE);
+  }
+
+  discord_json_decode_free(dd, channels);
+  discord_http_restore_next(ic);
+}
+
+static void discord_http_restore_servers_cb(struct http_request *req)
+{
+  struct im_connection *ic = req->data;
+  discord_data *dd = ic->proto_data;
+  json_value *servers = discord_http_restore_reply(req, json_array);
+  GString *api = g_string_new("");
+
+  if (servers == NULL) {
+    g_string_free(api, TRUE);
+    return;
+  }
+
+  for (int sidx = 0; sidx < servers->u.array.length; sidx++) {
+    json_value *sinfo = servers->u.array.values[sidx];
+    const char *id = json_o_str(sinfo, "id");
+
+    if (id != NULL) {
+      discord_restore_server(ic, sinfo);
+      g_string_printf(api, "guilds/%s/channels", id);
+      discord_http_restore_get(ic, api->str,
+                               discord_http_restore_channels_cb);
+    }
+  }
+
+  g_string_free(api, TRUE);
+  discord_json_decode_free(dd, servers);
+  discord_http_restore_next(ic);
+}
+
+static void discord_http_restore_relationships_cb(struct http_request *req)
+{
+  struct im_connection *ic = req->data;
+  discord_data *dd = ic->proto_data;
+  json_value *rels = discord_http_restore_reply(req, json_array);
+
+  if (rels == NULL) {
+    return;
+  }
+
+  for (int ridx = 0; ridx < rels->u.array.length; ridx++) {
+    discord_restore_relationship(ic, rels->u.array.values[ridx]);
+  }
+
+  discord_json_decode_free(dd, rels);
+  discord_http_restore_next(ic);
+}
+
+static void discord_http_restore_self_cb(struct http_request *req)
+{
+  struct im_connection *ic = req->data;
+  discord_data *dd = ic->proto_data;
+  json_value *user = discord_http_restore_reply(req, json_object);
+
+  if (user == NULL) {
+    return;
+  }
+
+  discord_restore_start(ic, user);
+  discord_json_decode_free(dd, user);
+
+  discord_http_restore_get(ic, "users/@me/guilds",
+                           discord_http_restore_servers_cb);
+  discord_http_restore_get(ic, "users/@me/channels",
+                           discord_http_restore_channels_cb);
+  discord_http_restore_get(ic, "users/@me/relationships",
+                           discord_http_restore_relationships_cb);
+  discord_http_restore_next(ic);
+}
+
+/* Asks for what READY would have brought after a RESUME of a session from
+ * before a restart, see discord_restore_start(). The user comes first, the
+ * names of everything else depend on it. */
+void discord_http_restore(struct im_connection *ic)
+{
+  discord_data *dd = ic->proto_data;
+
+  if (set_getbool(&ic->acc->set, "verbose")) {
+    imcb_log(ic, "Restoring servers and channels of the resumed session");
+  }
+  dd->restore_pending = 0;
+  discord_http_restore_get(ic, "users/@me", discord_http_restore_self_cb);
 }
 
 static void discord_http_mfa_cb(struct http_request *req)
@@ -342,11 +493,12 @@ static void discord_http_backlog_cb(struct http_request *req)
       imcb_error(ic, "Failed to get backlog (%d).", req->status_code);
     }
   } else {
-    json_value *messages = json_parse(req->reply_body, req->body_size);
+    json_value *messages = discord_json_decode(dd, req->reply_body,
+                                              req->body_size);
     if (!messages || messages->type != json_array) {
       imcb_error(ic, "Failed to parse json reply (%s)", __func__);
+      discord_json_decode_free(dd, messages);
       imc_logout(ic, TRUE);
-      json_value_free(messages);
       return;
     }
 
@@ -355,7 +507,7 @@ static void discord_http_backlog_cb(struct http_request *req)
       discord_handle_message(ic, minfo, ACTION_CREATE, TRUE);
     }
 
-    json_value_free(messages);
+    discord_json_decode_free(dd, messages);
   }
 }
 
@@ -386,11 +538,12 @@ static void discord_http_pinned_cb(struct http_request *req)
       imcb_error(ic, "Failed to get pinned messages (%d).", req->status_code);
     }
   } else {
-    json_value *messages = json_parse(req->reply_body, req->body_size);
+    json_value *messages = discord_json_decode(dd, req->reply_body,
+                                              req->body_size);
     if (!messages || messages->type != json_array) {
       imcb_error(ic, "Failed to parse json reply (%s)", __func__);
+      discord_json_decode_free(dd, messages);
       imc_logout(ic, TRUE);
-      json_value_free(messages);
       return;
     }
 
@@ -399,7 +552,7 @@ static void discord_http_pinned_cb(struct http_request *req)
       discord_handle_message(ic, minfo, ACTION_CREATE, TRUE);
     }
 
-    json_value_free(messages);
+    discord_json_decode_free(dd, messages);
   }
 }
 
@@ -540,13 +693,13 @@ void discord_http_send_msg(struct im_connection *ic, const char *id,
   g_string_printf(request, "POST /api/channels/%s/messages HTTP/1.1\r\n"
                   "Host: %s\r\n"
                   "User-Agent: Bitlbee-Discord\r\n"
-                  "authorization: %s\r\n"
+                  "authorization: %s%s\r\n"
                   "Content-Type: application/json\r\n"
                   "Content-Length: %zd\r\n\r\n"
                   "%s",
                   id,
                   set_getstr(&ic->acc->set, "host"),
-                  dd->token,
+                  dd->bot ? "Bot " : "", dd->token,
                   content->len,
                   content->str);
 
@@ -572,12 +725,12 @@ void discord_http_send_ack(struct im_connection *ic, const char *channel_id,
                   "Host: %s\r\n"
                   "User-Agent: Bitlbee-Discord\r\n"
                   "Content-Type: application/json\r\n"
-                  "Authorization: %s\r\n"
+                  "Authorization: %s%s\r\n"
                   "Content-Length: 2\r\n\r\n"
                   "{}",
                   channel_id, message_id,
                   set_getstr(&ic->acc->set, "host"),
-                  dd->token);
+                  dd->bot ? "Bot " : "", dd->token);
 
   discord_debug(">>> (%s) %s %lu", dd->uname, __func__, request->len);
 
@@ -694,13 +847,13 @@ void discord_http_create_and_send_msg(struct im_connection *ic,
   g_string_printf(request, "POST /api/users/%s/channels HTTP/1.1\r\n"
                   "Host: %s\r\n"
                   "User-Agent: Bitlbee-Discord\r\n"
-                  "authorization: %s\r\n"
+                  "authorization: %s%s\r\n"
                   "Content-Type: application/json\r\n"
                   "Content-Length: %zd\r\n\r\n"
                   "%s",
                   dd->id,
                   set_getstr(&ic->acc->set, "host"),
-                  dd->token,
+                  dd->bot ? "Bot " : "", dd->token,
                   content->len,
                   content->str);
 
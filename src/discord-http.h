@@ -28,3 +28,4 @@ void discord_http_get_pinned(struct im_connection *ic, const char *channel_id);
 void discord_http_login(account_t *acc);
 void discord_http_mfa_auth(struct im_connection *ic, const char *msg);
 void discord_http_get_gateway(struct im_connection *ic, const char *token);
+void discord_http_restore(struct im_connection *ic);
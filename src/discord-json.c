@@ -0,0 +1,866 @@
+/*
+ * Copyright 2015 Artem Savkov <artem.savkov@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "discord-json.h"
+#include "discord-etf.h"
+
+#define JSON_BLOCK 64
+#define JSON_MAX_DEPTH 128
+
+typedef struct {
+  const gchar *buf;
+  const gchar *end;
+  const gchar *p;      /* first byte not consumed yet */
+  guint32     *idx;    /* offsets of structural characters and quotes */
+  gsize       n;
+  gsize       alloc;
+  gsize       i;       /* next unconsumed entry of idx */
+  guint       depth;
+} json_reader;
+
+/* Bit i of each mask is set if byte i of the block is a quote, a backslash
+ * or one of {}[]:, respectively. */
+typedef struct {
+  guint64 quote;
+  guint64 backslash;
+  guint64 structural;
+} json_block;
+
+static void json_classify(const guchar *p, json_block *b)
+{
+#ifdef __SSE2__
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i lower = _mm_set1_epi8(0x20);
+  const __m128i open = _mm_set1_epi8('{');
+  const __m128i close = _mm_set1_epi8('}');
+  const __m128i colon = _mm_set1_epi8(':');
+  const __m128i comma = _mm_set1_epi8(',');
+
+  b->quote = b->backslash = b->structural = 0;
+  for (int i = 0; i < JSON_BLOCK; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+    /* [ and ] are { and } with bit 5 cleared. */
+    __m128i l = _mm_or_si128(v, lower);
+    __m128i s = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(l, open),
+                                          _mm_cmpeq_epi8(l, close)),
+                             _mm_or_si128(_mm_cmpeq_epi8(v, colon),
+                                          _mm_cmpeq_epi8(v, comma)));
+
+    b->quote |= (guint64)(guint16)_mm_movemask_epi8(
+                  _mm_cmpeq_epi8(v, quote)) << i;
+    b->backslash |= (guint64)(guint16)_mm_movemask_epi8(
+                      _mm_cmpeq_epi8(v, backslash)) << i;
+    b->structural |= (guint64)(guint16)_mm_movemask_epi8(s) << i;
+  }
+#else
+  b->quote = b->backslash = b->structural = 0;
+  for (int i = 0; i < JSON_BLOCK; i++) {
+    switch (p[i]) {
+      case '"':
+        b->quote |= 1ULL << i;
+        break;
+      case '\\':
+        b->backslash |= 1ULL << i;
+        break;
+      case '{': case '}': case '[': case ']': case ':': case ',':
+        b->structural |= 1ULL << i;
+        break;
+    }
+  }
+#endif
+}
+
+/* Marks the characters escaped by an odd run of backslashes. A run may go
+ * on from the previous block, carry tells whether that one ended in an odd
+ * run. */
+static guint64 json_escaped(guint64 backslash, guint64 *carry)
+{
+  const guint64 even = 0x5555555555555555ULL;
+  guint64 starts = backslash & ~(backslash << 1);
+  guint64 even_start_mask = even ^ *carry;
+  guint64 even_starts = starts & even_start_mask;
+  guint64 odd_starts = starts & ~even_start_mask;
+  guint64 even_carries = backslash + even_starts;
+  guint64 odd_carries = backslash + odd_starts;
+  guint64 overflow = odd_carries < backslash;
+  guint64 even_ends, odd_ends;
+
+  odd_carries |= *carry;
+  *carry = overflow;
+  even_ends = even_carries & ~backslash & ~even;
+  odd_ends = odd_carries & ~backslash & even;
+
+  return even_ends | odd_ends;
+}
+
+/* Bit i is the parity of the bits 0..i, which turns quotes into a mask of
+ * what is inside strings (opening quote included, closing one not). */
+static guint64 json_prefix_xor(guint64 x)
+{
+  x ^= x << 1;
+  x ^= x << 2;
+  x ^= x << 4;
+  x ^= x << 8;
+  x ^= x << 16;
+  x ^= x << 32;
+  return x;
+}
+
+static guint json_ctz(guint64 x)
+{
+#ifdef __GNUC__
+  return __builtin_ctzll(x);
+#else
+  return g_bit_nth_lsf(x, -1);
+#endif
+}
+
+static gboolean json_index(json_reader *r)
+{
+  const guchar *buf = (const guchar*)r->buf;
+  gsize size = r->end - r->buf;
+  guint64 escape_carry = 0;
+  guint64 in_string = 0;
+  guchar tail[JSON_BLOCK];
+
+  r->alloc = size / 8 + JSON_BLOCK;
+  r->idx = g_new(guint32, r->alloc);
+
+  for (gsize off = 0; off < size; off += JSON_BLOCK) {
+    const guchar *p = buf + off;
+    json_block b;
+    guint64 quotes, bits;
+
+    if (size - off < JSON_BLOCK) {
+      memset(tail, ' ', sizeof(tail));
+      memcpy(tail, p, size - off);
+      p = tail;
+    }
+
+    json_classify(p, &b);
+    quotes = b.quote & ~json_escaped(b.backslash, &escape_carry);
+    in_string = json_prefix_xor(quotes) ^ in_string;
+    bits = (b.structural & ~in_string) | quotes;
+    in_string = (guint64)((gint64)in_string >> 63);
+
+    if (r->n + JSON_BLOCK > r->alloc) {
+      r->alloc *= 2;
+      r->idx = g_renew(guint32, r->idx, r->alloc);
+    }
+    while (bits != 0) {
+      r->idx[r->n++] = off + json_ctz(bits);
+      bits &= bits - 1;
+    }
+  }
+
+  return in_string == 0;
+}
+
+static gboolean json_blank(const gchar *p, const gchar *end)
+{
+  for (; p < end; p++) {
+    if (*p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+static gchar json_peek(json_reader *r)
+{
+  return r->i < r->n ? r->buf[r->idx[r->i]] : '\0';
+}
+
+/* Consumes the next structural character if it is c and there's nothing
+ * but whitespace before it. */
+static gboolean json_expect(json_reader *r, gchar c)
+{
+  const gchar *s;
+
+  if (r->i >= r->n) {
+    return FALSE;
+  }
+  s = r->buf + r->idx[r->i];
+  if (*s != c || !json_blank(r->p, s)) {
+    return FALSE;
+  }
+
+  r->p = s + 1;
+  r->i++;
+  return TRUE;
+}
+
+static gboolean json_hex4(const gchar *p, const gchar *end, gunichar *c)
+{
+  *c = 0;
+  if (end - p < 4) {
+    return FALSE;
+  }
+  for (int i = 0; i < 4; i++) {
+    gint d = g_ascii_xdigit_value(p[i]);
+
+    if (d < 0) {
+      return FALSE;
+    }
+    *c = *c << 4 | d;
+  }
+  return TRUE;
+}
+
+/* Never longer than the escaped form, so that's what is allocated. */
+static gchar *json_unescape(const gchar *p, const gchar *end, gsize *len)
+{
+  gchar *out = g_malloc(end - p + 1);
+  gchar *o = out;
+  gunichar c, lo;
+
+  while (p < end) {
+    if (*p != '\\') {
+      *o++ = *p++;
+      continue;
+    }
+    if (++p >= end) {
+      goto fail;
+    }
+    switch (*p++) {
+      case '"':  *o++ = '"';  break;
+      case '\\': *o++ = '\\'; break;
+      case '/':  *o++ = '/';  break;
+      case 'b':  *o++ = '\b'; break;
+      case 'f':  *o++ = '\f'; break;
+      case 'n':  *o++ = '\n'; break;
+      case 'r':  *o++ = '\r'; break;
+      case 't':  *o++ = '\t'; break;
+      case 'u':
+        if (!json_hex4(p, end, &c)) {
+          goto fail;
+        }
+        p += 4;
+        if (c >= 0xd800 && c < 0xdc00 && end - p >= 6 && p[0] == '\\' &&
+            p[1] == 'u' && json_hex4(p + 2, end, &lo) &&
+            lo >= 0xdc00 && lo < 0xe000) {
+          c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+          p += 6;
+        }
+        o += g_unichar_to_utf8(c, o);
+        break;
+      default:
+        goto fail;
+    }
+  }
+
+  *o = '\0';
+  *len = o - out;
+  return out;
+
+fail:
+  g_free(out);
+  return NULL;
+}
+
+/* The closing quote is the index entry right after the opening one. */
+static gchar *json_read_string(json_reader *r, gsize *len)
+{
+  const gchar *start, *end;
+
+  if (!json_expect(r, '"') || r->i >= r->n) {
+    return NULL;
+  }
+  start = r->p;
+  end = r->buf + r->idx[r->i++];
+  r->p = end + 1;
+
+  if (memchr(start, '\\', end - start) == NULL) {
+    *len = end - start;
+    return g_strndup(start, end - start);
+  }
+  return json_unescape(start, end, len);
+}
+
+static json_value *json_new(json_type type, json_value *parent)
+{
+  json_value *js = g_new0(json_value, 1);
+  js->type = type;
+  js->parent = parent;
+  return js;
+}
+
+static json_value *json_scalar(const gchar *p, gsize len, json_value *parent)
+{
+  json_value *js = NULL;
+
+  if (len == 4 && memcmp(p, "true", 4) == 0) {
+    js = json_new(json_boolean, parent);
+    js->u.boolean = TRUE;
+  } else if (len == 5 && memcmp(p, "false", 5) == 0) {
+    js = json_new(json_boolean, parent);
+    js->u.boolean = FALSE;
+  } else if (len == 4 && memcmp(p, "null", 4) == 0) {
+    js = json_new(json_null, parent);
+  } else if (len > 0 && len < 64 && (*p == '-' || g_ascii_isdigit(*p))) {
+    gchar num[64];
+    gchar *rest;
+
+    memcpy(num, p, len);
+    num[len] = '\0';
+    if (strpbrk(num, ".eE") != NULL) {
+      js = json_new(json_double, parent);
+      js->u.dbl = g_ascii_strtod(num, &rest);
+    } else {
+      js = json_new(json_integer, parent);
+      js->u.integer = g_ascii_strtoll(num, &rest, 10);
+    }
+    if (*rest != '\0') {
+      g_free(js);
+      return NULL;
+    }
+  }
+
+  return js;
+}
+
+/* Numbers and literals aren't in the index, they run up to the next
+ * structural character. */
+static json_value *json_read_scalar(json_reader *r, json_value *parent)
+{
+  const gchar *p = r->p;
+  const gchar *end = r->i < r->n ? r->buf + r->idx[r->i] : r->end;
+
+  while (p < end && json_blank(p, p + 1)) {
+    p++;
+  }
+  while (end > p && json_blank(end - 1, end)) {
+    end--;
+  }
+
+  r->p = end;
+  return json_scalar(p, end - p, parent);
+}
+
+static json_value *json_read_value(json_reader *r, json_value *parent);
+
+static json_value *json_read_object(json_reader *r, json_value *parent)
+{
+  json_value *js = json_new(json_object, parent);
+  gsize alloc = 0;
+
+  json_expect(r, '{');
+  if (json_peek(r) == '}' && json_expect(r, '}')) {
+    return js;
+  }
+
+  do {
+    json_object_entry *entry;
+    gsize len;
+    gchar *name = json_read_string(r, &len);
+
+    if (name == NULL || !json_expect(r, ':')) {
+      g_free(name);
+      goto fail;
+    }
+
+    if (js->u.object.length == alloc) {
+      alloc = MAX(alloc * 2, 8);
+      js->u.object.values = g_renew(json_object_entry, js->u.object.values,
+                                    alloc);
+    }
+    entry = &js->u.object.values[js->u.object.length];
+    entry->name = name;
+    entry->name_length = len;
+    entry->value = json_read_value(r, js);
+    js->u.object.length++;
+    if (entry->value == NULL) {
+      goto fail;
+    }
+  } while (json_expect(r, ','));
+
+  if (json_expect(r, '}')) {
+    return js;
+  }
+
+fail:
+  discord_json_free(js);
+  return NULL;
+}
+
+static json_value *json_read_array(json_reader *r, json_value *parent)
+{
+  json_value *js = json_new(json_array, parent);
+  gsize alloc = 0;
+
+  json_expect(r, '[');
+  if (json_peek(r) == ']' && json_expect(r, ']')) {
+    return js;
+  }
+
+  do {
+    json_value *value = json_read_value(r, js);
+
+    if (value == NULL) {
+      goto fail;
+    }
+    if (js->u.array.length == alloc) {
+      alloc = MAX(alloc * 2, 8);
+      js->u.array.values = g_renew(json_value*, js->u.array.values, alloc);
+    }
+    js->u.array.values[js->u.array.length++] = value;
+  } while (json_expect(r, ','));
+
+  if (json_expect(r, ']')) {
+    return js;
+  }
+
+fail:
+  discord_json_free(js);
+  return NULL;
+}
+
+static json_value *json_read_value(json_reader *r, json_value *parent)
+{
+  json_value *js = NULL;
+  gchar c = json_peek(r);
+  gsize len;
+
+  if (r->depth >= JSON_MAX_DEPTH) {
+    return NULL;
+  }
+
+  /* Something other than whitespace in front of it, that's a scalar. */
+  if (c != '\0' && !json_blank(r->p, r->buf + r->idx[r->i])) {
+    c = '\0';
+  }
+
+  r->depth++;
+  switch (c) {
+    case '{':
+      js = json_read_object(r, parent);
+      break;
+    case '[':
+      js = json_read_array(r, parent);
+      break;
+    case '"':
+      js = json_new(json_string, parent);
+      js->u.string.ptr = json_read_string(r, &len);
+      js->u.string.length = len;
+      if (js->u.string.ptr == NULL) {
+        g_free(js);
+        js = NULL;
+      }
+      break;
+    default:
+      js = json_read_scalar(r, parent);
+      break;
+  }
+  r->depth--;
+
+  return js;
+}
+
+json_value *discord_json_parse(const gchar *buf, gsize size)
+{
+  json_reader r = { buf, buf + size, buf, NULL, 0, 0, 0, 0 };
+  json_value *js = NULL;
+
+  if (size > 0 && size <= G_MAXUINT32 && json_index(&r)) {
+    js = json_read_value(&r, NULL);
+    if (js != NULL && (r.i < r.n || !json_blank(r.p, r.end))) {
+      discord_json_free(js);
+      js = NULL;
+    }
+  }
+
+  g_free(r.idx);
+  return js;
+}
+
+/* The trees are put together the same way as the ETF decoder's. */
+void discord_json_free(json_value *js)
+{
+  discord_etf_free(js);
+}
+
+json_value *discord_json_decode(discord_data *dd, const gchar *buf,
+                                gsize size)
+{
+  if (dd->json_indexed) {
+    return discord_json_parse(buf, size);
+  }
+  return json_parse(buf, size);
+}
+
+void discord_json_decode_free(discord_data *dd, json_value *js)
+{
+  if (dd->json_indexed) {
+    discord_json_free(js);
+  } else {
+    json_value_free(js);
+  }
+}
+
+typedef enum {
+  JSON_STREAM_VALUE,    /* a value, or ] right after [ */
+  JSON_STREAM_NAME,     /* a member name, or } right after { */
+  JSON_STREAM_COLON,
+  JSON_STREAM_NEXT,     /* a comma or the end of the container */
+  JSON_STREAM_STRING,
+  JSON_STREAM_SCALAR,
+  JSON_STREAM_DONE,
+  JSON_STREAM_FAILED
+} json_stream_state;
+
+typedef struct {
+  json_value *js;
+  gsize      alloc;
+  guint      count;     /* values so far, including the ones handed out */
+} json_stream_frame;
+
+struct _discord_json_stream {
+  discord_json_stream_func func;
+  gpointer          data;
+  guint             emit_depth;
+  json_stream_state state;
+  json_value        *root;
+  json_stream_frame stack[JSON_MAX_DEPTH];
+  guint             depth;
+  gboolean          first;    /* right after { or [ */
+  gboolean          name;     /* the string being read is a member name */
+  gboolean          escape;   /* the last byte was a backslash */
+  gboolean          escaped;  /* the string has escapes in it */
+  gchar             *key;     /* member name waiting for its value */
+  gsize             keylen;
+  GString           *tok;     /* string or scalar read so far */
+};
+
+discord_json_stream *discord_json_stream_new(guint depth,
+                                             discord_json_stream_func func,
+                                             gpointer data)
+{
+  discord_json_stream *st = g_new0(discord_json_stream, 1);
+
+  st->func = func;
+  st->data = data;
+  st->emit_depth = depth;
+  st->state = JSON_STREAM_VALUE;
+  st->tok = g_string_sized_new(64);
+  return st;
+}
+
+void discord_json_stream_free(discord_json_stream *st)
+{
+  if (st == NULL) {
+    return;
+  }
+
+  discord_json_free(st->root);
+  g_free(st->key);
+  g_string_free(st->tok, TRUE);
+  g_free(st);
+}
+
+/* Containers are hooked up as soon as they are opened, so the callback
+ * sees everything that came before the value it gets. */
+static void json_stream_add(discord_json_stream *st, json_value *js)
+{
+  json_stream_frame *f;
+
+  if (st->depth == 0) {
+    st->root = js;
+    return;
+  }
+
+  f = &st->stack[st->depth - 1];
+  js->parent = f->js;
+  if (f->js->type == json_object) {
+    json_object_entry *entry;
+
+    if (f->js->u.object.length == f->alloc) {
+      f->alloc = MAX(f->alloc * 2, 8);
+      f->js->u.object.values = g_renew(json_object_entry,
+                                       f->js->u.object.values, f->alloc);
+    }
+    entry = &f->js->u.object.values[f->js->u.object.length++];
+    entry->name = st->key;
+    entry->name_length = st->keylen;
+    entry->value = js;
+    st->key = NULL;
+  } else {
+    if (f->js->u.array.length == f->alloc) {
+      f->alloc = MAX(f->alloc * 2, 8);
+      f->js->u.array.values = g_renew(json_value*, f->js->u.array.values,
+                                      f->alloc);
+    }
+    f->js->u.array.values[f->js->u.array.length++] = js;
+  }
+}
+
+/* Called when a value is complete, for containers once they are closed.
+ * Being the last thing added, a value the callback takes is easily taken
+ * out again. */
+static void json_stream_done(discord_json_stream *st, json_value *js)
+{
+  json_stream_frame *f;
+  json_value *parent;
+  const gchar *key = NULL;
+  guint index;
+
+  if (st->depth == 0) {
+    st->state = JSON_STREAM_DONE;
+    return;
+  }
+
+  st->state = JSON_STREAM_NEXT;
+  f = &st->stack[st->depth - 1];
+  parent = f->js;
+  index = f->count++;
+  if (st->func == NULL || st->depth > st->emit_depth) {
+    return;
+  }
+
+  if (parent->type == json_object) {
+    key = parent->u.object.values[parent->u.object.length - 1].name;
+  } else if (parent->parent != NULL && parent->parent->type == json_object) {
+    json_value *pp = parent->parent;
+    key = pp->u.object.values[pp->u.object.length - 1].name;
+  }
+
+  if (st->func(st->data, st->root, st->depth, key, index, js)) {
+    if (parent->type == json_object) {
+      g_free(parent->u.object.values[--parent->u.object.length].name);
+    } else {
+      parent->u.array.length--;
+    }
+    discord_json_free(js);
+  }
+}
+
+static gboolean json_stream_open(discord_json_stream *st, json_type type)
+{
+  json_value *js;
+
+  if (st->depth >= JSON_MAX_DEPTH) {
+    return FALSE;
+  }
+
+  js = json_new(type, NULL);
+  json_stream_add(st, js);
+  st->stack[st->depth].js = js;
+  st->stack[st->depth].alloc = 0;
+  st->stack[st->depth].count = 0;
+  st->depth++;
+  st->first = TRUE;
+  st->state = type == json_object ? JSON_STREAM_NAME : JSON_STREAM_VALUE;
+  return TRUE;
+}
+
+static void json_stream_close(discord_json_stream *st)
+{
+  st->first = FALSE;
+  st->depth--;
+  json_stream_done(st, st->stack[st->depth].js);
+}
+
+static gboolean json_stream_string(discord_json_stream *st)
+{
+  json_value *js;
+  gsize len = st->tok->len;
+  gchar *str = st->escaped ?
+               json_unescape(st->tok->str, st->tok->str + st->tok->len, &len) :
+               g_strndup(st->tok->str, st->tok->len);
+
+  g_string_truncate(st->tok, 0);
+  if (str == NULL) {
+    return FALSE;
+  }
+
+  if (st->name) {
+    st->key = str;
+    st->keylen = len;
+    st->state = JSON_STREAM_COLON;
+    return TRUE;
+  }
+
+  js = json_new(json_string, NULL);
+  js->u.string.ptr = str;
+  js->u.string.length = len;
+  json_stream_add(st, js);
+  json_stream_done(st, js);
+  return TRUE;
+}
+
+static gboolean json_stream_scalar(discord_json_stream *st)
+{
+  json_value *js = json_scalar(st->tok->str, st->tok->len, NULL);
+
+  g_string_truncate(st->tok, 0);
+  if (js == NULL) {
+    return FALSE;
+  }
+
+  json_stream_add(st, js);
+  json_stream_done(st, js);
+  return TRUE;
+}
+
+static gboolean json_stream_delim(gchar c)
+{
+  switch (c) {
+    case ' ': case '\t': case '\n': case '\r':
+    case ',': case '}': case ']':
+      return TRUE;
+    default:
+      return FALSE;
+  }
+}
+
+/* Everything outside of strings and scalars, whitespace already skipped. */
+static gboolean json_stream_char(discord_json_stream *st, gchar c)
+{
+  json_value *top = st->depth > 0 ? st->stack[st->depth - 1].js : NULL;
+
+  switch (st->state) {
+    case JSON_STREAM_VALUE:
+      if (c == ']' && st->first) {
+        json_stream_close(st);
+        return TRUE;
+      }
+      st->first = FALSE;
+      if (c == '{') {
+        return json_stream_open(st, json_object);
+      } else if (c == '[') {
+        return json_stream_open(st, json_array);
+      } else if (c == '"') {
+        st->name = FALSE;
+        st->escaped = FALSE;
+        st->state = JSON_STREAM_STRING;
+        return TRUE;
+      } else if (c == '-' || g_ascii_isalnum(c)) {
+        g_string_append_c(st->tok, c);
+        st->state = JSON_STREAM_SCALAR;
+        return TRUE;
+      }
+      return FALSE;
+    case JSON_STREAM_NAME:
+      if (c == '}' && st->first) {
+        json_stream_close(st);
+        return TRUE;
+      }
+      st->first = FALSE;
+      if (c != '"') {
+        return FALSE;
+      }
+      st->name = TRUE;
+      st->escaped = FALSE;
+      st->state = JSON_STREAM_STRING;
+      return TRUE;
+    case JSON_STREAM_COLON:
+      if (c != ':') {
+        return FALSE;
+      }
+      st->state = JSON_STREAM_VALUE;
+      return TRUE;
+    case JSON_STREAM_NEXT:
+      if (c == ',') {
+        st->state = top->type == json_object ? JSON_STREAM_NAME :
+                                               JSON_STREAM_VALUE;
+        return TRUE;
+      } else if (c == (top->type == json_object ? '}' : ']')) {
+        json_stream_close(st);
+        return TRUE;
+      }
+      return FALSE;
+    default:
+      return FALSE;
+  }
+}
+
+gboolean discord_json_stream_feed(discord_json_stream *st, const gchar *buf,
+                                  gsize size)
+{
+  const gchar *p = buf;
+  const gchar *end = buf + size;
+  const gchar *s;
+
+  while (p < end && st->state != JSON_STREAM_FAILED) {
+    switch (st->state) {
+      case JSON_STREAM_STRING:
+        if (st->escape) {
+          g_string_append_c(st->tok, *p++);
+          st->escape = FALSE;
+          break;
+        }
+        s = p;
+        while (s < end && *s != '"' && *s != '\\') {
+          s++;
+        }
+        g_string_append_len(st->tok, p, s - p);
+        p = s;
+        if (p == end) {
+          break;
+        }
+        p++;
+        if (*s == '\\') {
+          g_string_append_c(st->tok, '\\');
+          st->escape = st->escaped = TRUE;
+        } else if (!json_stream_string(st)) {
+          st->state = JSON_STREAM_FAILED;
+        }
+        break;
+      case JSON_STREAM_SCALAR:
+        /* The delimiter is left for the next round. */
+        s = p;
+        while (s < end && !json_stream_delim(*s)) {
+          s++;
+        }
+        g_string_append_len(st->tok, p, s - p);
+        p = s;
+        if (st->tok->len >= 64 ||
+            (p < end && !json_stream_scalar(st))) {
+          st->state = JSON_STREAM_FAILED;
+        }
+        break;
+      default:
+        if (!json_blank(p, p + 1) && !json_stream_char(st, *p)) {
+          st->state = JSON_STREAM_FAILED;
+        }
+        p++;
+        break;
+    }
+  }
+
+  return st->state != JSON_STREAM_FAILED;
+}
+
+json_value *discord_json_stream_finish(discord_json_stream *st)
+{
+  json_value *js = NULL;
+
+  if (st->state == JSON_STREAM_SCALAR && !json_stream_scalar(st)) {
+    st->state = JSON_STREAM_FAILED;
+  }
+  if (st->state == JSON_STREAM_DONE) {
+    js = st->root;
+    st->root = NULL;
+  }
+
+  discord_json_stream_free(st);
+  return js;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2015 Artem Savkov <artem.savkov@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "discord.h"
+#include <json.h>
+
+/* JSON decoder for gateway and REST payloads. It builds the same json_value
+ * tree json_parse() does, so handlers don't know which one was used, but
+ * gets there in two passes the way simdjson does: the first one indexes
+ * every structural character 64 bytes at a time (with SSE2 where
+ * available) and leaves out whatever is inside strings, the second one
+ * walks that index and only touches the bytes in between to copy strings
+ * and read numbers. The result must be freed with discord_json_free(). */
+json_value *discord_json_parse(const gchar *buf, gsize size);
+void discord_json_free(json_value *js);
+
+/* Parse and free with whichever parser the account's json_parser setting
+ * picks. */
+json_value *discord_json_decode(discord_data *dd, const gchar *buf,
+                                gsize size);
+void discord_json_decode_free(discord_data *dd, json_value *js);
+
+/* Incremental parser for messages that arrive in pieces, building the same
+ * tree. Every value completed at most depth levels down is offered to func
+ * first, along with the tree built so far: if it returns TRUE the value was
+ * dealt with and is freed instead of being added. key is the name of the
+ * member the value is, or for array elements the one of their array, index
+ * its position in its container. */
+typedef struct _discord_json_stream discord_json_stream;
+typedef gboolean (*discord_json_stream_func)(gpointer data, json_value *root,
+                                             guint depth, const gchar *key,
+                                             guint index, json_value *value);
+
+discord_json_stream *discord_json_stream_new(guint depth,
+                                             discord_json_stream_func func,
+                                             gpointer data);
+/* Returns FALSE once the input turned out not to be JSON. */
+gboolean discord_json_stream_feed(discord_json_stream *st, const gchar *buf,
+                                  gsize size);
+/* Frees the stream, returning the tree or NULL if the input wasn't a
+ * complete JSON value. Free the tree with discord_json_free(). */
+json_value *discord_json_stream_finish(discord_json_stream *st);
+void discord_json_stream_free(discord_json_stream *st);
@@ -0,0 +1,388 @@
+/*
+ * Copyright 2015 Artem Savkov <artem.savkov@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "discord-reconnect.h"
+#include "discord-util.h"
+
+#define DISCORD_RECONNECT_BASE 1000
+#define DISCORD_RECONNECT_MAX 300000
+#define DISCORD_RECONNECT_MAX_ACTIVE 2
+#define DISCORD_RECONNECT_SLOT_TIMEOUT 60000
+
+typedef enum {
+  RECONNECT_BACKOFF,
+  RECONNECT_WAITING,
+  RECONNECT_ACTIVE
+} reconnect_state;
+
+typedef struct {
+  struct im_connection *ic;
+  discord_connect_func func;
+  reconnect_state      state;
+  gint                 timeout_id;
+} reconnect_entry;
+
+/* Kept in the order connections asked to be (re)connected. */
+static GSList *entries = NULL;
+
+static reconnect_entry *discord_reconnect_find(struct im_connection *ic)
+{
+  for (GSList *l = entries; l; l = l->next) {
+    reconnect_entry *e = l->data;
+    if (e->ic == ic) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static void discord_reconnect_free(reconnect_entry *e)
+{
+  entries = g_slist_remove(entries, e);
+  if (e->timeout_id > 0) {
+    b_event_remove(e->timeout_id);
+  }
+  g_free(e);
+}
+
+static guint discord_reconnect_delay(guint attempt)
+{
+  guint delay;
+
+  if (attempt == 0) {
+    return g_random_int_range(0, DISCORD_RECONNECT_BASE / 2);
+  }
+
+  delay = MIN(DISCORD_RECONNECT_BASE << MIN(attempt - 1, 16),
+              DISCORD_RECONNECT_MAX);
+
+  /* Pick somewhere in the upper half so that accounts that failed together
+     don't come back together. */
+  return delay / 2 + g_random_int_range(0, delay / 2 + 1);
+}
+
+static gboolean discord_reconnect_slot_timeout(gpointer data, gint fd,
+                                               b_input_condition cond);
+
+static void discord_reconnect_pump(void)
+{
+  guint active = 0;
+  reconnect_entry *next = NULL;
+
+  for (GSList *l = entries; l; l = l->next) {
+    reconnect_entry *e = l->data;
+    if (e->state == RECONNECT_ACTIVE) {
+      active++;
+    } else if (e->state == RECONNECT_WAITING && next == NULL) {
+      next = e;
+    }
+  }
+
+  if (next == NULL || active >= DISCORD_RECONNECT_MAX_ACTIVE) {
+    return;
+  }
+
+  next->state = RECONNECT_ACTIVE;
+  next->timeout_id = b_timeout_add(DISCORD_RECONNECT_SLOT_TIMEOUT,
+                                   discord_reconnect_slot_timeout, next);
+  discord_debug("=== (%s) %s connecting (%u active)\n",
+                next->ic->acc->tag, __func__, active + 1);
+
+  /* func may very well end up cancelling next, don't touch it afterwards. */
+  next->func(next->ic);
+  discord_reconnect_pump();
+}
+
+static gboolean discord_reconnect_backoff_timeout(gpointer data, gint fd,
+                                                  b_input_condition cond)
+{
+  reconnect_entry *e = data;
+
+  e->timeout_id = 0;
+  e->state = RECONNECT_WAITING;
+  discord_reconnect_pump();
+  return FALSE;
+}
+
+static gboolean discord_reconnect_slot_timeout(gpointer data, gint fd,
+                                               b_input_condition cond)
+{
+  reconnect_entry *e = data;
+
+  /* Still not READY, don't let it hold up everybody else. The connection
+     itself is left alone, heartbeats will tell if it is dead. */
+  discord_debug("=== (%s) %s giving up the slot\n", e->ic->acc->tag,
+                __func__);
+  e->timeout_id = 0;
+  discord_reconnect_free(e);
+  discord_reconnect_pump();
+  return FALSE;
+}
+
+void discord_reconnect_schedule(struct im_connection *ic,
+                                discord_connect_func func)
+{
+  discord_data *dd = ic->proto_data;
+  reconnect_entry *e = discord_reconnect_find(ic);
+  guint attempt;
+  guint delay;
+
+  if (e != NULL && e->state != RECONNECT_ACTIVE) {
+    /* Already queued, keep its place. */
+    e->func = func;
+    return;
+  }
+
+  /* The count lives in discord_data and so only covers the current login.
+     It is reset on READY or RESUMED and starts over at 0 after
+     imc_logout(): bitlbee has waited out its own auto_reconnect_delay by
+     the time the account logs in again, backing off on top of that would
+     only double the delay. */
+  attempt = dd->reconnect_attempts++;
+
+  if (e != NULL) {
+    /* Failed while connecting, it goes to the back of the line. */
+    discord_reconnect_free(e);
+  }
+
+  e = g_new0(reconnect_entry, 1);
+  e->ic = ic;
+  e->func = func;
+  e->state = RECONNECT_BACKOFF;
+  entries = g_slist_append(entries, e);
+
+  delay = discord_reconnect_delay(attempt);
+  discord_debug("=== (%s) %s attempt %u in %u ms\n", ic->acc->tag, __func__,
+                attempt + 1, delay);
+  if (attempt > 0 && set_getbool(&ic->acc->set, "verbose")) {
+    imcb_log(ic, "Reconnecting in %u seconds", (delay + 999) / 1000);
+  }
+  e->timeout_id = b_timeout_add(delay, discord_reconnect_backoff_timeout, e);
+
+  discord_reconnect_pump();
+}
+
+void discord_reconnect_done(struct im_connection *ic)
+{
+  discord_data *dd = ic->proto_data;
+  reconnect_entry *e = discord_reconnect_find(ic);
+
+  dd->reconnect_attempts = 0;
+
+  if (e != NULL) {
+    discord_reconnect_free(e);
+    discord_reconnect_pump();
+  }
+}
+
+void discord_reconnect_cancel(struct im_connection *ic)
+{
+  reconnect_entry *e = discord_reconnect_find(ic);
+
+  if (e != NULL) {
+    discord_reconnect_free(e);
+    discord_reconnect_pump();
+  }
+}
+
+void discord_reconnect_queue(guint *waiting, guint *active)
+{
+  *waiting = 0;
+  *active = 0;
+
+  for (GSList *l = entries; l; l = l->next) {
+    reconnect_entry *e = l->data;
+    if (e->state == RECONNECT_ACTIVE) {
+      (*active)++;
+    } else {
+      (*waiting)++;
+    }
+  }
+}
+
+typedef struct {
+  discord_ws           *ws;
+  discord_identify_func func;
+  gint64               queued;
+} identify_entry;
+
+/* Discord limits session starts per token, so does the queue. A bucket
+ * stays around until its window has passed, even with nothing waiting. */
+typedef struct {
+  char    *token;
+  GSList  *entries;
+  gint    timeout_id;
+  gint64  window;
+  gint    interval;
+  guint   sent;
+  guint   pumping;
+} identify_bucket;
+
+static GHashTable *identify_buckets = NULL;
+
+static gboolean discord_identify_timeout(gpointer data, gint fd,
+                                         b_input_condition cond);
+
+static void discord_identify_bucket_free(identify_bucket *b)
+{
+  if (b->timeout_id > 0) {
+    b_event_remove(b->timeout_id);
+  }
+  g_slist_free_full(b->entries, g_free);
+  g_free(b->token);
+  g_free(b);
+}
+
+/* Drops a bucket nothing waits in any more once its window has passed,
+ * otherwise comes back when it has. */
+static void discord_identify_expire(identify_bucket *b)
+{
+  gint64 elapsed = g_get_monotonic_time() - b->window;
+
+  if (b->entries != NULL || b->timeout_id > 0 || b->pumping > 0) {
+    return;
+  }
+  if (elapsed >= (gint64)b->interval * 1000) {
+    g_hash_table_remove(identify_buckets, b->token);
+  } else {
+    b->timeout_id = b_timeout_add(b->interval - elapsed / 1000 + 1,
+                                  discord_identify_timeout, b);
+  }
+}
+
+static void discord_identify_pump(identify_bucket *b)
+{
+  b->pumping++;
+  while (b->entries != NULL) {
+    identify_entry *e = b->entries->data;
+    account_t *acc = e->ws->ic->acc;
+    /* Everybody in a bucket uses the same token, the limit they set is the
+       same limit. */
+    gint concurrency = MAX(set_getint(&acc->set, "identify_concurrency"), 1);
+    gint64 now = g_get_monotonic_time();
+    gint64 elapsed = now - b->window;
+
+    b->interval = MAX(set_getint(&acc->set, "identify_interval"), 0);
+    if (elapsed >= (gint64)b->interval * 1000) {
+      b->window = now;
+      b->sent = 0;
+    } else if (b->sent >= concurrency) {
+      if (b->timeout_id == 0) {
+        b->timeout_id = b_timeout_add(b->interval - elapsed / 1000 + 1,
+                                      discord_identify_timeout, b);
+      }
+      break;
+    }
+
+    b->entries = g_slist_remove(b->entries, e);
+    b->sent++;
+
+    discord_data *dd = e->ws->ic->proto_data;
+    dd->stats.identifies++;
+    dd->stats.identify_wait_us_last = now - e->queued;
+    dd->stats.identify_wait_us_total += now - e->queued;
+    discord_debug("=== (%s) %s identifying after %"G_GINT64_FORMAT" ms, "
+                  "%u left in queue\n", acc->tag, __func__,
+                  (now - e->queued) / 1000, g_slist_length(b->entries));
+
+    e->func(e->ws);
+    g_free(e);
+  }
+  b->pumping--;
+
+  discord_identify_expire(b);
+}
+
+static gboolean discord_identify_timeout(gpointer data, gint fd,
+                                         b_input_condition cond)
+{
+  identify_bucket *b = data;
+
+  b->timeout_id = 0;
+  discord_identify_pump(b);
+  return FALSE;
+}
+
+void discord_identify_enqueue(discord_ws *ws, discord_identify_func func)
+{
+  discord_data *dd = ws->ic->proto_data;
+  const char *token = dd->token ? dd->token : "";
+  identify_bucket *b;
+  identify_entry *e;
+
+  discord_identify_cancel(ws);
+
+  if (identify_buckets == NULL) {
+    identify_buckets = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                          (GDestroyNotify)discord_identify_bucket_free);
+  }
+  b = g_hash_table_lookup(identify_buckets, token);
+  if (b == NULL) {
+    b = g_new0(identify_bucket, 1);
+    b->token = g_strdup(token);
+    g_hash_table_insert(identify_buckets, b->token, b);
+  }
+
+  e = g_new0(identify_entry, 1);
+  e->ws = ws;
+  e->func = func;
+  e->queued = g_get_monotonic_time();
+  b->entries = g_slist_append(b->entries, e);
+
+  discord_identify_pump(b);
+}
+
+void discord_identify_cancel(discord_ws *ws)
+{
+  GHashTableIter iter;
+  identify_bucket *b;
+
+  if (identify_buckets == NULL) {
+    return;
+  }
+
+  /* Not looked up by token, it may have changed since the entry was
+     queued. */
+  g_hash_table_iter_init(&iter, identify_buckets);
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&b)) {
+    for (GSList *l = b->entries; l; l = l->next) {
+      identify_entry *e = l->data;
+      if (e->ws == ws) {
+        b->entries = g_slist_remove(b->entries, e);
+        g_free(e);
+        discord_identify_expire(b);
+        return;
+      }
+    }
+  }
+}
+
+guint discord_identify_queue(void)
+{
+  GHashTableIter iter;
+  identify_bucket *b;
+  guint n = 0;
+
+  if (identify_buckets == NULL) {
+    return 0;
+  }
+
+  g_hash_table_iter_init(&iter, identify_buckets);
+  while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&b)) {
+    n += g_slist_length(b->entries);
+  }
+  return n;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright 2015 Artem Savkov <artem.savkov@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "discord.h"
+
+typedef void (*discord_connect_func)(struct im_connection *ic);
+typedef void (*discord_identify_func)(discord_ws *ws);
+
+/* Process-wide connection scheduler. Every (re)connect goes through it so
+ * that a network blip doesn't have all accounts hammer the gateway at once:
+ * retries back off exponentially with jitter, and only a few connections are
+ * allowed to be between the TLS handshake and READY/RESUMED at a time. The
+ * backoff covers soft reconnects, once an account is logged out bitlbee's
+ * auto_reconnect_delay takes over. */
+void discord_reconnect_schedule(struct im_connection *ic,
+                                discord_connect_func func);
+void discord_reconnect_done(struct im_connection *ic);
+void discord_reconnect_cancel(struct im_connection *ic);
+void discord_reconnect_queue(guint *waiting, guint *active);
+
+/* IDENTIFY admission per token, the way discord counts session starts. New
+ * sessions are started in the order they asked for it, identify_concurrency
+ * at a time every identify_interval milliseconds. RESUME doesn't start a
+ * session and doesn't go through here. Every shard of an account identifies
+ * on its own. */
+void discord_identify_enqueue(discord_ws *ws, discord_identify_func func);
+void discord_identify_cancel(discord_ws *ws);
+guint discord_identify_queue(void);
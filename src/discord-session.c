@@ -0,0 +1,191 @@
+/*
+ * Copyright 2015 Artem Savkov <artem.savkov@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <config.h>
+#include <json_util.h>
+
+#include "discord-session.h"
+#include "discord-etf.h"
+#include "discord-json.h"
+#include "discord-handlers.h"
+#include "discord-util.h"
+
+/* Events kept after READY before giving up on late followers. */
+#define DISCORD_JOURNAL_MAX (4 << 20)
+
+/* token -> leading account */
+static GHashTable *sessions = NULL;
+
+discord_data *discord_session_leader(discord_data *dd)
+{
+  return dd->leader != NULL ? dd->leader : dd;
+}
+
+static void discord_session_free_buf(GString *buf)
+{
+  g_string_free(buf, TRUE);
+}
+
+static void discord_session_journal_free(discord_data *dd)
+{
+  if (dd->journal != NULL) {
+    g_queue_free_full(dd->journal, (GDestroyNotify)discord_session_free_buf);
+    dd->journal = NULL;
+  }
+  dd->journal_size = 0;
+}
+
+/* Brings an account that attaches after READY up to date by running it
+ * through the same events the leader got. */
+static void discord_session_replay(discord_data *leader, discord_data *dd)
+{
+  for (GList *l = leader->journal->head; l; l = l->next) {
+    GString *buf = l->data;
+    json_value *js = leader->etf ? discord_etf_decode(buf->str, buf->len) :
+                                   discord_json_decode(dd, buf->str,
+                                                       buf->len);
+
+    if (js != NULL && js->type == json_object) {
+      discord_handle_event(dd->ic, NULL, js, json_o_str(js, "t"), "");
+    }
+    if (leader->etf) {
+      discord_etf_free(js);
+    } else {
+      discord_json_decode_free(dd, js);
+    }
+  }
+}
+
+gboolean discord_session_attach(discord_data *dd)
+{
+  struct im_connection *ic = dd->ic;
+  discord_data *leader;
+
+  if (dd->token == NULL || !set_getbool(&ic->acc->set, "share_session")) {
+    return FALSE;
+  }
+
+  if (sessions == NULL) {
+    sessions = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  }
+
+  leader = g_hash_table_lookup(sessions, dd->token);
+  if (leader == NULL || leader == dd) {
+    g_hash_table_insert(sessions, g_strdup(dd->token), dd);
+    return FALSE;
+  }
+
+  if (leader->state == WS_READY && leader->journal == NULL) {
+    /* Too much happened since READY to catch up with, this account goes
+       on its own. */
+    return FALSE;
+  }
+
+  dd->leader = leader;
+  dd->reconnecting = FALSE;
+  dd->state = WS_CONNECTING;
+  leader->followers = g_slist_append(leader->followers, dd);
+  if (set_getbool(&ic->acc->set, "verbose")) {
+    imcb_log(ic, "Sharing the gateway session of %s", leader->ic->acc->tag);
+  }
+
+  /* Otherwise READY is still to come and gets here like everything else. */
+  if (leader->state == WS_READY) {
+    discord_session_replay(leader, dd);
+  }
+  return TRUE;
+}
+
+static gboolean discord_session_is(gpointer key, gpointer value,
+                                   gpointer data)
+{
+  return value == data;
+}
+
+void discord_session_detach(discord_data *dd)
+{
+  discord_data *next;
+
+  if (dd->leader != NULL) {
+    dd->leader->followers = g_slist_remove(dd->leader->followers, dd);
+    dd->leader = NULL;
+    return;
+  }
+
+  if (sessions == NULL ||
+      g_hash_table_foreach_remove(sessions, discord_session_is, dd) == 0 ||
+      dd->followers == NULL) {
+    discord_session_journal_free(dd);
+    return;
+  }
+
+  /* The first follower takes over and RESUMEs the session where we leave
+     it, the others move along with it. */
+  next = dd->followers->data;
+  next->leader = NULL;
+  next->followers = g_slist_delete_link(dd->followers, dd->followers);
+  dd->followers = NULL;
+  for (GSList *l = next->followers; l; l = g_slist_next(l)) {
+    ((discord_data *)l->data)->leader = next;
+  }
+
+  next->seq = dd->seq;
+  next->journal = dd->journal;
+  next->journal_size = dd->journal_size;
+  dd->journal = NULL;
+  g_hash_table_insert(sessions, g_strdup(next->token), next);
+
+  discord_soft_reconnect(next->ic);
+}
+
+/* Keeps what a late follower needs: the last READY of the main session and
+ * the events that changed something since. Messages are left out, there
+ * is no point in replaying them as if they were new. */
+void discord_session_record(discord_data *dd, discord_ws *ws,
+                            const char *event, const gchar *buf, gsize size)
+{
+  if (dd->leader != NULL ||
+      !set_getbool(&dd->ic->acc->set, "share_session")) {
+    return;
+  }
+
+  if (ws->shard == NULL && g_strcmp0(event, "READY") == 0) {
+    discord_session_journal_free(dd);
+    dd->journal = g_queue_new();
+  } else if (dd->journal == NULL || g_str_has_prefix(event, "MESSAGE_") ||
+             g_strcmp0(event, "TYPING_START") == 0) {
+    return;
+  } else {
+    dd->journal_size += size;
+  }
+
+  g_queue_push_tail(dd->journal, g_string_new_len(buf, size));
+  if (dd->journal_size > DISCORD_JOURNAL_MAX) {
+    discord_debug("=== (%s) %s journal full, dropping it\n", dd->uname,
+                  __func__);
+    discord_session_journal_free(dd);
+  }
+}
+
+void discord_session_dispatch(discord_data *dd, json_value *js,
+                              const char *event)
+{
+  for (GSList *l = dd->followers; l; l = g_slist_next(l)) {
+    discord_data *fdd = l->data;
+
+    discord_handle_event(fdd->ic, NULL, js, event, "");
+  }
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright 2015 Artem Savkov <artem.savkov@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "discord.h"
+#include <json.h>
+
+/* Accounts logging in with the same token, and share_session on, share a
+ * single gateway session across the whole process. The first of them leads:
+ * it owns the connection and every event it gets is applied to the others as
+ * well, their gateway ops go out through it. Each account keeps its own
+ * servers, channels and users, only the parsing and the traffic are shared.
+ *
+ * discord_session_attach() returns TRUE if dd now follows another account
+ * and must not open a connection of its own. */
+gboolean discord_session_attach(discord_data *dd);
+void discord_session_detach(discord_data *dd);
+discord_data *discord_session_leader(discord_data *dd);
+void discord_session_record(discord_data *dd, discord_ws *ws,
+                            const char *event, const gchar *buf, gsize size);
+void discord_session_dispatch(discord_data *dd, json_value *js,
+                              const char *event);
@@ -0,0 +1,344 @@
+/*
+ * Copyright 2015 Artem Savkov <artem.savkov@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <config.h>
+#include <proxy.h>
+#include <sock.h>
+
+#include "discord-tls.h"
+#include "discord-util.h"
+
+#ifdef HAVE_GNUTLS
+#include <gnutls/gnutls.h>
+#if GNUTLS_VERSION_NUMBER >= 0x030703
+#include <gnutls/socket.h>
+#endif
+
+typedef struct {
+  discord_ws           *ws;
+  ssl_input_function   func;
+  gnutls_session_t     session;
+  gchar                *host;
+  gchar                *key;
+  int                  fd;
+  gint                 inpa;
+  gboolean             again;
+  gboolean             saved;
+} discord_tls;
+
+static gnutls_certificate_credentials_t cred = NULL;
+/* Latest session data per host:port, shared by all accounts. */
+static GHashTable *sessions = NULL;
+
+static void discord_tls_free_datum(gnutls_datum_t *datum)
+{
+  gnutls_free(datum->data);
+  g_free(datum);
+}
+
+static gboolean discord_tls_init(struct im_connection *ic)
+{
+  int trusted;
+
+  if (cred != NULL) {
+    return TRUE;
+  }
+
+  if (gnutls_global_init() < 0 ||
+      gnutls_certificate_allocate_credentials(&cred) < 0) {
+    return FALSE;
+  }
+
+  /* Both return the number of certificates loaded. */
+  trusted = MAX(gnutls_certificate_set_x509_system_trust(cred), 0);
+  if (global.conf->cafile != NULL) {
+    trusted += MAX(gnutls_certificate_set_x509_trust_file(cred,
+                     global.conf->cafile, GNUTLS_X509_FMT_PEM), 0);
+  }
+  if (trusted == 0) {
+    /* Every handshake would fail verification, say why once instead. */
+    imcb_error(ic, "GnuTLS has no trusted certificates: the system trust "
+               "store isn't available and no usable CAfile is configured");
+    gnutls_certificate_free_credentials(cred);
+    cred = NULL;
+    return FALSE;
+  }
+
+  sessions = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                   (GDestroyNotify)discord_tls_free_datum);
+  return TRUE;
+}
+
+/* With TLS 1.3 the tickets arrive after the handshake, so this is done once
+ * something has been read and again when the connection goes away. */
+static void discord_tls_save(discord_tls *tls)
+{
+  gnutls_datum_t *datum = g_new0(gnutls_datum_t, 1);
+
+  if (gnutls_session_get_data2(tls->session, datum) < 0) {
+    g_free(datum);
+    return;
+  }
+
+  g_hash_table_replace(sessions, g_strdup(tls->key), datum);
+  tls->saved = TRUE;
+}
+
+static void discord_tls_free(discord_tls *tls)
+{
+  if (tls->inpa > 0) {
+    b_event_remove(tls->inpa);
+  }
+
+  if (tls->session != NULL) {
+    gnutls_deinit(tls->session);
+  }
+
+  if (tls->fd >= 0) {
+    proxy_disconnect(tls->fd);
+  }
+
+  g_free(tls->host);
+  g_free(tls->key);
+  g_free(tls);
+}
+
+static void discord_tls_fail(discord_tls *tls, int err)
+{
+  discord_ws *ws = tls->ws;
+  ssl_input_function func = tls->func;
+
+  discord_debug("=== %s %s: %s\n", __func__, tls->key, gnutls_strerror(err));
+  discord_tls_free(tls);
+  func(ws, err, NULL, B_EV_IO_READ);
+}
+
+static gboolean discord_tls_handshake(gpointer data, gint fd,
+                                      b_input_condition cond)
+{
+  discord_tls *tls = data;
+  int ret = gnutls_handshake(tls->session);
+
+  tls->inpa = 0;
+  if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) {
+    tls->inpa = b_input_add(tls->fd,
+                            gnutls_record_get_direction(tls->session) ?
+                            B_EV_IO_WRITE : B_EV_IO_READ,
+                            discord_tls_handshake, tls);
+  } else if (ret < 0) {
+    discord_tls_fail(tls, ret);
+  } else {
+    tls->func(tls->ws, 0, tls, cond);
+  }
+
+  return FALSE;
+}
+
+static gboolean discord_tls_connected(gpointer data, gint fd,
+                                      b_input_condition cond)
+{
+  discord_tls *tls = data;
+  gnutls_datum_t *cached;
+  int ret;
+
+  if (fd < 0) {
+    tls->fd = -1;
+    discord_tls_fail(tls, GNUTLS_E_PUSH_ERROR);
+    return FALSE;
+  }
+
+  tls->fd = fd;
+  sock_make_nonblocking(fd);
+
+  ret = gnutls_init(&tls->session, GNUTLS_CLIENT | GNUTLS_NONBLOCK);
+  if (ret == 0) {
+    ret = gnutls_set_default_priority(tls->session);
+  }
+  if (ret == 0) {
+    ret = gnutls_credentials_set(tls->session, GNUTLS_CRD_CERTIFICATE, cred);
+  }
+  if (ret == 0) {
+    ret = gnutls_server_name_set(tls->session, GNUTLS_NAME_DNS, tls->host,
+                                 strlen(tls->host));
+  }
+  if (ret < 0) {
+    discord_tls_fail(tls, ret);
+    return FALSE;
+  }
+
+  gnutls_session_set_verify_cert(tls->session, tls->host, 0);
+  cached = g_hash_table_lookup(sessions, tls->key);
+  if (cached != NULL) {
+    gnutls_session_set_data(tls->session, cached->data, cached->size);
+  }
+  gnutls_transport_set_int(tls->session, fd);
+
+  return discord_tls_handshake(tls, fd, cond);
+}
+
+static int discord_tls_gnutls_connect(discord_ws *ws, const char *host,
+                                      int port, ssl_input_function func)
+{
+  discord_tls *tls;
+
+  if (!discord_tls_init(ws->ic)) {
+    return -1;
+  }
+
+  tls = g_new0(discord_tls, 1);
+  tls->ws = ws;
+  tls->func = func;
+  tls->host = g_strdup(host);
+  tls->key = g_strdup_printf("%s:%d", host, port);
+  tls->fd = proxy_connect(host, port, discord_tls_connected, tls);
+
+  if (tls->fd < 0) {
+    discord_tls_free(tls);
+    return -1;
+  }
+
+  ws->ssl = tls;
+  return 0;
+}
+#endif
+
+int discord_tls_connect(discord_ws *ws, const char *host, int port,
+                        ssl_input_function func)
+{
+  struct im_connection *ic = ws->ic;
+
+  ws->own_tls = g_strcmp0(set_getstr(&ic->acc->set, "tls_transport"),
+                          "gnutls") == 0;
+#ifdef HAVE_GNUTLS
+  if (ws->own_tls) {
+    return discord_tls_gnutls_connect(ws, host, port, func);
+  }
+#endif
+
+  ws->own_tls = FALSE;
+  ws->ssl = ssl_connect((char *)host, port, TRUE, func, ws);
+  return ws->ssl != NULL ? 0 : -1;
+}
+
+int discord_tls_read(discord_ws *ws, char *buf, int len)
+{
+#ifdef HAVE_GNUTLS
+  if (ws->own_tls) {
+    discord_tls *tls = ws->ssl;
+    ssize_t ret = gnutls_record_recv(tls->session, buf, len);
+
+    tls->again = ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED;
+    if (ret > 0 && !tls->saved) {
+      discord_tls_save(tls);
+    }
+    return ret < 0 ? -1 : ret;
+  }
+#endif
+
+  return ssl_read(ws->ssl, buf, len);
+}
+
+int discord_tls_write(discord_ws *ws, const char *buf, int len)
+{
+#ifdef HAVE_GNUTLS
+  if (ws->own_tls) {
+    discord_tls *tls = ws->ssl;
+    ssize_t ret = gnutls_record_send(tls->session, buf, len);
+
+    tls->again = ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED;
+    return ret < 0 ? -1 : ret;
+  }
+#endif
+
+  return ssl_write(ws->ssl, buf, len);
+}
+
+gboolean discord_tls_again(discord_ws *ws)
+{
+#ifdef HAVE_GNUTLS
+  if (ws->own_tls) {
+    return ((discord_tls *)ws->ssl)->again;
+  }
+#endif
+
+  return ssl_errno == SSL_AGAIN;
+}
+
+int discord_tls_getfd(discord_ws *ws)
+{
+#ifdef HAVE_GNUTLS
+  if (ws->own_tls) {
+    return ((discord_tls *)ws->ssl)->fd;
+  }
+#endif
+
+  return ssl_getfd(ws->ssl);
+}
+
+void discord_tls_disconnect(discord_ws *ws)
+{
+#ifdef HAVE_GNUTLS
+  if (ws->own_tls) {
+    discord_tls *tls = ws->ssl;
+
+    if (tls->session != NULL && tls->inpa == 0) {
+      discord_tls_save(tls);
+      gnutls_bye(tls->session, GNUTLS_SHUT_WR);
+    }
+    discord_tls_free(tls);
+    return;
+  }
+#endif
+
+  ssl_disconnect(ws->ssl);
+}
+
+gboolean discord_tls_resumed(discord_ws *ws)
+{
+#ifdef HAVE_GNUTLS
+  if (ws->own_tls) {
+    return gnutls_session_is_resumed(((discord_tls *)ws->ssl)->session) != 0;
+  }
+#endif
+
+  return FALSE;
+}
+
+/* Returns NULL when the transport can't tell. */
+const char *discord_tls_ktls(discord_ws *ws)
+{
+#if defined(HAVE_GNUTLS) && GNUTLS_VERSION_NUMBER >= 0x030703
+  if (ws->own_tls) {
+    discord_tls *tls = ws->ssl;
+
+    if (tls->session == NULL || tls->inpa > 0) {
+      return NULL;
+    }
+    switch (gnutls_transport_is_ktls_enabled(tls->session)) {
+      case GNUTLS_KTLS_DUPLEX:
+        return "on";
+      case GNUTLS_KTLS_SEND:
+        return "send only";
+      case GNUTLS_KTLS_RECV:
+        return "receive only";
+      default:
+        return "off";
+    }
+  }
+#endif
+
+  return NULL;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright 2015 Artem Savkov <artem.savkov@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "discord.h"
+#include <ssl_client.h>
+
+/* TLS transport of a gateway connection. By default this is bitlbee's own
+ * ssl_client, with tls_transport set to "gnutls" (and the plugin built
+ * against it) the plugin runs the TLS session itself so that it can resume
+ * sessions across reconnects and let GnuTLS hand records to kTLS.
+ *
+ * func is called the same way ssl_connect() calls it: with source set to
+ * ws->ssl once the handshake is done, or NULL after ws->ssl was freed. */
+int discord_tls_connect(discord_ws *ws, const char *host, int port,
+                        ssl_input_function func);
+int discord_tls_read(discord_ws *ws, char *buf, int len);
+int discord_tls_write(discord_ws *ws, const char *buf, int len);
+/* TRUE if the last read or write failed only because it would block. */
+gboolean discord_tls_again(discord_ws *ws);
+int discord_tls_getfd(discord_ws *ws);
+void discord_tls_disconnect(discord_ws *ws);
+
+gboolean discord_tls_resumed(discord_ws *ws);
+const char *discord_tls_ktls(discord_ws *ws);
@@ -14,6 +14,8 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <config.h>
+
 #include "discord-util.h"
 #include <http_client.h>
 #include <stdarg.h>
@@ -87,6 +89,9 @@ void free_server_info(server_info *sinfo)
 
   g_slist_free_full(sinfo->channels, (GDestroyNotify)free_channel_info);
   g_slist_free_full(sinfo->users, (GDestroyNotify)free_user_info);
+  if (sinfo->subscriptions != NULL) {
+    g_hash_table_destroy(sinfo->subscriptions);
+  }
 
   g_free(sinfo);
 }
@@ -101,6 +106,85 @@ void free_gw_data(gw_data *gw)
   }
 }
 
+void free_discord_op(discord_op *op)
+{
+  g_free(op->key);
+  g_string_free(op->payload, TRUE);
+  g_free(op);
+}
+
+/* Splits a gateway url (as returned by GET /gateway or sent as
+ * resume_gateway_url in READY) and fills in the query the account settings
+ * ask for. Returns NULL if the url makes no sense. */
+gw_data *discord_parse_gateway_url(struct im_connection *ic, const char *url)
+{
+  GMatchInfo *match = NULL;
+  GRegex *gwregex = g_regex_new("^(wss?://)?([^/:]+)(:[0-9]+)?(/.*)?$", 0, 0,
+                                NULL);
+  gw_data *gw = NULL;
+
+  if (url != NULL && g_regex_match(gwregex, url, 0, &match)) {
+    gw = g_new0(gw_data, 1);
+
+    gchar *wss = g_match_info_fetch(match, 1);
+    if (g_strcmp0(wss, "wss://") == 0) {
+      gw->wss = 1;
+    } else {
+      gw->wss = 0;
+    }
+    g_free(wss);
+
+    gw->addr = g_match_info_fetch(match, 2);
+    gchar *port = g_match_info_fetch(match, 3);
+    gw->port = (port != NULL && *port == ':') ? atoi(port + 1) : 443;
+    g_free(port);
+    gw->path = g_match_info_fetch(match, 4);
+
+    if (gw->path == NULL || *gw->path == '\0' || g_strcmp0(gw->path, "/") == 0) {
+      g_free(gw->path);
+      gw->path = g_strdup_printf("/?encoding=%s&v=6",
+                                 set_getstr(&ic->acc->set, "encoding"));
+    }
+
+#ifdef HAVE_ZLIB
+    if (set_getbool(&ic->acc->set, "compression")) {
+      gchar *path = gw->path;
+      gw->path = g_strconcat(path, strchr(path, '?') ? "&" : "?",
+                             "compress=zlib-stream", NULL);
+      g_free(path);
+    }
+#endif
+  }
+
+  g_match_info_free(match);
+  g_regex_unref(gwregex);
+
+  return gw;
+}
+
+/* Keeps the resume_state setting in step with the session, so the account
+ * can RESUME it after a restart, see discord_do_cached_login(). Bots and
+ * shards get their servers from GUILD_CREATE, which RESUME doesn't repeat,
+ * and shared sessions are picked up by the other accounts already: those
+ * always start a new session. */
+void discord_save_session(struct im_connection *ic)
+{
+  discord_data *dd = ic->proto_data;
+  gw_data *gw = dd->resume_gateway;
+  gchar *state = NULL;
+
+  if (dd->session_id != NULL && gw != NULL && !dd->bot &&
+      !set_getbool(&ic->acc->set, "share_session")) {
+    state = g_strdup_printf("%s %"G_GUINT64_FORMAT" %s://%s:%d",
+                            dd->session_id, dd->seq, gw->wss ? "wss" : "ws",
+                            gw->addr, gw->port);
+  }
+  if (g_strcmp0(state, set_getstr(&ic->acc->set, "resume_state")) != 0) {
+    set_setstr(&ic->acc->set, "resume_state", state);
+  }
+  g_free(state);
+}
+
 static void free_pending_req(struct http_request *req)
 {
   http_close(req);
@@ -114,12 +198,22 @@ static void free_pending_ev(gpointer *ev)
 void free_discord_data(discord_data *dd)
 {
   g_hash_table_destroy(dd->sent_message_ids);
+  g_hash_table_destroy(dd->event_stats);
+  g_queue_free_full(dd->outq, (GDestroyNotify)free_discord_op);
   g_slist_free_full(dd->pending_events, (GDestroyNotify)free_pending_ev);
   g_slist_free_full(dd->pending_reqs, (GDestroyNotify)free_pending_req);
   g_slist_free_full(dd->pchannels, (GDestroyNotify)free_channel_info);
   g_slist_free_full(dd->servers, (GDestroyNotify)free_server_info);
 
   free_gw_data(dd->gateway);
+  free_gw_data(dd->resume_gateway);
+  for (int i = 0; i < G_N_ELEMENTS(dd->conns); i++) {
+    g_string_free(dd->conns[i].buf, TRUE);
+    g_string_free(dd->conns[i].frag, TRUE);
+    g_string_free(dd->conns[i].obuf, TRUE);
+    g_string_free(dd->conns[i].wbuf, TRUE);
+    g_string_free(dd->conns[i].zbuf, TRUE);
+  }
   g_free(dd->token);
   g_free(dd->uname);
   g_free(dd->session_id);
@@ -327,6 +421,143 @@ user_info *get_user(discord_data *dd, const char *uname,
   return ul == NULL ?  NULL : ul->data;
 }
 
+static const gchar *json_skip_ws(const gchar *p, const gchar *end)
+{
+  while (p < end && g_ascii_isspace(*p)) {
+    p++;
+  }
+  return p;
+}
+
+/* p is at the opening quote, returns what follows the closing one. */
+static const gchar *json_skip_string(const gchar *p, const gchar *end)
+{
+  for (p++; p < end; p++) {
+    if (*p == '\\') {
+      p++;
+    } else if (*p == '"') {
+      return p + 1;
+    }
+  }
+  return NULL;
+}
+
+/* Returns what follows the value at p, which for scalars is the ',' or '}'
+ * ending them. Nothing is checked beyond finding where the value ends. */
+static const gchar *json_skip_value(const gchar *p, const gchar *end)
+{
+  guint depth = 0;
+
+  while (p < end) {
+    switch (*p) {
+      case '"':
+        p = json_skip_string(p, end);
+        if (p == NULL || depth == 0) {
+          return p;
+        }
+        continue;
+      case '{':
+      case '[':
+        depth++;
+        break;
+      case '}':
+      case ']':
+        if (depth == 0) {
+          return p;
+        }
+        if (--depth == 0) {
+          return p + 1;
+        }
+        break;
+      case ',':
+        if (depth == 0) {
+          return p;
+        }
+        break;
+    }
+    p++;
+  }
+  return NULL;
+}
+
+/* Picks op, t and s out of the top level of a payload without parsing it,
+ * "d" is only stepped over. Returns FALSE if the payload doesn't look like
+ * one, it is up to json_parse() to complain about it then. */
+gboolean discord_json_envelope(const gchar *buf, gsize size,
+                               discord_envelope *env)
+{
+  const gchar *p = json_skip_ws(buf, buf + size);
+  const gchar *end = buf + size;
+  guint found = 0;
+
+  env->op = -1;
+  env->t[0] = '\0';
+  env->s = -1;
+
+  if (p >= end || *p != '{') {
+    return FALSE;
+  }
+  p++;
+
+  while (found < 3) {
+    const gchar *key, *val;
+    gsize klen;
+
+    p = json_skip_ws(p, end);
+    if (p >= end || *p != '"') {
+      return FALSE;
+    }
+    key = p + 1;
+    p = json_skip_string(p, end);
+    if (p == NULL) {
+      return FALSE;
+    }
+    klen = p - key - 1;
+
+    p = json_skip_ws(p, end);
+    if (p >= end || *p != ':') {
+      return FALSE;
+    }
+    val = json_skip_ws(p + 1, end);
+    p = json_skip_value(val, end);
+    if (p == NULL || p >= end) {
+      return FALSE;
+    }
+
+    if (klen == 1 && key[0] == 't') {
+      found++;
+      if (*val == '"') {
+        gsize vlen = p - val - 2;
+
+        if (vlen >= sizeof(env->t) || memchr(val + 1, '\\', vlen) != NULL) {
+          return FALSE;
+        }
+        memcpy(env->t, val + 1, vlen);
+        env->t[vlen] = '\0';
+      }
+    } else if (klen == 1 && key[0] == 's') {
+      found++;
+      if (g_ascii_isdigit(*val)) {
+        env->s = g_ascii_strtoll(val, NULL, 10);
+      }
+    } else if (klen == 2 && key[0] == 'o' && key[1] == 'p') {
+      found++;
+      if (!g_ascii_isdigit(*val)) {
+        return FALSE;
+      }
+      env->op = g_ascii_strtoll(val, NULL, 10);
+    }
+
+    p = json_skip_ws(p, end);
+    if (p >= end || *p != ',') {
+      break;
+    }
+    p++;
+  }
+
+  return env->op >= 0;
+}
+
 char *discord_canonize_name(const char *name)
 {
   return str_reject_chars(g_strdup(name), "@+ ", '_');
@@ -40,6 +40,19 @@ void free_discord_data(discord_data *dd);
 void free_server_info(server_info *sinfo);
 void free_user_info(user_info *uinfo);
 void free_gw_data(gw_data *gw);
+void free_discord_op(discord_op *op);
+gw_data *discord_parse_gateway_url(struct im_connection *ic, const char *url);
+void discord_save_session(struct im_connection *ic);
+
+/* op, t and s of a gateway payload, see discord_json_envelope(). */
+typedef struct {
+  gint   op;
+  gchar  t[64];  /* empty if null */
+  gint64 s;      /* -1 if null */
+} discord_envelope;
+
+gboolean discord_json_envelope(const gchar *buf, gsize size,
+                               discord_envelope *env);
 char *discord_canonize_name(const char *name);
 char *discord_escape_string(const char *msg);
 void discord_debug(char *format, ...);
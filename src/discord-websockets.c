@@ -15,410 +15,1737 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <config.h>
-#include <ssl_client.h>
 #include <events.h>
+#include <json_util.h>
 
 #include "discord-websockets.h"
 #include "discord-handlers.h"
+#include "discord-etf.h"
+#include "discord-json.h"
+#include "discord-reconnect.h"
+#include "discord-session.h"
+#include "discord-tls.h"
 #include "discord-util.h"
 #include "discord.h"
 
-#define DISCORD_STATUS_TIMEOUT 500
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#define WS_READ_CHUNK 16384
+#define WS_MAX_HANDSHAKE 4096
+#define WS_INFLATE_CHUNK 65536
+#define WS_OUT_HIGH_WATER (1024 * 1024)
+/* Largest frame or reassembled message we are willing to hold, READY for a
+ * big account is a few MiB so this only stops a broken length field. */
+#define WS_MAX_FRAME (64 * 1024 * 1024)
+#define DISCORD_SUB_PAGE 100
+#define DISCORD_SUB_MAX_PAGES 10
+#define DISCORD_SUB_FLUSH_DELAY 250
+/* Gateway send limit per connection, heartbeats are never held back and the
+ * last few sends of the budget are kept for them. */
+#define DISCORD_SEND_BUDGET 120
+#define DISCORD_SEND_WINDOW 60000
+#define DISCORD_SEND_RESERVE 5
+
+typedef enum {
+  WS_OP_CONTINUATION = 0x0,
+  WS_OP_TEXT = 0x1,
+  WS_OP_BINARY = 0x2,
+  WS_OP_CLOSE = 0x8,
+  WS_OP_PING = 0x9,
+  WS_OP_PONG = 0xa
+} ws_opcode;
+
+typedef enum {
+  WS_CLOSE_MESSAGE_TOO_BIG = 1009,
+  WS_CLOSE_AUTHENTICATION_FAILED = 4004,
+  WS_CLOSE_INVALID_SEQ = 4007,
+  WS_CLOSE_SESSION_TIMED_OUT = 4009,
+  WS_CLOSE_INVALID_SHARD = 4010,
+  WS_CLOSE_SHARDING_REQUIRED = 4011,
+  WS_CLOSE_INVALID_API_VERSION = 4012,
+  WS_CLOSE_INVALID_INTENTS = 4013,
+  WS_CLOSE_DISALLOWED_INTENTS = 4014
+} ws_close_code;
+
+typedef enum {
+  GATEWAY_INTENT_GUILDS = 1 << 0,
+  GATEWAY_INTENT_GUILD_MEMBERS = 1 << 1,
+  GATEWAY_INTENT_GUILD_VOICE_STATES = 1 << 7,
+  GATEWAY_INTENT_GUILD_PRESENCES = 1 << 8,
+  GATEWAY_INTENT_GUILD_MESSAGES = 1 << 9,
+  GATEWAY_INTENT_DIRECT_MESSAGES = 1 << 12,
+  GATEWAY_INTENT_MESSAGE_CONTENT = 1 << 15
+} gateway_intent;
+
+typedef enum {
+  CLIENT_CAPABILITY_DEDUPE_USER_OBJECTS = 1 << 4
+} client_capability;
 
 typedef struct {
-  struct im_connection *ic;
-  gchar *status;
-  gchar *msg;
-} status_data;
+  guint8   flags;
+  guint8   opcode;
+  gboolean mask;
+  guchar   mkey[4];
+  gsize    hlen;
+  guint64  plen;
+} ws_frame;
+
+/* Masks (or unmasks) data in place. The key is applied a machine word at a
+ * time, which the compiler turns into vector instructions where it can. */
+static void discord_ws_mask(const guchar key[4], gchar *data, gsize size)
+{
+  guint32 k32;
+  guint64 k64;
+  gsize i = 0;
+
+  memcpy(&k32, key, sizeof(k32));
+  k64 = ((guint64)k32 << 32) | k32;
+
+  for (; i + sizeof(k64) <= size; i += sizeof(k64)) {
+    guint64 w;
+    memcpy(&w, data + i, sizeof(w));
+    w ^= k64;
+    memcpy(data + i, &w, sizeof(w));
+  }
+
+  for (; i < size; i++) {
+    data[i] ^= key[i % 4];
+  }
+}
+
+/* The gateway to connect to, Discord wants sessions resumed through the url
+ * it gave us in READY. */
+static gw_data *discord_ws_gateway(discord_data *dd, gboolean resume)
+{
+  if (resume && dd->session_id != NULL && dd->resume_gateway != NULL) {
+    return dd->resume_gateway;
+  }
+  return dd->gateway;
+}
+
+/* Where a connection should go: shards resume on their own gateway, the
+ * main session follows discord_ws_gateway(). */
+static gw_data *discord_ws_conn_gateway(discord_ws *ws)
+{
+  discord_data *dd = ws->ic->proto_data;
+  discord_shard *shard = ws->shard;
+
+  if (shard != NULL) {
+    if (shard->session_id != NULL && shard->resume_gateway != NULL) {
+      return shard->resume_gateway;
+    }
+    return dd->gateway;
+  }
+  return discord_ws_gateway(dd, ws == dd->ws_next || dd->reconnecting);
+}
+
+/* Sequence number of the session a connection belongs to. */
+guint64 *discord_ws_seq(discord_ws *ws)
+{
+  discord_data *dd = ws->ic->proto_data;
+
+  return ws->shard != NULL ? &ws->shard->seq : &dd->seq;
+}
+
+static void discord_ws_remove_event(gint *event)
+{
+  if (*event > 0) {
+    b_event_remove(*event);
+    *event = 0;
+  }
+}
+
+/* Shuts a single connection down, leaving it ready to be opened again. */
+static void discord_ws_close(discord_ws *ws)
+{
+  discord_data *dd = ws->ic->proto_data;
+
+  discord_ws_remove_event(&ws->keepalive_loop_id);
+  discord_ws_remove_event(&ws->heartbeat_timeout_id);
+  discord_ws_remove_event(&ws->wsid);
+  discord_ws_remove_event(&ws->inpa);
+  discord_ws_remove_event(&ws->outpa);
+
+  g_string_truncate(ws->buf, 0);
+  g_string_truncate(ws->frag, 0);
+  ws->frag_op = 0;
+  g_string_truncate(ws->obuf, 0);
+  g_string_truncate(ws->wbuf, 0);
+  g_string_truncate(ws->zbuf, 0);
+
+  if (ws->stream != NULL) {
+    discord_json_stream_free(ws->stream);
+    ws->stream = NULL;
+    if (ws == dd->ws) {
+      discord_stream_abort(ws->ic);
+    }
+  }
+
+#ifdef HAVE_ZLIB
+  if (ws->zstream != NULL) {
+    inflateEnd(ws->zstream);
+    g_free(ws->zstream);
+    ws->zstream = NULL;
+  }
+#endif
+
+  if (ws->ssl != NULL) {
+    discord_tls_disconnect(ws);
+    ws->ssl = NULL;
+  }
+
+  ws->state = WS_IDLE;
+}
+
+static void discord_ws_reconnect(discord_ws *ws)
+{
+  struct im_connection *ic = ws->ic;
+  discord_data *dd = ic->proto_data;
+
+  if (ws->shard != NULL) {
+    discord_ws_shard_reconnect(ws->shard);
+  } else if (ws == dd->ws_next) {
+    /* The replacement didn't make it, do it the slow way. */
+    discord_ws_close(ws);
+    dd->ws_next = NULL;
+    discord_soft_reconnect(ic);
+  } else if (dd->ws_next != NULL) {
+    /* The old connection went away before the replacement has RESUMED
+       (discord may drop it as soon as it sees the RESUME). Events are
+       already coming through the new one, so just let it take over. */
+    discord_ws_close(ws);
+    dd->ws = dd->ws_next;
+    dd->ws_next = NULL;
+    dd->reconnecting = TRUE;
+    dd->state = dd->ws->state;
+  } else if (dd->state == WS_READY) {
+    discord_soft_reconnect(ic);
+  } else {
+    imc_logout(ic, TRUE);
+  }
+}
+
+/* Failing to set up the primary connection means the session is gone,
+ * failing to set up its replacement only means we have to reconnect. */
+static void discord_ws_connect_failed(discord_ws *ws)
+{
+  discord_data *dd = ws->ic->proto_data;
+
+  if (ws == dd->ws_next || ws->shard != NULL) {
+    discord_ws_reconnect(ws);
+  } else {
+    /* Maybe the gateway we remembered is gone, look it up next time. */
+    set_setstr(&ws->ic->acc->set, "gateway_cache", NULL);
+    imc_logout(ws->ic, TRUE);
+  }
+}
+
+static gboolean discord_ws_flush_cb(gpointer data, gint fd,
+                                    b_input_condition cond)
+{
+  discord_ws *ws = data;
+  discord_data *dd = ws->ic->proto_data;
+
+  for (;;) {
+    int ret;
+
+    /* Bytes that the TLS layer refused as would-block have to be offered again
+       exactly as they were, so new frames only go to obuf and the two
+       buffers are swapped once the in-flight one is done. */
+    if (ws->wbuf->len == 0) {
+      GString *tmp = ws->wbuf;
+
+      if (ws->obuf->len == 0) {
+        break;
+      }
+      ws->wbuf = ws->obuf;
+      ws->obuf = tmp;
+    }
+
+    ret = discord_tls_write(ws, ws->wbuf->str, ws->wbuf->len);
+    if (ret > 0) {
+      dd->stats.ws_writes++;
+      dd->stats.ws_bytes_out += ret;
+      g_string_erase(ws->wbuf, 0, ret);
+    } else if (ret < 0 && discord_tls_again(ws)) {
+      return TRUE;
+    } else {
+      ws->outpa = 0;
+      imcb_error(ws->ic, "Failed to write ws data.");
+      discord_ws_reconnect(ws);
+      return FALSE;
+    }
+  }
+
+  ws->outpa = 0;
+  return FALSE;
+}
+
+static void discord_ws_flush(discord_ws *ws)
+{
+  if (ws->outpa == 0) {
+    ws->outpa = b_input_add(ws->sslfd, B_EV_IO_WRITE, discord_ws_flush_cb,
+                            ws);
+  }
+}
+
+/* Queues a frame for sending. Everything queued before we get back to the
+ * event loop goes out in a single write once the socket is writable. */
+static int discord_ws_send_frame(discord_ws *ws, guint8 opcode,
+                                 const char *pload, guint64 psize)
+{
+  discord_data *dd = ws->ic->proto_data;
+  GString *buf = ws->obuf;
+  guchar hdr[14];
+  gsize hlen = 2;
+  gsize flen;
+  guchar mkey[4];
+
+  if (ws->ssl == NULL || ws->state < WS_CONNECTED) {
+    return -1;
+  }
+
+  random_bytes(mkey, sizeof(mkey));
+
+  hdr[0] = 0x80 | opcode;
+  if (psize < 126) {
+    hdr[1] = (guchar)(psize | 0x80);
+  } else if (psize > G_MAXUINT16) {
+    guint64 esize = GUINT64_TO_BE(psize);
+    hdr[1] = (guchar)(127 | 0x80);
+    memcpy(hdr + hlen, &esize, sizeof(esize));
+    hlen += sizeof(esize);
+  } else {
+    guint16 esize = GUINT16_TO_BE(psize);
+    hdr[1] = (guchar)(126 | 0x80);
+    memcpy(hdr + hlen, &esize, sizeof(esize));
+    hlen += sizeof(esize);
+  }
+  memcpy(hdr + hlen, mkey, sizeof(mkey));
+  hlen += sizeof(mkey);
+
+  /* The frame is assembled at the end of the outbound queue, the payload is
+     copied once and masked where it lands. */
+  flen = buf->len;
+  g_string_append_len(buf, (gchar*)hdr, hlen);
+  g_string_append_len(buf, pload, psize);
+  discord_ws_mask(mkey, buf->str + flen + hlen, psize);
+  dd->stats.ws_frames_out++;
+
+  discord_ws_flush(ws);
+
+  return hlen + psize;
+}
+
+/* Queues a close frame and offers it to the socket right away, the caller
+ * is about to tear the connection down and nobody will flush it later. */
+static void discord_ws_send_close(discord_ws *ws, guint16 code)
+{
+  guint16 ecode = GUINT16_TO_BE(code);
+
+  if (discord_ws_send_frame(ws, WS_OP_CLOSE, (gchar*)&ecode,
+                            sizeof(ecode)) > 0 && ws->wbuf->len == 0) {
+    discord_tls_write(ws, ws->obuf->str, ws->obuf->len);
+  }
+}
+
+static void discord_ws_refill(discord_ws *ws)
+{
+  gint64 now = g_get_monotonic_time();
+
+  ws->send_tokens = MIN(DISCORD_SEND_BUDGET, ws->send_tokens +
+                        (now - ws->send_refill) * DISCORD_SEND_BUDGET /
+                        (DISCORD_SEND_WINDOW * 1000.0));
+  ws->send_refill = now;
+}
+
+static int discord_ws_send(discord_ws *ws, const char *pload, guint64 psize)
+{
+  discord_data *dd = ws->ic->proto_data;
+  GString *etf = NULL;
+  int ret;
+
+  discord_debug(">>> (%s) %s %"G_GUINT64_FORMAT"\n%s\n", dd->uname, __func__, psize, pload);
+
+  discord_ws_refill(ws);
+  ws->send_tokens -= 1;
+
+  if (dd->etf) {
+    /* Payloads are put together as JSON, the gateway wants them in the
+       encoding it was asked for. */
+    json_value *js = json_parse(pload, psize);
+    etf = discord_etf_encode(js);
+    json_value_free(js);
+    ret = discord_ws_send_frame(ws, WS_OP_BINARY, etf->str, etf->len);
+    g_string_free(etf, TRUE);
+  } else {
+    ret = discord_ws_send_frame(ws, WS_OP_TEXT, pload, psize);
+  }
+
+  return ret;
+}
+
+static gboolean discord_ws_queue_drain(gpointer data, gint fd,
+                                       b_input_condition cond)
+{
+  struct im_connection *ic = data;
+  discord_data *dd = ic->proto_data;
+  discord_ws *ws = dd->ws;
+
+  dd->outq_id = 0;
+  // READY or RESUMED will get back to us
+  if (dd->state != WS_READY) {
+    return FALSE;
+  }
+
+  if (!g_queue_is_empty(dd->outq) &&
+      ws->obuf->len + ws->wbuf->len > WS_OUT_HIGH_WATER) {
+    /* The socket hasn't taken anything for a while, it is either dead or
+       about to be. Keep the ops queued where they collapse instead of
+       piling frames up, the heartbeat timeout takes care of a dead one.
+       Handshakes, heartbeats and control frames don't come through here
+       and always go out. */
+    discord_debug("=== (%s) %s outbound buffer is full, holding ops\n",
+                  dd->uname, __func__);
+    dd->stats.ws_ops_held++;
+    dd->outq_id = b_timeout_add(DISCORD_SEND_WINDOW / DISCORD_SEND_BUDGET,
+                                discord_ws_queue_drain, ic);
+    return FALSE;
+  }
+
+  discord_ws_refill(ws);
+  while (!g_queue_is_empty(dd->outq) &&
+         ws->send_tokens >= DISCORD_SEND_RESERVE + 1) {
+    discord_op *op = g_queue_pop_head(dd->outq);
+
+    discord_ws_send(ws, op->payload->str, op->payload->len);
+    /* Bots have a presence per shard. */
+    if (dd->shards != NULL && g_strcmp0(op->key, "status") == 0) {
+      for (guint i = 0; i < dd->shards->len; i++) {
+        discord_shard *shard = g_ptr_array_index(dd->shards, i);
+
+        if (shard->ready) {
+          discord_ws_send(&shard->ws, op->payload->str, op->payload->len);
+        }
+      }
+    }
+    free_discord_op(op);
+  }
+
+  if (!g_queue_is_empty(dd->outq)) {
+    gdouble missing = DISCORD_SEND_RESERVE + 1 - ws->send_tokens;
+
+    dd->outq_id = b_timeout_add(missing * DISCORD_SEND_WINDOW /
+                                DISCORD_SEND_BUDGET + 1,
+                                discord_ws_queue_drain, ic);
+  }
+  return FALSE;
+}
+
+/* Sends whatever is queued as far as the budget allows, unless a drain is
+ * already scheduled. */
+void discord_ws_queue_flush(struct im_connection *ic)
+{
+  discord_data *dd = discord_session_leader(ic->proto_data);
+
+  if (dd->outq_id == 0) {
+    discord_ws_queue_drain(dd->ic, 0, 0);
+  }
+}
+
+/* Takes over payload. An op queued under the same key is replaced in place,
+ * only the latest of them matters. */
+static void discord_ws_queue(discord_data *dd, const char *key,
+                             GString *payload)
+{
+  dd = discord_session_leader(dd);
+  dd->stats.ops_queued++;
+
+  if (key != NULL) {
+    for (GList *l = dd->outq->head; l; l = l->next) {
+      discord_op *op = l->data;
+
+      if (g_strcmp0(op->key, key) == 0) {
+        g_string_free(op->payload, TRUE);
+        op->payload = payload;
+        dd->stats.ops_collapsed++;
+        discord_ws_queue_flush(dd->ic);
+        return;
+      }
+    }
+  }
+
+  discord_op *op = g_new0(discord_op, 1);
+  op->key = g_strdup(key);
+  op->payload = payload;
+  g_queue_push_tail(dd->outq, op);
+  discord_ws_queue_flush(dd->ic);
+}
+
+static void discord_ws_merge_subscriptions(GHashTable *subs,
+                                           server_info *sinfo)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+
+  sinfo->subs_dirty = FALSE;
+  if (sinfo->subscriptions == NULL) {
+    return;
+  }
+
+  g_hash_table_iter_init(&iter, sinfo->subscriptions);
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    if (GPOINTER_TO_UINT(value) >
+        GPOINTER_TO_UINT(g_hash_table_lookup(subs, key))) {
+      g_hash_table_insert(subs, key, value);
+    }
+  }
+}
+
+/* Lazy guild requests (op 14) carry the complete set of channels we want
+ * member lists for, anything left out is unsubscribed. A channel subscribed
+ * with n pages always gets the first page plus the last two of its n, which
+ * is as many ranges as the gateway accepts per channel. In low traffic mode
+ * the set is sent empty, with typing and activities off. On a shared
+ * session the set is what all accounts on it want together. */
+static void discord_ws_sync_guild(discord_data *dd, server_info *sinfo)
+{
+  GString *buf = g_string_new("");
+  GHashTable *subs = g_hash_table_new(g_str_hash, g_str_equal);
+  GHashTableIter iter;
+  gpointer key, value;
+  gboolean first = TRUE;
+  gboolean low_traffic = dd->low_traffic;
+  gchar *qkey = g_strdup_printf("sync:%s", sinfo->id);
+
+  discord_ws_merge_subscriptions(subs, sinfo);
+  for (GSList *fl = dd->followers; fl; fl = g_slist_next(fl)) {
+    discord_data *fdd = fl->data;
+    server_info *fsinfo = get_server_by_id(fdd, sinfo->id);
+
+    low_traffic &= fdd->low_traffic;
+    if (fsinfo != NULL) {
+      discord_ws_merge_subscriptions(subs, fsinfo);
+    }
+  }
+
+  g_string_printf(buf, "{\"op\":%d,\"d\":{\"guild_id\":\"%s\",\"typing\":%s,\"activities\":%s,\"channels\":{",
+                  OPCODE_REQUEST_SYNC_CHANNEL, sinfo->id,
+                  low_traffic ? "false" : "true",
+                  low_traffic ? "false" : "true");
+
+  if (!low_traffic) {
+    g_hash_table_iter_init(&iter, subs);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+      guint pages = GPOINTER_TO_UINT(value);
+
+      g_string_append_printf(buf, "%s\"%s\":[[0,%u]", first ? "" : ",",
+                             (char *)key, DISCORD_SUB_PAGE - 1);
+      for (guint p = MAX(pages, 3) - 2; p < pages; p++) {
+        g_string_append_printf(buf, ",[%u,%u]", p * DISCORD_SUB_PAGE,
+                               (p + 1) * DISCORD_SUB_PAGE - 1);
+      }
+      g_string_append_c(buf, ']');
+      first = FALSE;
+    }
+  }
+  g_string_append(buf, "}}}");
+
+  discord_ws_queue(dd, qkey, buf);
+  g_hash_table_destroy(subs);
+  g_free(qkey);
+}
+
+static gboolean discord_ws_subscriptions_flush(gpointer data, gint fd,
+                                               b_input_condition cond)
+{
+  struct im_connection *ic = data;
+  discord_data *dd = ic->proto_data;
+
+  dd->subs_flush_id = 0;
+  // READY or RESUMED will get back to us
+  if (dd->state != WS_READY) {
+    return FALSE;
+  }
+
+  for (GSList *sl = dd->servers; sl; sl = g_slist_next(sl)) {
+    server_info *sinfo = sl->data;
+    gboolean dirty = sinfo->subs_dirty;
+
+    for (GSList *fl = dd->followers; fl && !dirty; fl = g_slist_next(fl)) {
+      server_info *fsinfo = get_server_by_id(fl->data, sinfo->id);
+
+      dirty = fsinfo != NULL && fsinfo->subs_dirty;
+    }
+    if (dirty) {
+      discord_ws_sync_guild(dd, sinfo);
+    }
+  }
+  return FALSE;
+}
+
+/* Changes are collected for a moment so that joining a bunch of channels
+ * (auto_join after login) results in a single request per guild. */
+static void discord_ws_subscriptions_schedule(struct im_connection *ic)
+{
+  discord_data *dd = discord_session_leader(ic->proto_data);
+
+  if (dd->subs_flush_id == 0) {
+    dd->subs_flush_id = b_timeout_add(DISCORD_SUB_FLUSH_DELAY,
+                                      discord_ws_subscriptions_flush, dd->ic);
+  }
+}
+
+void discord_ws_subscribe(struct im_connection *ic, channel_info *cinfo)
+{
+  server_info *sinfo = cinfo->to.channel.sinfo;
+
+  if (sinfo->subscriptions == NULL) {
+    sinfo->subscriptions = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                 g_free, NULL);
+  }
+
+  if (!g_hash_table_contains(sinfo->subscriptions, cinfo->id)) {
+    g_hash_table_insert(sinfo->subscriptions, g_strdup(cinfo->id),
+                        GUINT_TO_POINTER(1));
+    sinfo->subs_dirty = TRUE;
+    discord_ws_subscriptions_schedule(ic);
+  }
+}
+
+void discord_ws_unsubscribe(struct im_connection *ic, channel_info *cinfo)
+{
+  server_info *sinfo = cinfo->to.channel.sinfo;
+
+  if (sinfo->subscriptions != NULL &&
+      g_hash_table_remove(sinfo->subscriptions, cinfo->id)) {
+    sinfo->subs_dirty = TRUE;
+    discord_ws_subscriptions_schedule(ic);
+  }
+}
+
+/* Called for every SYNC of a member list range. If it came back full and it
+ * is the last range a channel asked for, there is more to see so ask for the
+ * next page. The list id in the update can't be mapped to a channel, so all
+ * channels of the guild sitting at that range move on together. */
+void discord_ws_subscriptions_page(struct im_connection *ic,
+                                   const char *guild_id, guint start,
+                                   guint end, guint count)
+{
+  discord_data *dd = ic->proto_data;
+  server_info *sinfo = get_server_by_id(dd, guild_id);
+  GHashTableIter iter;
+  gpointer key, value;
+
+  if (sinfo == NULL || sinfo->subscriptions == NULL ||
+      count < end - start + 1) {
+    return;
+  }
+
+  g_hash_table_iter_init(&iter, sinfo->subscriptions);
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    guint pages = GPOINTER_TO_UINT(value);
+
+    if (pages < DISCORD_SUB_MAX_PAGES &&
+        end == pages * DISCORD_SUB_PAGE - 1) {
+      g_hash_table_iter_replace(&iter, GUINT_TO_POINTER(pages + 1));
+      sinfo->subs_dirty = TRUE;
+    }
+  }
+
+  if (sinfo->subs_dirty) {
+    discord_ws_subscriptions_schedule(ic);
+  }
+}
+
+/* After READY the gateway knows nothing about our subscriptions, after
+ * RESUMED it does but changes made while we were away are still pending. */
+void discord_ws_resubscribe(struct im_connection *ic, gboolean all)
+{
+  discord_data *dd = ic->proto_data;
+  gboolean pending = FALSE;
+
+  for (GSList *sl = dd->servers; sl; sl = g_slist_next(sl)) {
+    server_info *sinfo = sl->data;
+
+    if (all && sinfo->subscriptions != NULL &&
+        g_hash_table_size(sinfo->subscriptions) > 0) {
+      sinfo->subs_dirty = TRUE;
+    }
+    pending |= sinfo->subs_dirty;
+  }
+
+  if (pending) {
+    discord_ws_subscriptions_schedule(ic);
+  }
+}
+
+/* While away nobody looks at member lists, so with away_low_traffic on the
+ * guild subscriptions are dropped and only messages keep coming. Coming
+ * back subscribes again and the SYNCs that follow refill the rosters. */
+static void discord_ws_low_traffic(struct im_connection *ic, gboolean on)
+{
+  discord_data *dd = ic->proto_data;
+
+  if (dd->low_traffic == on) {
+    return;
+  }
+
+  dd->low_traffic = on;
+  if (set_getbool(&ic->acc->set, "verbose")) {
+    imcb_log(ic, on ? "Away, dropping member list subscriptions" :
+                      "Back, resubscribing to member lists");
+  }
+  discord_ws_resubscribe(ic, TRUE);
+}
+
+void discord_ws_sync_private_group(discord_data *dd, const char *channel_id)
+{
+  GString *buf = g_string_new("");
+  g_string_printf(buf, "{\"op\":%d,\"d\":{\"channel_id\":\"%s\"}}",
+                  OPCODE_REQUEST_SYNC_PRIVATE_GROUP, channel_id);
+  discord_ws_queue(dd, NULL, buf);
+}
+
+static gboolean discord_ws_heartbeat_timeout(gpointer data, gint fd,
+                                             b_input_condition cond)
+{
+  discord_ws *ws = data;
+  struct im_connection *ic = ws->ic;
+  discord_data *dd = ic->proto_data;
+
+  ws->heartbeat_timeout_id = 0;
+  if (set_getbool(&ic->acc->set, "verbose")) {
+    imcb_log(ic, "Heartbeat timed out, reconnecting...");
+  }
+  if (ws == dd->ws_next || ws->shard != NULL) {
+    discord_ws_reconnect(ws);
+  } else {
+    discord_soft_reconnect(ic);
+  }
+  return FALSE;
+}
+
+/* Only ask for the events we actually do something with. Typing and
+ * reactions are ignored anyway, presences don't matter when every buddy is
+ * shown online and voice states only feed voice_status_notify. */
+static guint32 discord_ws_intents(struct im_connection *ic)
+{
+  guint32 intents = GATEWAY_INTENT_GUILDS | GATEWAY_INTENT_GUILD_MEMBERS |
+                    GATEWAY_INTENT_GUILD_MESSAGES |
+                    GATEWAY_INTENT_DIRECT_MESSAGES |
+                    GATEWAY_INTENT_MESSAGE_CONTENT;
+
+  if (!set_getbool(&ic->acc->set, "never_offline")) {
+    intents |= GATEWAY_INTENT_GUILD_PRESENCES;
+  }
+  if (set_getbool(&ic->acc->set, "voice_status_notify")) {
+    intents |= GATEWAY_INTENT_GUILD_VOICE_STATES;
+  }
+
+  return intents;
+}
+
+static void discord_ws_identify(discord_ws *ws)
+{
+  struct im_connection *ic = ws->ic;
+  discord_data *dd = ic->proto_data;
+  gint threshold = CLAMP(set_getint(&ic->acc->set, "large_threshold"), 50,
+                         250);
+  gboolean presences = !set_getbool(&ic->acc->set, "never_offline");
+  GString *buf;
+
+  if (ws->state != WS_CONNECTED ||
+      (ws->shard == NULL && dd->state != WS_CONNECTED)) {
+    return;
+  }
+
+  buf = g_string_new("");
+  /* guild_subscriptions:false turns off presence and typing events for
+     servers. */
+  g_string_printf(buf, "{\"d\":{\"token\":\"%s\",\"properties\":{\"$browser\":\"bitlbee-discord\",\"$device\":\"bitlbee\",\"$os\":\"linux\"},\"compress\":false,\"large_threshold\":%d,\"guild_subscriptions\":%s",
+                  dd->token, threshold, presences ? "true" : "false");
+  /* Client capabilities are a user account thing, bots don't get to pick
+     what READY looks like. */
+  if (!dd->bot) {
+    g_string_append_printf(buf, ",\"capabilities\":%d",
+                           CLIENT_CAPABILITY_DEDUPE_USER_OBJECTS);
+  }
+  if (set_getbool(&ic->acc->set, "intents")) {
+    g_string_append_printf(buf, ",\"intents\":%u", discord_ws_intents(ic));
+  }
+  if (dd->shard_count > 1) {
+    g_string_append_printf(buf, ",\"shard\":[%u,%u]",
+                           ws->shard ? ws->shard->id : 0, dd->shard_count);
+  }
+  g_string_append_printf(buf, ",\"synced_guilds\":[]},\"op\":%d}",
+                         OPCODE_IDENTIFY);
+  discord_ws_send(ws, buf->str, buf->len);
+  g_string_free(buf, TRUE);
+}
+
+static gboolean discord_ws_writable(gpointer data, int source,
+                                    b_input_condition cond)
+{
+  discord_ws *ws = data;
+  struct im_connection *ic = ws->ic;
+  discord_data *dd = ic->proto_data;
+
+  if (ws->state == WS_CONNECTED) {
+    const char *session_id = NULL;
+
+    if (ws->shard != NULL) {
+      session_id = ws->shard->session_id;
+    } else if (ws == dd->ws_next || dd->reconnecting == TRUE) {
+      session_id = dd->session_id;
+    }
+
+    if (session_id != NULL) {
+      GString *buf = g_string_new("");
+      g_string_printf(buf, "{\"d\":{\"token\":\"%s\",\"session_id\":\"%s\",\"seq\":%"G_GUINT64_FORMAT"},\"op\":%d}", dd->token, session_id, *discord_ws_seq(ws), OPCODE_RESUME);
+      discord_ws_send(ws, buf->str, buf->len);
+      g_string_free(buf, TRUE);
+    } else {
+      /* Starting a new session is rate limited per token. */
+      discord_identify_enqueue(ws, discord_ws_identify);
+    }
+  } else {
+    imcb_error(ic, "Unhandled writable callback.");
+  }
+
+  ws->wsid = 0;
+  return FALSE;
+}
+
+/* Starts a new session on a connection whose session was invalidated. The
+ * connection and everything we know stay as they are, the new READY is
+ * applied on top of it. */
+void discord_ws_reidentify(discord_ws *ws)
+{
+  discord_data *dd = ws->ic->proto_data;
+
+  if (ws->shard != NULL) {
+    g_free(ws->shard->session_id);
+    ws->shard->session_id = NULL;
+    ws->shard->seq = 0;
+    ws->shard->ready = FALSE;
+  } else if (ws == dd->ws_next) {
+    /* The handover RESUME was refused, the new connection will do just as
+       well for a new session. */
+    discord_ws_close(dd->ws);
+    dd->ws = ws;
+    dd->ws_next = NULL;
+  } else if (dd->ws_next != NULL) {
+    discord_ws_close(dd->ws_next);
+    dd->ws_next = NULL;
+  }
+
+  if (ws->shard == NULL) {
+    g_free(dd->session_id);
+    dd->session_id = NULL;
+    dd->seq = 0;
+    dd->resume_start = 0;
+    dd->reconnecting = FALSE;
+    dd->state = WS_CONNECTED;
+  }
+
+  /* Discord wants a random 1-5 second pause before identifying again. */
+  discord_ws_remove_event(&ws->wsid);
+  ws->wsid = b_timeout_add(1000 + g_random_int_range(0, 4000),
+                           discord_ws_writable, ws);
+}
+
+static void discord_ws_callback_on_writable(discord_ws *ws)
+{
+  ws->wsid = b_input_add(ws->sslfd, B_EV_IO_WRITE, discord_ws_writable, ws);
+}
+
+gboolean discord_ws_keepalive_loop(gpointer data, gint fd,
+                                   b_input_condition cond)
+{
+  discord_ws *ws = data;
+  discord_data *dd = ws->ic->proto_data;
+
+  /* Heartbeats start with HELLO, connections waiting for their turn to
+     IDENTIFY have to keep their socket alive as well. */
+  if (ws->state == WS_CONNECTED && dd->state < WS_CLOSING) {
+    GString *buf = g_string_new("");
+
+    guint64 seq = *discord_ws_seq(ws);
+
+    if (seq == 0) {
+      g_string_printf(buf, "{\"op\":%d,\"d\":null}", OPCODE_HEARTBEAT);
+    } else {
+      g_string_printf(buf, "{\"op\":%d,\"d\":%"G_GUINT64_FORMAT"}", OPCODE_HEARTBEAT,
+                      seq);
+    }
+    discord_ws_send(ws, buf->str, buf->len);
+    if (ws->heartbeat_sent == 0) {
+      ws->heartbeat_sent = g_get_monotonic_time();
+    }
+    if (ws->heartbeat_timeout_id == 0) {
+      ws->heartbeat_timeout_id = b_timeout_add((ws->keepalive_interval - 100),
+                                               discord_ws_heartbeat_timeout,
+                                               ws);
+    }
+    g_string_free(buf, TRUE);
+  } else {
+    discord_debug("=== (%s) %s tried to send keepalive in a wrong state: %d\n",
+        dd->uname, __func__, dd->state);
+  }
+  return TRUE;
+}
+
+/* Fills in the round trip times of the last DISCORD_RTT_WINDOW heartbeats
+ * in microseconds, jitter being the mean difference between consecutive
+ * ones. Returns the number of samples. */
+guint discord_ws_rtt(discord_ws *ws, gint64 *last, gint64 *avg,
+                     gint64 *jitter)
+{
+  guint n = MIN(ws->rtt_count, DISCORD_RTT_WINDOW);
+  guint first = ws->rtt_count - n;
+  gint64 sum = 0, diff = 0;
+
+  *last = *avg = *jitter = 0;
+  if (n == 0) {
+    return 0;
+  }
+
+  for (guint i = first; i < ws->rtt_count; i++) {
+    gint64 rtt = ws->rtt[i % DISCORD_RTT_WINDOW];
+
+    sum += rtt;
+    if (i > first) {
+      gint64 prev = ws->rtt[(i - 1) % DISCORD_RTT_WINDOW];
+      diff += rtt > prev ? rtt - prev : prev - rtt;
+    }
+  }
+
+  *last = ws->rtt[(ws->rtt_count - 1) % DISCORD_RTT_WINDOW];
+  *avg = sum / n;
+  *jitter = n > 1 ? diff / (n - 1) : 0;
+  return n;
+}
+
+/* With rtt_threshold set, a connection whose heartbeats took longer than
+ * that on average over a whole window is replaced by a fresh one the same
+ * way a RECONNECT request is, before it gets bad enough to time out. */
+void discord_ws_heartbeat_ack(discord_ws *ws)
+{
+  struct im_connection *ic = ws->ic;
+  discord_data *dd = ic->proto_data;
+  gint threshold = set_getint(&ic->acc->set, "rtt_threshold");
+  gint64 last, avg, jitter;
+
+  discord_ws_remove_event(&ws->heartbeat_timeout_id);
+  if (ws->heartbeat_sent == 0) {
+    return;
+  }
+
+  ws->rtt[ws->rtt_count++ % DISCORD_RTT_WINDOW] =
+    g_get_monotonic_time() - ws->heartbeat_sent;
+  ws->heartbeat_sent = 0;
+  if (ws == dd->ws && dd->state == WS_READY) {
+    discord_save_session(ic);
+  }
+
+  if (threshold <= 0 || ws != dd->ws || dd->state != WS_READY ||
+      discord_ws_rtt(ws, &last, &avg, &jitter) < DISCORD_RTT_WINDOW ||
+      avg / 1000 < threshold) {
+    return;
+  }
+
+  if (set_getbool(&ic->acc->set, "verbose")) {
+    imcb_log(ic, "Gateway latency degraded (%"G_GINT64_FORMAT" ms), "
+             "reconnecting", avg / 1000);
+  }
+  ws->rtt_count = 0;
+  discord_ws_handover(ic);
+}
+
+/* Decodes a frame header from the start of data. Returns FALSE if there are
+ * not enough bytes buffered yet to know the whole header. */
+static gboolean discord_ws_parse_header(const guchar *data, gsize size,
+                                        ws_frame *frame)
+{
+  gsize hlen = 2;
+
+  if (size < hlen) {
+    return FALSE;
+  }
 
-static gchar *discord_ws_mask(guchar key[4], const char *pload,
-                              guint64 psize)
-{
-  gchar *ret = g_malloc0(psize);
+  frame->flags = data[0] & 0xf0;
+  frame->opcode = data[0] & 0x0f;
+  frame->mask = (data[1] & 0x80) != 0;
+  frame->plen = data[1] & 0x7f;
 
-  for (guint64 i = 0; i < psize; i++) {
-    ret[i] = pload[i] ^ key[i % 4];
+  if (frame->plen == 126) {
+    hlen += 2;
+  } else if (frame->plen == 127) {
+    hlen += 8;
+  }
+  if (frame->mask) {
+    hlen += sizeof(frame->mkey);
   }
 
-  return ret;
+  if (size < hlen) {
+    return FALSE;
+  }
+
+  if (frame->plen == 126) {
+    guint16 lbuf;
+    memcpy(&lbuf, data + 2, sizeof(lbuf));
+    frame->plen = GUINT16_FROM_BE(lbuf);
+  } else if (frame->plen == 127) {
+    guint64 lbuf;
+    memcpy(&lbuf, data + 2, sizeof(lbuf));
+    frame->plen = GUINT64_FROM_BE(lbuf);
+  }
+
+  if (frame->mask) {
+    memcpy(frame->mkey, data + hlen - sizeof(frame->mkey),
+           sizeof(frame->mkey));
+  }
+
+  frame->hlen = hlen;
+  return TRUE;
 }
 
-static int discord_ws_send_payload(discord_data *dd, const char *pload,
-                                   guint64 psize)
+/* Appends everything the TLS layer has for us to ws->buf. Returns 1 once
+ * reading would block, 0 if the remote end closed the connection and -1
+ * on error. */
+static int discord_ws_fill_buf(discord_ws *ws)
 {
-  gchar *buf;
-  guint64 hlen = 6;
-  size_t ret = 0;
-  guchar mkey[4];
-  gchar *mpload;
+  discord_data *dd = ws->ic->proto_data;
 
-  discord_debug(">>> (%s) %s %"G_GUINT64_FORMAT"\n%s\n", dd->uname, __func__, psize, pload);
+  for (;;) {
+    gsize len = ws->buf->len;
+    int ret;
 
-  random_bytes(mkey, sizeof(mkey));
-  mpload = discord_ws_mask(mkey, pload, psize);
+    g_string_set_size(ws->buf, len + WS_READ_CHUNK);
+    ret = discord_tls_read(ws, ws->buf->str + len, WS_READ_CHUNK);
+    g_string_set_size(ws->buf, len + MAX(ret, 0));
 
-  if (psize > 125) {
-    if (psize > G_MAXUINT16) {
-      hlen += 8;
-    } else {
-      hlen += 2;
+    if (ret > 0) {
+      dd->stats.ws_bytes_in += ret;
+    } else if (ret == 0) {
+      return 0;
+    } else if (ret < 0) {
+      return discord_tls_again(ws) ? 1 : -1;
     }
   }
+}
 
-  buf = g_malloc0(hlen + psize);
+#ifdef HAVE_ZLIB
+/* Runs data through the connection's inflate context, appending the output
+ * to ws->zbuf. Returns FALSE if that failed and the connection is being
+ * reestablished. */
+static gboolean discord_ws_inflate_data(discord_ws *ws, const gchar *data,
+                                        gsize size)
+{
+  discord_data *dd = ws->ic->proto_data;
+  z_stream *zs = ws->zstream;
+  int ret;
 
-  buf[0] = 0x81; // Text frame
-  if (psize < 126) {
-    buf[1] = (gchar)(psize | 0x80);
-  } else if (psize > G_MAXUINT16) {
-    guint64 esize = GUINT64_TO_BE(psize);
-    buf[1] = (gchar)(127 | 0x80);
-    memcpy(buf + 2, &esize, sizeof(esize));
-  } else {
-    guint16 esize = GUINT16_TO_BE(psize);
-    buf[1] = (gchar)(126 | 0x80);
-    memcpy(buf + 2, &esize, sizeof(esize));
-  }
+  dd->stats.zlib_in += size;
+  zs->next_in = (Bytef*)data;
+  zs->avail_in = size;
 
-  memcpy(buf + hlen - sizeof(mkey), &mkey, sizeof(mkey));
-  memcpy(buf + hlen, mpload, psize);
-  g_free(mpload);
+  do {
+    gsize len = ws->zbuf->len;
 
-  ret = ssl_write(dd->ssl, buf, hlen + psize);
+    g_string_set_size(ws->zbuf, len + WS_INFLATE_CHUNK);
+    zs->next_out = (Bytef*)ws->zbuf->str + len;
+    zs->avail_out = WS_INFLATE_CHUNK;
+    ret = inflate(zs, Z_SYNC_FLUSH);
+    g_string_set_size(ws->zbuf, len + WS_INFLATE_CHUNK - zs->avail_out);
 
-  g_free(buf);
-  return ret;
-}
+    if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      imcb_error(ws->ic, "Failed to inflate gateway data: %s",
+                 zs->msg ? zs->msg : "unknown error");
+      discord_ws_reconnect(ws);
+      return FALSE;
+    }
+  } while (zs->avail_out == 0);
 
-void discord_ws_sync_server(discord_data *dd, const char *id)
-{
-  GString *buf = g_string_new("");
-  g_string_printf(buf, "{\"op\":%d,\"d\":[\"%s\"]}", OPCODE_REQUEST_SYNC, id);
-  discord_ws_send_payload(dd, buf->str, buf->len);
-  g_string_free(buf, TRUE);
+  return TRUE;
 }
 
-void discord_ws_sync_channel(discord_data *dd, const char *guild_id,
-                             const char *channel_id, unsigned int members)
+/* Feeds a binary frame to the connection's inflate context. zlib-stream
+ * messages end with a Z_SYNC_FLUSH marker, so once a frame carries it the
+ * inflated message is complete and gets handed to the parser. */
+static gboolean discord_ws_inflate(discord_ws *ws, const gchar *data,
+                                   gsize size)
 {
-  GString *buf = g_string_new("");
-  g_string_printf(buf, "{\"op\":%d,\"d\":{\"guild_id\":\"%s\",\"typing\":true,\"activities\":true,\"channels\":{\"%s\":[[0,%u]]}}}",
-                  OPCODE_REQUEST_SYNC_CHANNEL, guild_id, channel_id, members);
-  discord_ws_send_payload(dd, buf->str, buf->len);
-  g_string_free(buf, TRUE);
-}
+  discord_data *dd = ws->ic->proto_data;
+  gboolean disconnected;
 
-void discord_ws_sync_private_group(discord_data *dd, const char *channel_id)
-{
-  GString *buf = g_string_new("");
-  g_string_printf(buf, "{\"op\":%d,\"d\":{\"channel_id\":\"%s\"}}",
-                  OPCODE_REQUEST_SYNC_PRIVATE_GROUP, channel_id);
-  discord_ws_send_payload(dd, buf->str, buf->len);
-  g_string_free(buf, TRUE);
-}
+  if (!discord_ws_inflate_data(ws, data, size)) {
+    return TRUE;
+  }
 
-static gboolean discord_ws_heartbeat_timeout(gpointer data, gint fd,
-                                             b_input_condition cond)
-{
-  struct im_connection *ic = data;
-  if (set_getbool(&ic->acc->set, "verbose")) {
-    imcb_log(ic, "Heartbeat timed out, reconnecting...");
+  if (size < 4 || memcmp(data + size - 4, "\x00\x00\xff\xff", 4) != 0) {
+    return FALSE;
   }
-  discord_soft_reconnect(ic);
-  return FALSE;
+
+  dd->stats.zlib_out += ws->zbuf->len;
+  disconnected = discord_parse_message(ws->ic, ws, ws->zbuf->str,
+                                       ws->zbuf->len);
+  if (!disconnected) {
+    g_string_truncate(ws->zbuf, 0);
+  }
+
+  return disconnected;
 }
+#endif
 
-static gboolean discord_ws_writable(gpointer data, int source,
-                                    b_input_condition cond)
+static gboolean discord_ws_handle_payload(discord_ws *ws, gchar *pload,
+                                          gsize size)
 {
-  struct im_connection *ic = data;
-  discord_data *dd = ic->proto_data;
-  if (dd->state == WS_CONNECTED) {
-    GString *buf = g_string_new("");
-    if (dd->reconnecting == TRUE) {
-      g_string_printf(buf, "{\"d\":{\"token\":\"%s\",\"session_id\":\"%s\",\"seq\":%"G_GUINT64_FORMAT"},\"op\":%d}", dd->token, dd->session_id, dd->seq, OPCODE_RESUME);
-    } else {
-      g_string_printf(buf, "{\"d\":{\"token\":\"%s\",\"properties\":{\"$referring_domain\":\"\",\"$browser\":\"bitlbee-discord\",\"$device\":\"bitlbee\",\"$referrer\":\"\",\"$os\":\"linux\"},\"compress\":false,\"large_threshold\":250,\"synced_guilds\":[]},\"op\":%d}", dd->token, OPCODE_IDENTIFY);
-    }
+  discord_data *dd = ws->ic->proto_data;
 
-    discord_ws_send_payload(dd, buf->str, buf->len);
-    g_string_free(buf, TRUE);
-  } else {
-    imcb_error(ic, "Unhandled writable callback.");
+  dd->stats.ws_frames_in++;
+#ifdef HAVE_ZLIB
+  if (ws->zstream != NULL) {
+    return discord_ws_inflate(ws, pload, size);
   }
+#endif
 
-  dd->wsid = 0;
-  return FALSE;
+  return discord_parse_message(ws->ic, ws, pload, size);
 }
 
-static void discord_ws_callback_on_writable(struct im_connection *ic)
+/* Large messages like READY or GUILD_CREATE are parsed while they are still
+ * coming in rather than once they are complete, so neither the payload nor
+ * the whole tree has to be kept. That is only done for JSON messages in a
+ * single frame, and not when the payload is needed for sharing the session
+ * with other accounts. */
+static gboolean discord_ws_stream_wanted(discord_ws *ws, ws_frame *frame)
 {
+  struct im_connection *ic = ws->ic;
   discord_data *dd = ic->proto_data;
-  dd->wsid = b_input_add(dd->sslfd, B_EV_IO_WRITE, discord_ws_writable, ic);
+  gint threshold = set_getint(&ic->acc->set, "stream_threshold");
+
+  return threshold > 0 && frame->plen >= (guint64)threshold && !dd->etf &&
+         (frame->flags & 0xf0) == 0x80 && !frame->mask &&
+         (frame->opcode == WS_OP_TEXT || frame->opcode == WS_OP_BINARY) &&
+         ws->frag_op == WS_OP_CONTINUATION && ws->zbuf->len == 0 &&
+         !set_getbool(&ic->acc->set, "share_session");
 }
 
-gboolean discord_ws_keepalive_loop(gpointer data, gint fd,
-                                   b_input_condition cond)
+/* Hands whatever arrived of a streamed frame to the parser and takes it out
+ * of the buffer, acting on the message once the frame is complete. Returns
+ * FALSE if the connection went away meanwhile. */
+static gboolean discord_ws_stream_feed(discord_ws *ws)
 {
-  struct im_connection *ic = data;
+  struct im_connection *ic = ws->ic;
   discord_data *dd = ic->proto_data;
+  gsize len = MIN(ws->buf->len, ws->stream_left);
+  const gchar *data = ws->buf->str;
+  gsize size = len;
+  gint inpa = ws->inpa;
+  gboolean ok;
+  json_value *js;
 
-  if (dd->state > WS_CONNECTED && dd->state < WS_CLOSING) {
-    GString *buf = g_string_new("");
-
-    if (dd->seq == 0) {
-      g_string_printf(buf, "{\"op\":%d,\"d\":null}", OPCODE_HEARTBEAT);
-    } else {
-      g_string_printf(buf, "{\"op\":%d,\"d\":%"G_GUINT64_FORMAT"}", OPCODE_HEARTBEAT,
-                      dd->seq);
+#ifdef HAVE_ZLIB
+  if (ws->zstream != NULL) {
+    if (!discord_ws_inflate_data(ws, ws->buf->str, len)) {
+      return FALSE;
     }
-    discord_ws_send_payload(dd, buf->str, buf->len);
-    dd->heartbeat_timeout_id = b_timeout_add((dd->keepalive_interval - 100),
-                                             discord_ws_heartbeat_timeout, ic);
-    g_string_free(buf, TRUE);
-  } else {
-    discord_debug("=== (%s) %s tried to send keepalive in a wrong state: %d\n",
-        dd->uname, __func__, dd->state);
+    dd->stats.zlib_out += ws->zbuf->len;
+    data = ws->zbuf->str;
+    size = ws->zbuf->len;
   }
-  return TRUE;
+#endif
+  ws->stream_bytes += size;
+  ok = discord_json_stream_feed(ws->stream, data, size);
+  g_string_truncate(ws->zbuf, 0);
+
+  g_string_erase(ws->buf, 0, len);
+  ws->stream_left -= len;
+
+  if (!ok) {
+    imcb_error(ic, "Failed to parse streamed gateway message");
+    discord_ws_reconnect(ws);
+    return FALSE;
+  }
+  if (ws->stream_left > 0) {
+    return TRUE;
+  }
+
+  js = discord_json_stream_finish(ws->stream);
+  ws->stream = NULL;
+  dd->stats.streamed++;
+  dd->stats.streamed_bytes += ws->stream_bytes;
+
+  return !discord_parse_streamed(ic, ws, js, ws->stream_bytes) &&
+         ws->inpa == inpa;
 }
 
-static void discord_ws_reconnect(struct im_connection *ic)
+/* The gateway dropped the session together with the connection. The
+ * connection comes back without a session_id, which makes it IDENTIFY
+ * through the identify queue. */
+static void discord_ws_session_lost(discord_ws *ws)
 {
-  discord_data *dd = ic->proto_data;
+  discord_data *dd = ws->ic->proto_data;
 
-  if (dd->state == WS_READY) {
-    discord_soft_reconnect(ic);
+  if (ws->shard != NULL) {
+    g_free(ws->shard->session_id);
+    ws->shard->session_id = NULL;
+    ws->shard->seq = 0;
+    discord_ws_shard_reconnect(ws->shard);
   } else {
-    imc_logout(ic, TRUE);
+    g_free(dd->session_id);
+    dd->session_id = NULL;
+    dd->seq = 0;
+    discord_soft_reconnect(ws->ic);
   }
 }
 
-static gboolean discord_ws_in_cb(gpointer data, int source,
-                                 b_input_condition cond)
+/* Handles a close frame. Returns after the connection was dealt with, one
+ * way or another. */
+static void discord_ws_handle_close(discord_ws *ws, const gchar *pload,
+                                    gsize size)
 {
-  struct im_connection *ic = (struct im_connection *)data;
+  struct im_connection *ic = ws->ic;
   discord_data *dd = ic->proto_data;
+  guint16 code = 0;
 
-  if (dd->state == WS_CONNECTING) {
-    gchar buf[4096] = "";
-    if (ssl_read(dd->ssl, buf, sizeof(buf)) < 1) {
-      if (ssl_errno == SSL_AGAIN)
-        return TRUE;
-      imcb_error(ic, "Failed to do ssl_read while switching to websocket mode: %d", ssl_errno);
-      imc_logout(ic, TRUE);
-      return FALSE;
-    }
-    if (g_strrstr_len(buf, 25, "101 Switching") != NULL && \
-        g_str_has_suffix(buf, "\r\n\r\n")) {
-      dd->state = WS_CONNECTED;
-      discord_ws_callback_on_writable(ic);
-    } else {
-      discord_debug("<<< (%s) %s switching failure. buf:\n%s\n", dd->uname, __func__, buf);
-      imcb_error(ic, "Failed to switch to websocket mode");
-      imc_logout(ic, TRUE);
-      return FALSE;
-    }
-  } else {
-    gchar buf = 0 ;
-    guint64 len = 0;
-    gboolean mask = FALSE;
-    guchar mkey[4] = {0};
-    gpointer rdata = NULL;
-    guint64 read = 0;
-    gboolean disconnected;
+  if (size >= sizeof(code)) {
+    memcpy(&code, pload, sizeof(code));
+    code = GUINT16_FROM_BE(code);
+  }
 
-    if (ssl_read(dd->ssl, &buf, 1) < 1) {
-      if (ssl_errno == SSL_AGAIN)
-        return TRUE;
-      imcb_error(ic, "Failed to read ws header.");
-      discord_ws_reconnect(ic);
-      return FALSE;
-    }
+  discord_debug("<<< (%s) %s close code %u: %.*s\n", dd->uname, __func__,
+                code, (int)(size > 2 ? size - 2 : 0), pload + 2);
+  imcb_log(ic, "Remote host is closing websocket connection (%u)", code);
 
-    if ((buf & 0xf0) != 0x80) {
-      imcb_error(ic, "Unexpected websockets header [0x%x], exiting", buf);
-      discord_ws_reconnect(ic);
-      return FALSE;
+  if (code == WS_CLOSE_INVALID_SEQ || code == WS_CLOSE_SESSION_TIMED_OUT) {
+    if (ws == dd->ws_next) {
+      /* Only the handover failed, the old connection is still fine. */
+      discord_ws_close(ws);
+      dd->ws_next = NULL;
+    } else {
+      discord_ws_session_lost(ws);
     }
+    return;
+  }
+
+  /* A shard or a replacement connection going away is no reason to give up
+   * on the account, only the main connection decides that. */
+  if (ws->shard != NULL) {
+    discord_ws_shard_reconnect(ws->shard);
+    return;
+  } else if (ws == dd->ws_next) {
+    discord_ws_close(ws);
+    dd->ws_next = NULL;
+    return;
+  }
 
-    if ((buf & 0x0f) == 8) {
-      imcb_log(ic, "Remote host is closing websocket connection");
-      if (dd->state == WS_CONNECTED) {
+  switch (code) {
+    case WS_CLOSE_AUTHENTICATION_FAILED:
+      if (dd->bot) {
+        /* Nothing to log in again with, the token is the password. */
+        imcb_error(ic, "Bot token was rejected, check the account password");
+        imc_logout(ic, FALSE);
+        break;
+      }
+      imcb_log(ic, "Token expired, cleaning up");
+      set_setstr(&ic->acc->set, "token_cache", NULL);
+      imc_logout(ic, TRUE);
+      break;
+    case WS_CLOSE_INVALID_SHARD:
+    case WS_CLOSE_SHARDING_REQUIRED:
+    case WS_CLOSE_INVALID_API_VERSION:
+    case WS_CLOSE_INVALID_INTENTS:
+    case WS_CLOSE_DISALLOWED_INTENTS:
+      imcb_error(ic, "Gateway refused the connection (%u)", code);
+      imc_logout(ic, FALSE);
+      break;
+    default:
+      if (code == 0 && dd->state == WS_CONNECTED) {
         imcb_log(ic, "Token expired, cleaning up");
         set_setstr(&ic->acc->set, "token_cache", NULL);
         imc_logout(ic, TRUE);
       } else {
-        discord_ws_reconnect(ic);
+        discord_ws_reconnect(ws);
       }
+      break;
+  }
+}
+
+/* Dispatches every complete message in ws->buf, leaving a trailing partial
+ * frame (if any) for the next wakeup. Fragmented messages are collected in
+ * ws->frag, control frames are answered as they come. */
+static gboolean discord_ws_process_buf(discord_ws *ws)
+{
+  struct im_connection *ic = ws->ic;
+  discord_data *dd = ic->proto_data;
+  gint inpa = ws->inpa;
+  gsize off = 0;
+  ws_frame frame;
+
+  if (ws->stream != NULL && !discord_ws_stream_feed(ws)) {
+    return FALSE;
+  }
+
+  while (discord_ws_parse_header((guchar*)ws->buf->str + off,
+                                 ws->buf->len - off, &frame)) {
+    gchar *pload = ws->buf->str + off + frame.hlen;
+    gboolean fin = (frame.flags & 0x80) != 0;
+    gboolean disconnected;
+    gchar term;
+
+    if (frame.plen > WS_MAX_FRAME ||
+        (frame.opcode == WS_OP_CONTINUATION &&
+         ws->frag->len + frame.plen > WS_MAX_FRAME)) {
+      imcb_error(ic, "Websockets frame too large (%" G_GUINT64_FORMAT
+                 " bytes), exiting", frame.plen);
+      discord_ws_send_close(ws, WS_CLOSE_MESSAGE_TOO_BIG);
+      discord_ws_reconnect(ws);
       return FALSE;
     }
 
-    if (ssl_read(dd->ssl, &buf, 1) < 1) {
-      imcb_error(ic, "Failed to read first length byte.");
-      discord_ws_reconnect(ic);
+    if (frame.plen > ws->buf->len - off - frame.hlen) {
+      if (discord_ws_stream_wanted(ws, &frame)) {
+        g_string_erase(ws->buf, 0, off + frame.hlen);
+        dd->stats.ws_frames_in++;
+        ws->stream = discord_stream_new(ws);
+        ws->stream_left = frame.plen;
+        ws->stream_bytes = 0;
+        return discord_ws_stream_feed(ws);
+      }
+      break;
+    }
+    off += frame.hlen + frame.plen;
+
+    if ((frame.flags & 0x70) != 0 ||
+        (frame.opcode >= WS_OP_CLOSE && (!fin || frame.plen > 125))) {
+      imcb_error(ic, "Unexpected websockets header [0x%x], exiting",
+                 frame.flags | frame.opcode);
+      discord_ws_reconnect(ws);
       return FALSE;
     }
-    len = buf & 0x7f;
-    mask = (buf & 0x80) != 0;
 
-    if (len == 126) {
-      guint16 lbuf;
-      if (ssl_read(dd->ssl, (gchar*)&lbuf, 2) < 2) {
-        imcb_error(ic, "Failed to read the rest of length (small).");
-        discord_ws_reconnect(ic);
+    if (frame.mask) {
+      discord_ws_mask(frame.mkey, pload, frame.plen);
+    }
+
+    switch (frame.opcode) {
+      case WS_OP_CLOSE:
+        discord_ws_handle_close(ws, pload, frame.plen);
         return FALSE;
-      }
-      len = GUINT16_FROM_BE(lbuf);
-    } else if (len == 127) {
-      guint64 lbuf;
-      if (ssl_read(dd->ssl, (gchar*)&lbuf, 8) < 8) {
-        imcb_error(ic, "Failed to read the rest of length (big).");
-        discord_ws_reconnect(ic);
+      case WS_OP_PING:
+        discord_ws_send_frame(ws, WS_OP_PONG, pload, frame.plen);
+        continue;
+      case WS_OP_PONG:
+        continue;
+      case WS_OP_CONTINUATION:
+        if (ws->frag_op == WS_OP_CONTINUATION) {
+          imcb_error(ic, "Unexpected websockets continuation frame");
+          discord_ws_reconnect(ws);
+          return FALSE;
+        }
+        g_string_append_len(ws->frag, pload, frame.plen);
+        if (!fin) {
+          continue;
+        }
+
+        disconnected = discord_ws_handle_payload(ws, ws->frag->str,
+                                                 ws->frag->len);
+        if (disconnected || ws->inpa != inpa) {
+          return FALSE;
+        }
+        g_string_truncate(ws->frag, 0);
+        ws->frag_op = WS_OP_CONTINUATION;
+        continue;
+      case WS_OP_TEXT:
+      case WS_OP_BINARY:
+        if (ws->frag_op != WS_OP_CONTINUATION) {
+          imcb_error(ic, "Unexpected websockets frame inside a fragmented "
+                     "message");
+          discord_ws_reconnect(ws);
+          return FALSE;
+        }
+        if (!fin) {
+          ws->frag_op = frame.opcode;
+          g_string_append_len(ws->frag, pload, frame.plen);
+          continue;
+        }
+        break;
+      default:
+        imcb_error(ic, "Unexpected websockets opcode [0x%x], exiting",
+                   frame.opcode);
+        discord_ws_reconnect(ws);
         return FALSE;
-      }
-      len = GUINT64_FROM_BE(lbuf);
     }
 
-    if (mask) {
-      if (ssl_read(dd->ssl, (gchar*)mkey, 4) < 4) {
-        imcb_error(ic, "Failed to read ws data.");
-        discord_ws_reconnect(ic);
-        return FALSE;
-      }
+    /* Temporarily terminate the payload in place instead of copying it out
+       of the buffer, discord_parse_message() expects a string. */
+    term = pload[frame.plen];
+    pload[frame.plen] = '\0';
+    disconnected = discord_ws_handle_payload(ws, pload, frame.plen);
+
+    if (disconnected) {
+      return FALSE;
+    }
+    if (ws->inpa != inpa) {
+      /* The handler tore this connection down (soft-reconnect), whatever is
+         left in the buffer belongs to a dead socket. */
+      return FALSE;
     }
 
-    rdata = g_malloc0(len + 1);
-    while (read < len) {
-      int ret = ssl_read(dd->ssl, rdata + read, len - read);
-      read += ret;
-      if (ret == 0) {
-        break;
-      }
+    pload[frame.plen] = term;
+  }
+
+  g_string_erase(ws->buf, 0, off);
+  return TRUE;
+}
+
+static gboolean discord_ws_in_cb(gpointer data, int source,
+                                 b_input_condition cond)
+{
+  discord_ws *ws = data;
+  struct im_connection *ic = ws->ic;
+  discord_data *dd = ic->proto_data;
+  int ret = discord_ws_fill_buf(ws);
+
+  if (ws->state == WS_CONNECTING) {
+    gchar *hend;
+
+    if (ret < 1) {
+      imcb_error(ic, "Failed to read while switching to websocket mode");
+      ws->inpa = 0;
+      discord_ws_connect_failed(ws);
+      return FALSE;
     }
 
-    if (read != len) {
-        imcb_error(ic, "Short-read on ws data.");
-        discord_ws_reconnect(ic);
-        g_free(rdata);
-        return FALSE;
+    hend = g_strstr_len(ws->buf->str, ws->buf->len, "\r\n\r\n");
+    if (hend == NULL && ws->buf->len < WS_MAX_HANDSHAKE) {
+      return TRUE;
     }
 
-    if (mask) {
-      gchar *mdata = discord_ws_mask(mkey, rdata, len);
-      disconnected = discord_parse_message(ic, mdata, len);
-      g_free(mdata);
+    if (hend != NULL &&
+        g_strrstr_len(ws->buf->str, 25, "101 Switching") != NULL) {
+      g_string_erase(ws->buf, 0, hend + 4 - ws->buf->str);
+      ws->state = WS_CONNECTED;
+      if (ws == dd->ws) {
+        dd->state = WS_CONNECTED;
+      }
+      discord_ws_callback_on_writable(ws);
     } else {
-      disconnected = discord_parse_message(ic, rdata, len);
-    }
-    g_free(rdata);
-    if (disconnected)
+      discord_debug("<<< (%s) %s switching failure. buf:\n%s\n", dd->uname, __func__, ws->buf->str);
+      imcb_error(ic, "Failed to switch to websocket mode");
+      ws->inpa = 0;
+      discord_ws_connect_failed(ws);
       return FALSE;
+    }
+  } else if (ret < 0) {
+    imcb_error(ic, "Failed to read ws data.");
+    ws->inpa = 0;
+    discord_ws_reconnect(ws);
+    return FALSE;
   }
-  if (ssl_pending(dd->ssl)) {
-    /* The SSL library empties the TCP buffers completely but may keep some
-       data in its internal buffers. select() won't see that, but
-       ssl_pending() does. */
-    return discord_ws_in_cb(data, source, cond);
-  } else {
-    return TRUE;
+
+  if (!discord_ws_process_buf(ws)) {
+    return FALSE;
+  }
+
+  if (ret == 0) {
+    imcb_error(ic, "Remote host closed the connection.");
+    ws->inpa = 0;
+    discord_ws_reconnect(ws);
+    return FALSE;
   }
+
+  return TRUE;
 }
 
 static gboolean discord_ws_connected_cb(gpointer data, int retcode,
                                         void *source, b_input_condition cond)
 {
-  struct im_connection *ic = (struct im_connection *)data;
+  discord_ws *ws = data;
+  struct im_connection *ic = ws->ic;
   discord_data *dd = ic->proto_data;
+  gw_data *gw = discord_ws_conn_gateway(ws);
   gchar *bkey;
-  GString *req;
+  gchar *host;
   guchar key[16];
+  gint64 elapsed = g_get_monotonic_time() - ws->connect_start;
 
   if (source == NULL) {
-    dd->ssl = NULL;
+    ws->ssl = NULL;
     imcb_error(ic, "Failed to establish connection.");
-    imc_logout(ic, TRUE);
+    discord_ws_connect_failed(ws);
     return FALSE;
   }
 
+  /* With bitlbee's transport this includes the TCP connect. */
+  dd->stats.tls_handshakes++;
+  dd->stats.tls_handshake_us_last = elapsed;
+  dd->stats.tls_handshake_us_total += elapsed;
+  if (discord_tls_resumed(ws)) {
+    dd->stats.tls_resumed++;
+  }
+
   random_bytes(key, sizeof(key));
 
   bkey = g_base64_encode(key, 16);
+  host = gw->port == 443 ? g_strdup(gw->addr) :
+         g_strdup_printf("%s:%d", gw->addr, gw->port);
 
-  req = g_string_new("");
-  g_string_printf(req, "GET %s HTTP/1.1\r\n"
-                       "Host: %s\r\n"
-                       "Connection: keep-alive, Upgrade\r\n"
-                       "Upgrade: websocket\r\n"
-                       "Origin: %s\r\n"
-                       "Pragma: no-cache\r\n"
-                       "Cache-Control: no-cache\r\n"
-                       "Sec-WebSocket-Version: 13\r\n"
-                       "Sec-WebSocket-Key: %s\r\n"
-                       "\r\n", dd->gateway->path, dd->gateway->addr,
-                       DISCORD_HOST, bkey);
+  /* Goes out like any frame would, so a short or would-block write is
+     finished once the socket is writable again. */
+  g_string_append_printf(ws->obuf, "GET %s HTTP/1.1\r\n"
+                         "Host: %s\r\n"
+                         "Connection: keep-alive, Upgrade\r\n"
+                         "Upgrade: websocket\r\n"
+                         "Origin: %s\r\n"
+                         "Pragma: no-cache\r\n"
+                         "Cache-Control: no-cache\r\n"
+                         "Sec-WebSocket-Version: 13\r\n"
+                         "Sec-WebSocket-Key: %s\r\n"
+                         "\r\n", gw->path, host, DISCORD_HOST, bkey);
 
   g_free(bkey);
+  g_free(host);
 
-  dd->sslfd = ssl_getfd(source);
-  dd->inpa = b_input_add(dd->sslfd, B_EV_IO_READ, discord_ws_in_cb, ic);
-  ssl_write(dd->ssl, req->str, req->len);
-  g_string_free(req, TRUE);
+  ws->sslfd = discord_tls_getfd(ws);
+  ws->inpa = b_input_add(ws->sslfd, B_EV_IO_READ, discord_ws_in_cb, ws);
+  discord_ws_flush(ws);
   return FALSE;
 }
 
-int discord_ws_init(struct im_connection *ic, discord_data *dd)
+static int discord_ws_open(discord_ws *ws, gw_data *gw)
 {
-  dd->ssl = ssl_connect(dd->gateway->addr, 443, TRUE,
-                        discord_ws_connected_cb, ic);
+  ws->keepalive_interval = DEFAULT_KEEPALIVE_INTERVAL;
+  ws->send_tokens = DISCORD_SEND_BUDGET;
+  ws->send_refill = g_get_monotonic_time();
+  ws->heartbeat_sent = 0;
+  ws->rtt_count = 0;
 
-  if (dd->ssl == NULL) {
-    return -1;
+#ifdef HAVE_ZLIB
+  if (set_getbool(&ws->ic->acc->set, "compression")) {
+    ws->zstream = g_new0(z_stream, 1);
+    if (inflateInit(ws->zstream) != Z_OK) {
+      g_free(ws->zstream);
+      ws->zstream = NULL;
+      return -1;
+    }
   }
+#endif
 
-  return 0;
+  ws->state = WS_CONNECTING;
+  ws->connect_start = g_get_monotonic_time();
+
+  return discord_tls_connect(ws, gw->addr, gw->port, discord_ws_connected_cb);
 }
 
-static void discord_ws_remove_event(gint *event)
+int discord_ws_init(struct im_connection *ic, discord_data *dd)
 {
-  if (*event > 0) {
-    b_event_remove(*event);
-    *event = 0;
+  dd->etf = g_strcmp0(set_getstr(&ic->acc->set, "encoding"), "etf") == 0;
+  dd->json_indexed = g_strcmp0(set_getstr(&ic->acc->set, "json_parser"),
+                              "indexed") == 0;
+
+  if (discord_session_attach(dd)) {
+    return 0;
   }
+
+  dd->state = WS_CONNECTING;
+  return discord_ws_open(dd->ws, discord_ws_gateway(dd, dd->reconnecting));
 }
 
-void discord_ws_cleanup(discord_data *dd)
+/* Opens a second connection and RESUMEs the session on it while the current
+ * one keeps delivering events. Once it is RESUMED it replaces the old one,
+ * see discord_ws_handover_complete(). */
+void discord_ws_handover(struct im_connection *ic)
 {
-  discord_ws_remove_event(&dd->keepalive_loop_id);
-  discord_ws_remove_event(&dd->heartbeat_timeout_id);
-  discord_ws_remove_event(&dd->status_timeout_id);
-  discord_ws_remove_event(&dd->wsid);
-  discord_ws_remove_event(&dd->inpa);
+  discord_data *dd = ic->proto_data;
+  discord_ws *ws;
+
+  if (dd->ws_next != NULL) {
+    return;
+  }
+
+  if (dd->state != WS_READY || dd->session_id == NULL ||
+      dd->gateway == NULL) {
+    discord_soft_reconnect(ic);
+    return;
+  }
+
+  ws = dd->ws == &dd->conns[0] ? &dd->conns[1] : &dd->conns[0];
+  dd->ws_next = ws;
+  dd->resume_start = g_get_monotonic_time();
 
-  if (dd->ssl != NULL) {
-    ssl_disconnect(dd->ssl);
-    dd->ssl = NULL;
+  if (discord_ws_open(ws, discord_ws_gateway(dd, TRUE)) < 0 &&
+      dd->ws_next == ws) {
+    discord_ws_close(ws);
+    dd->ws_next = NULL;
+    discord_soft_reconnect(ic);
   }
 }
 
-static gboolean discord_ws_status_postponed(status_data *sd, gint fd,
-                                            b_input_condition cond)
+void discord_ws_handover_complete(discord_data *dd)
 {
-  discord_data *dd = sd->ic->proto_data;
-  if (dd->state != WS_READY) {
-    return TRUE;
+  discord_ws *old = dd->ws;
+  discord_ws *ws = dd->ws_next;
+
+  if (ws == NULL) {
+    return;
+  }
+
+  /* Whole frames that were queued on the old connection but never went out
+     can be sent as they are. */
+  if (old->obuf->len > 0) {
+    g_string_append_len(ws->obuf, old->obuf->str, old->obuf->len);
+    discord_ws_flush(ws);
   }
 
-  discord_ws_set_status(sd->ic, sd->status, sd->msg);
+  dd->ws = ws;
+  dd->ws_next = NULL;
+  discord_ws_close(old);
+}
+
+#define DISCORD_SHARD_BACKOFF_MAX 60000
 
-  g_free(sd->msg);
-  g_free(sd->status);
-  g_free(sd);
-  dd->status_timeout_id = 0;
+static gboolean discord_ws_shard_connect(gpointer data, gint fd,
+                                         b_input_condition cond)
+{
+  discord_shard *shard = data;
+  discord_ws *ws = &shard->ws;
+  discord_data *dd = ws->ic->proto_data;
 
+  shard->reconnect_id = 0;
+  if (dd->gateway == NULL ||
+      discord_ws_open(ws, discord_ws_conn_gateway(ws)) < 0) {
+    discord_ws_shard_reconnect(shard);
+  }
   return FALSE;
 }
 
+/* Shards come back on their own with a capped exponential backoff, the rest
+ * of the account isn't bothered. */
+void discord_ws_shard_reconnect(discord_shard *shard)
+{
+  discord_ws *ws = &shard->ws;
+  guint delay = MIN(1000u << MIN(shard->attempts, 6),
+                    DISCORD_SHARD_BACKOFF_MAX);
+
+  discord_identify_cancel(ws);
+  discord_ws_close(ws);
+  discord_ws_remove_event(&shard->reconnect_id);
+  shard->ready = FALSE;
+  shard->reconnects++;
+  shard->attempts++;
+
+  discord_debug("=== %s shard %u in %u ms\n", __func__, shard->id, delay);
+  shard->reconnect_id = b_timeout_add(delay + g_random_int_range(0, 1000),
+                                      discord_ws_shard_connect, shard);
+}
+
+static discord_shard *discord_ws_shard_new(struct im_connection *ic, guint id)
+{
+  discord_shard *shard = g_new0(discord_shard, 1);
+  discord_ws *ws = &shard->ws;
+
+  shard->id = id;
+  ws->ic = ic;
+  ws->shard = shard;
+  ws->keepalive_interval = DEFAULT_KEEPALIVE_INTERVAL;
+  ws->buf = g_string_sized_new(4096);
+  ws->frag = g_string_sized_new(0);
+  ws->obuf = g_string_sized_new(1024);
+  ws->wbuf = g_string_sized_new(1024);
+  ws->zbuf = g_string_sized_new(4096);
+
+  return shard;
+}
+
+static void discord_ws_shard_free(discord_shard *shard)
+{
+  discord_ws *ws = &shard->ws;
+
+  discord_identify_cancel(ws);
+  discord_ws_remove_event(&shard->reconnect_id);
+  discord_ws_close(ws);
+
+  g_string_free(ws->buf, TRUE);
+  g_string_free(ws->frag, TRUE);
+  g_string_free(ws->obuf, TRUE);
+  g_string_free(ws->wbuf, TRUE);
+  g_string_free(ws->zbuf, TRUE);
+  g_free(shard->session_id);
+  free_gw_data(shard->resume_gateway);
+  g_free(shard);
+}
+
+/* Called once the main session (shard 0) is READY, brings up whichever of
+ * the other shards isn't connected or on its way there. */
+void discord_ws_shards_start(struct im_connection *ic)
+{
+  discord_data *dd = ic->proto_data;
+
+  if (dd->shard_count <= 1) {
+    return;
+  }
+
+  if (dd->shards == NULL) {
+    dd->shards = g_ptr_array_new_with_free_func(
+                   (GDestroyNotify)discord_ws_shard_free);
+    for (guint id = 1; id < dd->shard_count; id++) {
+      g_ptr_array_add(dd->shards, discord_ws_shard_new(ic, id));
+    }
+  }
+
+  for (guint i = 0; i < dd->shards->len; i++) {
+    discord_shard *shard = g_ptr_array_index(dd->shards, i);
+
+    if (shard->ws.state == WS_IDLE && shard->reconnect_id == 0) {
+      discord_ws_shard_connect(shard, 0, 0);
+    }
+  }
+}
+
+void discord_ws_shards_stop(discord_data *dd)
+{
+  if (dd->shards != NULL) {
+    g_ptr_array_free(dd->shards, TRUE);
+    dd->shards = NULL;
+  }
+}
+
+/* READY or RESUMED on one of the extra shards. Guilds arrive as
+ * GUILD_CREATE afterwards, so READY only matters for resuming later. */
+void discord_ws_shard_ready(discord_ws *ws, json_value *data)
+{
+  discord_shard *shard = ws->shard;
+  const char *session_id = json_o_str(data, "session_id");
+
+  if (session_id != NULL) {
+    g_free(shard->session_id);
+    shard->session_id = g_strdup(session_id);
+    free_gw_data(shard->resume_gateway);
+    shard->resume_gateway = discord_parse_gateway_url(ws->ic,
+                              json_o_str(data, "resume_gateway_url"));
+  }
+  shard->ready = TRUE;
+  shard->attempts = 0;
+}
+
+void discord_ws_cleanup(discord_data *dd)
+{
+  discord_identify_cancel(dd->ws);
+  discord_ws_remove_event(&dd->outq_id);
+  discord_ws_remove_event(&dd->subs_flush_id);
+
+  discord_ws_close(dd->ws);
+  if (dd->ws_next != NULL) {
+    discord_ws_close(dd->ws_next);
+    dd->ws_next = NULL;
+  }
+}
+
 void discord_ws_set_status(struct im_connection *ic, gchar *status,
     gchar *message)
 {
@@ -427,17 +1754,8 @@ void discord_ws_set_status(struct im_connection *ic, gchar *status,
   gchar *msg = NULL;
   gchar *stat = NULL;
 
-  if (dd->state != WS_READY) {
-    if (dd->status_timeout_id == 0) {
-      status_data *sdata = g_new0(status_data, 1);
-      sdata->ic = ic;
-      sdata->status = g_strdup(status);
-      sdata->msg = g_strdup(message);
-      dd->status_timeout_id = b_timeout_add(DISCORD_STATUS_TIMEOUT,
-        (b_event_handler)discord_ws_status_postponed, sdata);
-    }
-    return;
-  }
+  discord_ws_low_traffic(ic, status != NULL &&
+                         set_getbool(&ic->acc->set, "away_low_traffic"));
 
   if (message != NULL) {
     msg = discord_escape_string(message);
@@ -466,8 +1784,7 @@ void discord_ws_set_status(struct im_connection *ic, gchar *status,
     }
   }
 
-  discord_ws_send_payload(dd, buf->str, buf->len);
-  g_string_free(buf, TRUE);
+  discord_ws_queue(dd, "status", buf);
   g_free(msg);
   g_free(stat);
 }
@@ -15,6 +15,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "discord.h"
+#include <json.h>
 
 typedef enum {
   OPCODE_DISPATCH,
@@ -39,9 +40,24 @@ gboolean discord_ws_keepalive_loop(gpointer data, gint fd,
 
 int discord_ws_init(struct im_connection *ic, discord_data *dd);
 void discord_ws_cleanup(discord_data *dd);
+void discord_ws_handover(struct im_connection *ic);
+void discord_ws_handover_complete(discord_data *dd);
+void discord_ws_reidentify(discord_ws *ws);
+guint64 *discord_ws_seq(discord_ws *ws);
+void discord_ws_shards_start(struct im_connection *ic);
+void discord_ws_shards_stop(discord_data *dd);
+void discord_ws_shard_reconnect(discord_shard *shard);
+void discord_ws_shard_ready(discord_ws *ws, json_value *data);
+void discord_ws_heartbeat_ack(discord_ws *ws);
+guint discord_ws_rtt(discord_ws *ws, gint64 *last, gint64 *avg,
+                     gint64 *jitter);
+void discord_ws_queue_flush(struct im_connection *ic);
 void discord_ws_set_status(struct im_connection *ic, gchar *status,
     gchar *message);
-void discord_ws_sync_server(discord_data *dd, const char *id);
-void discord_ws_sync_channel(discord_data *dd, const char *guild_id,
-                             const char *channel_id, unsigned int members);
+void discord_ws_subscribe(struct im_connection *ic, channel_info *cinfo);
+void discord_ws_unsubscribe(struct im_connection *ic, channel_info *cinfo);
+void discord_ws_subscriptions_page(struct im_connection *ic,
+                                   const char *guild_id, guint start,
+                                   guint end, guint count);
+void discord_ws_resubscribe(struct im_connection *ic, gboolean all);
 void discord_ws_sync_private_group(discord_data *dd, const char *channel_id);
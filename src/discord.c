@@ -18,6 +18,9 @@
 #include "discord.h"
 #include "discord-http.h"
 #include "discord-util.h"
+#include "discord-reconnect.h"
+#include "discord-session.h"
+#include "discord-tls.h"
 #include "discord-websockets.h"
 #include "help.h"
 
@@ -74,6 +77,38 @@ struct plugin_info *init_plugin_info(void)
 }
 #endif
 
+static char *discord_set_eval_encoding(set_t *set, char *value)
+{
+  if (g_strcmp0(value, "json") != 0 && g_strcmp0(value, "etf") != 0) {
+    return SET_INVALID;
+  }
+
+  return value;
+}
+
+static char *discord_set_eval_json_parser(set_t *set, char *value)
+{
+  if (g_strcmp0(value, "indexed") != 0 && g_strcmp0(value, "bitlbee") != 0) {
+    return SET_INVALID;
+  }
+
+  return value;
+}
+
+static char *discord_set_eval_tls_transport(set_t *set, char *value)
+{
+  if (g_strcmp0(value, "bitlbee") == 0) {
+    return value;
+  }
+#ifdef HAVE_GNUTLS
+  if (g_strcmp0(value, "gnutls") == 0) {
+    return value;
+  }
+#endif
+
+  return SET_INVALID;
+}
+
 static void discord_init(account_t *acc)
 {
   set_t *s;
@@ -110,9 +145,58 @@ static void discord_init(account_t *acc)
   s = set_add(&acc->set, "token_cache", NULL, NULL, acc);
   s->flags |= SET_HIDDEN | SET_NULL_OK;
 
+  s = set_add(&acc->set, "gateway_cache", NULL, NULL, acc);
+  s->flags |= SET_HIDDEN | SET_NULL_OK;
+
+  /* "<session_id> <seq> <resume url>", see discord_save_session(). It is
+     written out whenever bitlbee saves the account, which it does before
+     logging out on quit, so it is kept up to date all the time. */
+  s = set_add(&acc->set, "resume_state", NULL, NULL, acc);
+  s->flags |= SET_HIDDEN | SET_NULL_OK;
+
   s = set_add(&acc->set, "friendship_mode", "on", set_eval_bool, acc);
   s->flags |= ACC_SET_OFFLINE_ONLY;
 
+#ifdef HAVE_ZLIB
+  s = set_add(&acc->set, "compression", "off", set_eval_bool, acc);
+  s->flags |= ACC_SET_OFFLINE_ONLY;
+#endif
+
+  s = set_add(&acc->set, "encoding", "json", discord_set_eval_encoding, acc);
+  s->flags |= ACC_SET_OFFLINE_ONLY;
+
+  s = set_add(&acc->set, "json_parser", "bitlbee", discord_set_eval_json_parser,
+              acc);
+  s->flags |= ACC_SET_OFFLINE_ONLY;
+
+  s = set_add(&acc->set, "stream_threshold", "0", set_eval_int, acc);
+
+  s = set_add(&acc->set, "identify_concurrency", "1", set_eval_int, acc);
+  s = set_add(&acc->set, "identify_interval", "5000", set_eval_int, acc);
+
+  s = set_add(&acc->set, "large_threshold", "250", set_eval_int, acc);
+  s->flags |= ACC_SET_OFFLINE_ONLY;
+
+  s = set_add(&acc->set, "intents", "off", set_eval_bool, acc);
+  s->flags |= ACC_SET_OFFLINE_ONLY;
+
+  s = set_add(&acc->set, "away_low_traffic", "off", set_eval_bool, acc);
+
+  s = set_add(&acc->set, "rtt_threshold", "0", set_eval_int, acc);
+
+  s = set_add(&acc->set, "bot", "off", set_eval_bool, acc);
+  s->flags |= ACC_SET_OFFLINE_ONLY;
+
+  s = set_add(&acc->set, "shards", "0", set_eval_int, acc);
+  s->flags |= ACC_SET_OFFLINE_ONLY;
+
+  s = set_add(&acc->set, "share_session", "off", set_eval_bool, acc);
+  s->flags |= ACC_SET_OFFLINE_ONLY;
+
+  s = set_add(&acc->set, "tls_transport", "bitlbee",
+              discord_set_eval_tls_transport, acc);
+  s->flags |= ACC_SET_OFFLINE_ONLY;
+
   s = set_add(&acc->set, "verbose", "off", set_eval_bool, acc);
 
   acc->flags |= ACC_FLAG_AWAY_MESSAGE;
@@ -121,9 +205,80 @@ static void discord_init(account_t *acc)
   discord_help_init();
 }
 
+/* Picks up the session saved by discord_save_session(), the connection
+ * RESUMEs it instead of IDENTIFYing. RESUMED doesn't come with a READY, the
+ * rest is restored over REST, see discord_restore_start(). Anything going
+ * wrong on the way ends up IDENTIFYing after all. */
+static void discord_load_session(struct im_connection *ic)
+{
+  discord_data *dd = ic->proto_data;
+  const char *state = set_getstr(&ic->acc->set, "resume_state");
+  gchar **parts;
+
+  if (state == NULL || dd->bot ||
+      set_getbool(&ic->acc->set, "share_session")) {
+    return;
+  }
+
+  parts = g_strsplit(state, " ", 3);
+  if (g_strv_length(parts) == 3) {
+    dd->resume_gateway = discord_parse_gateway_url(ic, parts[2]);
+  }
+  if (dd->resume_gateway != NULL) {
+    dd->session_id = g_strdup(parts[0]);
+    dd->seq = g_ascii_strtoull(parts[1], NULL, 10);
+    dd->reconnecting = TRUE;
+    dd->restoring = TRUE;
+    dd->resume_start = g_get_monotonic_time();
+  }
+  g_strfreev(parts);
+}
+
+/* Goes straight to the websocket if we still know where it is from the last
+ * time. */
+static gboolean discord_do_cached_login(struct im_connection *ic,
+                                        const char *token)
+{
+  discord_data *dd = ic->proto_data;
+  gw_data *gw = discord_parse_gateway_url(ic,
+                  set_getstr(&ic->acc->set, "gateway_cache"));
+
+  if (gw == NULL) {
+    return FALSE;
+  }
+
+  free_gw_data(dd->gateway);
+  dd->gateway = gw;
+  if (dd->token != token) {
+    g_free(dd->token);
+    dd->token = g_strdup(token);
+  }
+
+  if (discord_ws_init(ic, dd) < 0) {
+    discord_ws_cleanup(dd);
+    return FALSE;
+  }
+  return TRUE;
+}
+
 static void discord_do_login(struct im_connection *ic)
 {
-  if (set_getstr(&ic->acc->set,"token_cache")) {
+  discord_data *dd = ic->proto_data;
+  gint shards = set_getint(&ic->acc->set, "shards");
+
+  dd->shard_count = dd->bot ? MAX(shards, 1) : 1;
+  if (dd->bot) {
+    /* The password is the bot token. With shards set to 0 the shard count
+       discord recommends comes with the gateway lookup. */
+    set_setstr(&ic->acc->set, "token_cache", NULL);
+    if (shards > 0 && discord_do_cached_login(ic, ic->acc->pass)) {
+      return;
+    }
+    discord_http_get_gateway(ic, ic->acc->pass);
+  } else if (set_getstr(&ic->acc->set,"token_cache")) {
+    if (discord_do_cached_login(ic, set_getstr(&ic->acc->set,"token_cache"))) {
+      return;
+    }
     discord_http_get_gateway(ic, set_getstr(&ic->acc->set,"token_cache"));
   } else {
     discord_http_login(ic->acc);
@@ -135,24 +290,67 @@ static void discord_login(account_t *acc)
   struct im_connection *ic = imcb_new(acc);
 
   discord_data *dd = g_new0(discord_data, 1);
+  dd->ic = ic;
   dd->sent_message_ids = g_hash_table_new_full(g_str_hash, g_str_equal,
                             g_free, NULL);
-  dd->keepalive_interval = DEFAULT_KEEPALIVE_INTERVAL;
+  dd->event_stats = g_hash_table_new_full(g_str_hash, g_str_equal,
+                            g_free, g_free);
+  dd->outq = g_queue_new();
+  dd->bot = set_getbool(&acc->set, "bot");
+  for (int i = 0; i < G_N_ELEMENTS(dd->conns); i++) {
+    discord_ws *ws = &dd->conns[i];
+
+    ws->ic = ic;
+    ws->keepalive_interval = DEFAULT_KEEPALIVE_INTERVAL;
+    ws->buf = g_string_sized_new(4096);
+    ws->frag = g_string_sized_new(0);
+    ws->obuf = g_string_sized_new(1024);
+    ws->wbuf = g_string_sized_new(1024);
+    ws->zbuf = g_string_sized_new(4096);
+  }
+  dd->ws = &dd->conns[0];
   ic->proto_data = dd;
+  /* Without the token it was started with the session can't be resumed. */
+  if (set_getstr(&acc->set, "token_cache") != NULL) {
+    discord_load_session(ic);
+  }
 
-  discord_do_login(ic);
+  discord_reconnect_schedule(ic, discord_do_login);
 }
 
 static void discord_logout(struct im_connection *ic)
 {
   discord_data *dd = ic->proto_data;
 
+  discord_reconnect_cancel(ic);
+  discord_save_session(ic);
+  discord_session_detach(dd);
+  discord_ws_shards_stop(dd);
   discord_ws_cleanup(dd);
 
   free_discord_data(dd);
   g_slist_free(ic->chatlist);
 }
 
+static void discord_do_resume(struct im_connection *ic)
+{
+  discord_data *dd = ic->proto_data;
+
+  dd->resume_start = g_get_monotonic_time();
+
+  /* The token and the gateway we already have are still good, there is no
+     point in asking for them again. Without a session_id left to RESUME the
+     connection IDENTIFYs instead. */
+  if (dd->token != NULL && dd->gateway != NULL) {
+    if (discord_ws_init(ic, dd) == 0) {
+      return;
+    }
+    discord_ws_cleanup(dd);
+  }
+
+  discord_do_login(ic);
+}
+
 void discord_soft_reconnect(struct im_connection *ic)
 {
   discord_data *dd = ic->proto_data;
@@ -162,7 +360,8 @@ void discord_soft_reconnect(struct im_connection *ic)
   }
   discord_ws_cleanup(dd);
   dd->reconnecting = TRUE;
-  discord_do_login(ic);
+  dd->state = WS_IDLE;
+  discord_reconnect_schedule(ic, discord_do_resume);
 }
 
 static void discord_chat_msg(struct groupchat *gc, char *msg, int flags)
@@ -199,7 +398,7 @@ struct groupchat *discord_chat_do_join(struct im_connection *ic,
   if (cinfo != NULL && cinfo->type == CHANNEL_TEXT) {
     sinfo = cinfo->to.channel.sinfo;
     gc = imcb_chat_new(ic, cinfo->to.channel.name);
-    discord_ws_sync_channel(dd, sinfo->id, cinfo->id, 0);
+    discord_ws_subscribe(ic, cinfo);
 
     if (is_auto_join) {
       imcb_chat_name_hint(gc, room);
@@ -253,6 +452,10 @@ struct groupchat *discord_chat_do_join(struct im_connection *ic,
 static void discord_chat_leave(struct groupchat *gc)
 {
   channel_info *cinfo = gc->data;
+
+  if (cinfo->type == CHANNEL_TEXT) {
+    discord_ws_unsubscribe(gc->ic, cinfo);
+  }
   imcb_chat_free(cinfo->to.channel.gc);
   cinfo->to.channel.gc = NULL;
 }
@@ -288,6 +491,176 @@ gboolean discord_is_self(struct im_connection *ic, const char *who)
   return !g_strcmp0(dd->uname, who);
 }
 
+static void discord_cmd_stats(irc_t *irc, account_t *acc)
+{
+  discord_data *dd = acc->ic->proto_data;
+  discord_stats *st = &dd->stats;
+  gint64 last, avg, jitter;
+
+  irc_rootmsg(irc, "%s: websocket in: %"G_GUINT64_FORMAT" bytes, "
+              "%"G_GUINT64_FORMAT" frames", acc->tag, st->ws_bytes_in,
+              st->ws_frames_in);
+  irc_rootmsg(irc, "%s: websocket out: %"G_GUINT64_FORMAT" bytes, "
+              "%"G_GUINT64_FORMAT" frames in %"G_GUINT64_FORMAT" writes, "
+              "%"G_GUINT64_FORMAT" ops held back", acc->tag, st->ws_bytes_out,
+              st->ws_frames_out, st->ws_writes, st->ws_ops_held);
+  if (st->zlib_in > 0) {
+    irc_rootmsg(irc, "%s: zlib-stream: %"G_GUINT64_FORMAT" bytes compressed, "
+                "%"G_GUINT64_FORMAT" bytes inflated", acc->tag, st->zlib_in,
+                st->zlib_out);
+  }
+  irc_rootmsg(irc, "%s: decoder (%s): %"G_GUINT64_FORMAT" bytes in "
+              "%"G_GUINT64_FORMAT" us", acc->tag,
+              dd->etf ? "etf" : dd->json_indexed ? "json, indexed" : "json",
+              st->decode_bytes, st->decode_us);
+  if (st->streamed > 0) {
+    irc_rootmsg(irc, "%s: streamed: %"G_GUINT64_FORMAT" messages, "
+                "%"G_GUINT64_FORMAT" bytes, %"G_GUINT64_FORMAT" items "
+                "handled early", acc->tag, st->streamed, st->streamed_bytes,
+                st->stream_items);
+  }
+  if (st->scan_us > 0) {
+    irc_rootmsg(irc, "%s: envelope scan: %"G_GUINT64_FORMAT" us, "
+                "%"G_GUINT64_FORMAT" bytes of ignored events skipped",
+                acc->tag, st->scan_us, st->skipped_bytes);
+  }
+  irc_rootmsg(irc, "%s: gateway: %"G_GUINT64_FORMAT" lookups, "
+              "%"G_GUINT64_FORMAT" resumes, last %"G_GUINT64_FORMAT" ms, "
+              "avg %"G_GUINT64_FORMAT" ms", acc->tag, st->gateway_lookups,
+              st->resumes, st->resume_us_last / 1000,
+              st->resumes ? st->resume_us_total / st->resumes / 1000 : 0);
+  irc_rootmsg(irc, "%s: identify: %"G_GUINT64_FORMAT" sent, waited in "
+              "queue last %"G_GUINT64_FORMAT" ms, avg %"G_GUINT64_FORMAT" ms",
+              acc->tag, st->identifies, st->identify_wait_us_last / 1000,
+              st->identifies ?
+              st->identify_wait_us_total / st->identifies / 1000 : 0);
+  irc_rootmsg(irc, "%s: tls: %"G_GUINT64_FORMAT" handshakes, "
+              "%"G_GUINT64_FORMAT" resumed, last %"G_GUINT64_FORMAT" ms, "
+              "avg %"G_GUINT64_FORMAT" ms", acc->tag, st->tls_handshakes,
+              st->tls_resumed, st->tls_handshake_us_last / 1000,
+              st->tls_handshakes ?
+              st->tls_handshake_us_total / st->tls_handshakes / 1000 : 0);
+  if (dd->ws->ssl != NULL && discord_tls_ktls(dd->ws) != NULL) {
+    irc_rootmsg(irc, "%s: ktls: %s", acc->tag, discord_tls_ktls(dd->ws));
+  }
+  if (discord_ws_rtt(dd->ws, &last, &avg, &jitter) > 0) {
+    irc_rootmsg(irc, "%s: heartbeat rtt: last %"G_GINT64_FORMAT" ms, "
+                "avg %"G_GINT64_FORMAT" ms, jitter %"G_GINT64_FORMAT" ms",
+                acc->tag, last / 1000, avg / 1000, jitter / 1000);
+  }
+  if (dd->shards != NULL) {
+    guint64 events = st->dispatches;
+
+    for (guint i = 0; i < dd->shards->len; i++) {
+      discord_shard *shard = g_ptr_array_index(dd->shards, i);
+
+      events -= shard->events;
+    }
+    irc_rootmsg(irc, "%s: shard 0/%u: %s, %"G_GUINT64_FORMAT" events",
+                acc->tag, dd->shard_count,
+                dd->state == WS_READY ? "ready" : "connecting", events);
+    for (guint i = 0; i < dd->shards->len; i++) {
+      discord_shard *shard = g_ptr_array_index(dd->shards, i);
+
+      discord_ws_rtt(&shard->ws, &last, &avg, &jitter);
+      irc_rootmsg(irc, "%s: shard %u/%u: %s, %"G_GUINT64_FORMAT" events, "
+                  "%"G_GUINT64_FORMAT" reconnects, rtt avg "
+                  "%"G_GINT64_FORMAT" ms", acc->tag, shard->id,
+                  dd->shard_count, shard->ready ? "ready" : "connecting",
+                  shard->events, shard->reconnects, avg / 1000);
+    }
+  }
+  if (dd->leader != NULL) {
+    irc_rootmsg(irc, "%s: session: following %s", acc->tag,
+                dd->leader->ic->acc->tag);
+  } else if (dd->followers != NULL) {
+    irc_rootmsg(irc, "%s: session: shared with %u accounts, %u events kept "
+                "for replay", acc->tag, g_slist_length(dd->followers),
+                dd->journal ? g_queue_get_length(dd->journal) : 0);
+  }
+  irc_rootmsg(irc, "%s: outbound ops: %"G_GUINT64_FORMAT" queued, "
+              "%"G_GUINT64_FORMAT" superseded, %u pending", acc->tag,
+              st->ops_queued, st->ops_collapsed, g_queue_get_length(dd->outq));
+}
+
+static gint discord_cmp_event_stats(const discord_event_stats *a,
+                                    const discord_event_stats *b)
+{
+  return a->bytes < b->bytes ? 1 : a->bytes > b->bytes ? -1 : 0;
+}
+
+static void discord_cmd_event_stats(irc_t *irc, account_t *acc)
+{
+  discord_data *dd = acc->ic->proto_data;
+  GSList *events = NULL;
+  GHashTableIter iter;
+  gpointer value;
+
+  g_hash_table_iter_init(&iter, dd->event_stats);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    events = g_slist_insert_sorted(events, value,
+                                   (GCompareFunc)discord_cmp_event_stats);
+  }
+
+  for (GSList *l = events; l; l = l->next) {
+    discord_event_stats *es = l->data;
+
+    if (es->skipped > 0) {
+      /* What parsing them would have taken at the decoder's average rate,
+         less the time spent on the envelopes. */
+      gint64 saved = dd->stats.decode_bytes == 0 ? 0 :
+                     (gint64)(es->skipped_bytes * dd->stats.decode_us /
+                              dd->stats.decode_bytes) - es->scan_us;
+
+      irc_rootmsg(irc, "%s: event %s: %"G_GUINT64_FORMAT" (%"G_GUINT64_FORMAT
+                  " bytes), %"G_GUINT64_FORMAT" skipped, ~%"G_GINT64_FORMAT
+                  " us saved", acc->tag, es->name, es->count, es->bytes,
+                  es->skipped, saved);
+    } else {
+      irc_rootmsg(irc, "%s: event %s: %"G_GUINT64_FORMAT" (%"G_GUINT64_FORMAT
+                  " bytes)", acc->tag, es->name, es->count, es->bytes);
+    }
+  }
+  g_slist_free(events);
+}
+
+static void discord_cmd_reconnect_queue(irc_t *irc)
+{
+  guint waiting, active;
+
+  discord_reconnect_queue(&waiting, &active);
+  irc_rootmsg(irc, "reconnect queue: %u connecting, %u waiting", active,
+              waiting);
+  irc_rootmsg(irc, "identify queue: %u waiting", discord_identify_queue());
+}
+
+static void discord_cmd(irc_t *irc, char **args)
+{
+  if (g_strcmp0(args[1], "stats") == 0) {
+    account_t *only = args[2] ? account_get(irc->b, args[2]) : NULL;
+
+    if (args[2] != NULL && only == NULL) {
+      irc_rootmsg(irc, "No such account: %s", args[2]);
+      return;
+    }
+
+    for (account_t *acc = irc->b->accounts; acc; acc = acc->next) {
+      if (acc->ic == NULL || g_strcmp0(acc->prpl->name, "discord") != 0 ||
+          (only != NULL && acc != only)) {
+        continue;
+      }
+      discord_cmd_stats(irc, acc);
+      if (only != NULL) {
+        discord_cmd_event_stats(irc, acc);
+      }
+    }
+    discord_cmd_reconnect_queue(irc);
+  } else {
+    irc_rootmsg(irc, "Unknown command: discord %s. See help discord commands.",
+                args[1]);
+  }
+}
+
 static GList *discord_away_states(struct im_connection *ic)
 {
     static GList *m = NULL;
@@ -327,4 +700,5 @@ G_MODULE_EXPORT void init_plugin(void)
   };
   dpp = g_memdup(&pp, sizeof pp);
   register_protocol(dpp);
+  root_command_add("discord", 1, discord_cmd, 0);
 }
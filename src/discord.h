@@ -21,6 +21,7 @@
 
 #define DISCORD_HOST "discordapp.com"
 #define DEFAULT_KEEPALIVE_INTERVAL 30000
+#define DISCORD_RTT_WINDOW 8
 #define DISCORD_MFA_HANDLE "discord_mfa"
 
 typedef enum {
@@ -50,33 +51,149 @@ typedef enum {
 typedef struct _gw_data {
   int wss;
   gchar *addr;
+  int port;
   gchar *path;
 } gw_data;
 
+/* An outbound gateway op waiting for READY or for send budget. Ops with the
+ * same key supersede each other. */
+typedef struct _discord_op {
+  gchar   *key;
+  GString *payload;
+} discord_op;
+
+typedef struct _discord_event_stats {
+  const gchar *name;
+  guint64     count;
+  guint64     bytes;
+  guint64     skipped;        /* dropped after looking at the envelope */
+  guint64     skipped_bytes;
+  guint64     scan_us;
+} discord_event_stats;
+
+typedef struct _discord_stats {
+  guint64 ws_bytes_in;
+  guint64 ws_frames_in;
+  guint64 ws_bytes_out;
+  guint64 ws_frames_out;
+  guint64 ws_ops_held;
+  guint64 ws_writes;
+  guint64 zlib_in;
+  guint64 zlib_out;
+  guint64 decode_bytes;
+  guint64 decode_us;
+  guint64 scan_us;
+  guint64 skipped_bytes;
+  guint64 streamed;
+  guint64 streamed_bytes;
+  guint64 stream_items;
+  guint64 gateway_lookups;
+  guint64 resumes;
+  guint64 resume_us_last;
+  guint64 resume_us_total;
+  guint64 identifies;
+  guint64 identify_wait_us_last;
+  guint64 identify_wait_us_total;
+  guint64 ops_queued;
+  guint64 ops_collapsed;
+  guint64 tls_handshakes;
+  guint64 tls_resumed;
+  guint64 tls_handshake_us_last;
+  guint64 tls_handshake_us_total;
+  guint64 dispatches;
+} discord_stats;
+
+/* A single gateway connection. There are two of them while a RECONNECT is
+ * being handed over to a new connection, see discord_ws_handover(). */
+typedef struct _discord_ws {
+  struct im_connection *ic;
+  struct _discord_shard *shard;
+  ws_state   state;
+  void       *ssl;
+  gboolean   own_tls;
+  int        sslfd;
+  gint64     connect_start;
+  gint       inpa;
+  gint       outpa;
+  gint       wsid;
+  GString    *buf;
+  GString    *frag;
+  guint8     frag_op;
+  GString    *obuf;
+  GString    *wbuf;
+  struct z_stream_s *zstream;  /* only with zlib and compression on */
+  GString    *zbuf;
+  struct _discord_json_stream *stream;  /* large frame still coming in */
+  gsize      stream_left;
+  gsize      stream_bytes;
+  gint       keepalive_interval;
+  gint       keepalive_loop_id;
+  gint       heartbeat_timeout_id;
+  gdouble    send_tokens;
+  gint64     send_refill;
+  gint64     heartbeat_sent;
+  gint64     rtt[DISCORD_RTT_WINDOW];
+  guint      rtt_count;
+} discord_ws;
+
+/* An additional gateway session of a sharded bot account. Shard 0 is the
+ * account's main session living in discord_data, the others only have a
+ * single connection each and feed the same servers, channels and users. */
+typedef struct _discord_shard {
+  guint      id;
+  discord_ws ws;
+  char       *session_id;
+  guint64    seq;
+  gw_data    *resume_gateway;
+  gboolean   ready;
+  gint       reconnect_id;
+  guint      attempts;
+  guint64    events;
+  guint64    reconnects;
+} discord_shard;
+
 typedef struct _discord_data {
+  struct im_connection *ic;
   char       *token;
   char       *id;
   char       *session_id;
   char       *uname;
   gw_data    *gateway;
+  gw_data    *resume_gateway;
+  gint64     resume_start;
+  guint      reconnect_attempts;  /* this login, since READY/RESUMED */
   GSList     *servers;
   GSList     *pchannels;
   gint       main_loop_id;
-  GString    *ws_buf;
+  discord_ws conns[2];
+  discord_ws *ws;
+  discord_ws *ws_next;
+  gboolean   etf;
+  gboolean   json_indexed;
   ws_state   state;
-  gint       keepalive_interval;
-  gint       keepalive_loop_id;
-  gint       heartbeat_timeout_id;
-  gint       status_timeout_id;
-  void       *ssl;
-  int        sslfd;
-  gint       inpa;
-  gint       wsid;
+  GQueue     *outq;
+  gint       outq_id;
+  gint       subs_flush_id;
   guint64    seq;
   GSList     *pending_reqs;
   GSList     *pending_events;
   gboolean   reconnecting;
   GHashTable *sent_message_ids;
+  discord_stats stats;
+  GHashTable *event_stats;
+  GHashTable *ready_users;
+  gboolean   ready_started;  /* READY is partially handled, being streamed */
+  gboolean   ready_resync;
+  gboolean   restoring;      /* RESUMEd from resume_state, no READY yet */
+  guint      restore_pending;
+  gboolean   low_traffic;
+  gboolean   bot;
+  guint      shard_count;
+  GPtrArray  *shards;
+  struct _discord_data *leader;  /* set while following another account */
+  GSList     *followers;
+  GQueue     *journal;           /* READY and what changed since, to replay */
+  gsize      journal_size;
 } discord_data;
 
 typedef struct _server_info {
@@ -85,6 +202,9 @@ typedef struct _server_info {
   GSList               *users;
   GSList               *channels;
   struct im_connection *ic;
+  gboolean             stale;
+  GHashTable           *subscriptions; /* channel id -> member list pages */
+  gboolean             subs_dirty;
 } server_info;
 
 typedef struct _channel_info {
@@ -112,6 +232,7 @@ typedef struct _channel_info {
   } to;
   channel_type         type;
   GSList *pinned;
+  gboolean             stale;
 } channel_info;
 
 typedef struct _user_info {
@@ -120,6 +241,7 @@ typedef struct _user_info {
   channel_info         *voice_channel;
   bee_user_t           *user;
   guint32               flags;
+  gboolean              stale;
 } user_info;
 
 gboolean discord_is_self(struct im_connection *ic, const char *who);
@@ -0,0 +1,103 @@
+/*
+ * Copyright 2015 Artem Savkov <artem.savkov@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "discord-etf.h"
+#include "discord-json.h"
+#include "test-util.h"
+
+/* Decodes every payload with bitlbee's json-parser, the indexed JSON parser
+ * and, after encoding it as ETF, the ETF decoder. All of them have to come
+ * up with the same tree, the time each of them took is printed. Set
+ * BENCH_TIME to the number of milliseconds to spend per decoder and
+ * payload. */
+
+static const char *payloads[] = {
+  "hello",
+  "typing_start",
+  "presence_update",
+  "message_create",
+  "guild_create",
+  "ready",
+  NULL
+};
+
+static void bench_json_parser(const gchar *buf, gsize len)
+{
+  json_value_free(json_parse(buf, len));
+}
+
+static void bench_indexed(const gchar *buf, gsize len)
+{
+  discord_json_free(discord_json_parse(buf, len));
+}
+
+static void bench_etf(const gchar *buf, gsize len)
+{
+  discord_etf_free(discord_etf_decode(buf, len));
+}
+
+int main(void)
+{
+  const char *env = g_getenv("BENCH_TIME");
+  gint64 budget = (env != NULL ? atoi(env) : 200) * 1000;
+
+  printf("%-16s %9s %9s %12s %12s %12s\n", "payload", "json", "etf",
+         "json-parser", "indexed", "etf");
+
+  for (int i = 0; payloads[i] != NULL; i++) {
+    gsize len;
+    gchar *buf = test_payload(payloads[i], &len);
+    json_value *ref = json_parse(buf, len);
+    json_value *js = discord_json_parse(buf, len);
+    GString *etf;
+    gdouble t_ref, t_idx, t_etf;
+
+    if (ref == NULL) {
+      test_fail("%s: json-parser rejected it", payloads[i]);
+      discord_json_free(js);
+      g_free(buf);
+      continue;
+    }
+    TEST_CHECK(test_json_equal(ref, js, FALSE),
+               "%s: indexed parser disagrees with json-parser", payloads[i]);
+    discord_json_free(js);
+
+    etf = discord_etf_encode(ref);
+    js = discord_etf_decode(etf->str, etf->len);
+    TEST_CHECK(test_json_equal(ref, js, TRUE),
+               "%s: ETF round trip disagrees with json-parser", payloads[i]);
+    discord_etf_free(js);
+
+    t_ref = test_bench(bench_json_parser, buf, len, budget);
+    t_idx = test_bench(bench_indexed, buf, len, budget);
+    t_etf = test_bench(bench_etf, etf->str, etf->len, budget);
+
+    printf("%-16s %9zu %9zu %9.1f us %9.1f us %9.1f us\n", payloads[i], len,
+           etf->len, t_ref, t_idx, t_etf);
+    printf("%-16s %9s %9s %7.1f MiB/s %7.1f MiB/s %7.1f MiB/s\n", "", "", "",
+           len / t_ref / 1.048576, len / t_idx / 1.048576,
+           etf->len / t_etf / 1.048576);
+
+    g_string_free(etf, TRUE);
+    json_value_free(ref);
+    g_free(buf);
+  }
+
+  return test_result();
+}
@@ -0,0 +1,347 @@
+/*
+ * Copyright 2015 Artem Savkov <artem.savkov@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <float.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "discord-etf.h"
+#include "test-util.h"
+
+/* What the ETF encoder writes has to decode to the tree it started from,
+ * integers that don't fit into 32 bits coming back as decimal strings.
+ * Nothing short of a whole term may decode and no length field may make
+ * the decoder read past the buffer or allocate for more elements than
+ * there are bytes left. */
+
+/* Has to match ETF_MAX_DEPTH in discord-etf.c. */
+#define MAX_DEPTH 128
+
+static guint checked = 0;
+
+/* Trees are put together with g_new0() and g_malloc(), the way the decoder
+ * does it, so discord_etf_free() frees them too. */
+static json_value *v_new(json_type type)
+{
+  json_value *js = g_new0(json_value, 1);
+  js->type = type;
+  return js;
+}
+
+static json_value *v_int(gint64 i)
+{
+  json_value *js = v_new(json_integer);
+  js->u.integer = i;
+  return js;
+}
+
+static json_value *v_dbl(gdouble d)
+{
+  json_value *js = v_new(json_double);
+  js->u.dbl = d;
+  return js;
+}
+
+static json_value *v_bool(gboolean b)
+{
+  json_value *js = v_new(json_boolean);
+  js->u.boolean = b;
+  return js;
+}
+
+static json_value *v_str(const gchar *s, gsize len)
+{
+  json_value *js = v_new(json_string);
+  js->u.string.ptr = g_malloc(len + 1);
+  memcpy(js->u.string.ptr, s, len);
+  js->u.string.ptr[len] = '\0';
+  js->u.string.length = len;
+  return js;
+}
+
+#define V_STR(s) v_str(s, sizeof(s) - 1)
+
+static json_value *v_arr(guint n, ...)
+{
+  json_value *js = v_new(json_array);
+  va_list args;
+
+  js->u.array.values = g_new0(json_value*, MAX(n, 1));
+  va_start(args, n);
+  for (guint i = 0; i < n; i++) {
+    json_value *v = va_arg(args, json_value*);
+    v->parent = js;
+    js->u.array.values[js->u.array.length++] = v;
+  }
+  va_end(args);
+  return js;
+}
+
+/* n pairs of member name and value. */
+static json_value *v_obj(guint n, ...)
+{
+  json_value *js = v_new(json_object);
+  va_list args;
+
+  js->u.object.values = g_new0(json_object_entry, MAX(n, 1));
+  va_start(args, n);
+  for (guint i = 0; i < n; i++) {
+    json_object_entry *e = &js->u.object.values[i];
+    const gchar *name = va_arg(args, const gchar*);
+
+    e->name = g_strdup(name);
+    e->name_length = strlen(name);
+    e->value = va_arg(args, json_value*);
+    e->value->parent = js;
+    js->u.object.length++;
+  }
+  va_end(args);
+  return js;
+}
+
+static json_value *decode(const gchar *buf, gsize len)
+{
+  checked++;
+  return discord_etf_decode(buf, len);
+}
+
+/* Encodes js, decodes it again and checks every prefix of the encoding is
+ * rejected. Takes js. */
+static void round_trip(const char *name, json_value *js)
+{
+  GString *buf = discord_etf_encode(js);
+  json_value *dec = decode(buf->str, buf->len);
+
+  TEST_CHECK(test_json_equal(js, dec, TRUE), "%s: differs after decoding",
+             name);
+  discord_etf_free(dec);
+
+  for (gsize len = 0; len < buf->len; len++) {
+    dec = decode(buf->str, len);
+    TEST_CHECK(dec == NULL, "%s: %"G_GSIZE_FORMAT" of %"G_GSIZE_FORMAT
+               " bytes decoded", name, len, buf->len);
+    discord_etf_free(dec);
+  }
+
+  g_string_free(buf, TRUE);
+  discord_etf_free(js);
+}
+
+/* Small ones stay integers, anything beyond 32 bits is sent as a bignum
+ * and comes back the way snowflakes do. */
+static void test_integers(void)
+{
+  static const gint64 ints[] = {
+    0, 1, 255, 256, -1, -255, -256, 65536,
+    G_MAXINT32, G_MININT32, (gint64)G_MAXINT32 + 1, (gint64)G_MININT32 - 1,
+    G_GINT64_CONSTANT(80351110224678912), G_MAXINT64, G_MININT64
+  };
+
+  for (guint i = 0; i < G_N_ELEMENTS(ints); i++) {
+    gchar *name = g_strdup_printf("%"G_GINT64_FORMAT, ints[i]);
+    json_value *js = v_int(ints[i]);
+    GString *buf = discord_etf_encode(js);
+    json_value *dec = decode(buf->str, buf->len);
+    json_type want = ints[i] >= G_MININT32 && ints[i] <= G_MAXINT32 ?
+                     json_integer : json_string;
+
+    TEST_CHECK(dec != NULL && dec->type == want,
+               "%s: decoded to the wrong type", name);
+    discord_etf_free(dec);
+    g_string_free(buf, TRUE);
+
+    round_trip(name, js);
+    g_free(name);
+  }
+}
+
+static void test_values(void)
+{
+  json_value *js;
+
+  round_trip("0.0", v_dbl(0.0));
+  round_trip("-0.0", v_dbl(-0.0));
+  round_trip("1.5", v_dbl(1.5));
+  round_trip("-1e-300", v_dbl(-1e-300));
+  round_trip("DBL_MAX", v_dbl(DBL_MAX));
+  round_trip("true", v_bool(TRUE));
+  round_trip("false", v_bool(FALSE));
+  round_trip("null", v_new(json_null));
+  round_trip("empty string", V_STR(""));
+  round_trip("string", V_STR("caf\xc3\xa9 \xf0\x9f\x8e\x89"));
+  round_trip("string with NULs", V_STR("\0a\0\0b\0"));
+  round_trip("empty array", v_arr(0));
+  round_trip("empty object", v_obj(0));
+  round_trip("array", v_arr(3, v_int(1), V_STR("two"), v_new(json_null)));
+
+  js = v_obj(1, "", v_int(1));
+  g_free(js->u.object.values[0].name);
+  js->u.object.values[0].name = g_malloc(4);
+  memcpy(js->u.object.values[0].name, "a\0b", 4);
+  js->u.object.values[0].name_length = 3;
+  round_trip("NUL in a member name", js);
+
+  round_trip("message", v_obj(4,
+    "op", v_int(0),
+    "s", v_int(42),
+    "t", V_STR("MESSAGE_CREATE"),
+    "d", v_obj(6,
+      "id", v_int(G_GINT64_CONSTANT(1111111111111111111)),
+      "content", V_STR("hi \"there\"\n"),
+      "tts", v_bool(FALSE),
+      "mentions", v_arr(0),
+      "embeds", v_arr(1, v_obj(0)),
+      "nested", v_arr(2, v_arr(1, v_arr(0)), v_obj(1, "x", v_dbl(0.25))))));
+}
+
+/* Terms the encoder doesn't write but the gateway may. */
+static void test_decode(void)
+{
+  static const struct {
+    const char *name;
+    const gchar *buf;
+    gsize len;
+  } terms[] = {
+#define TERM(name, buf) {name, buf, sizeof(buf) - 1}
+    TERM("small atom nil", "\x83\x73\x03nil"),
+    TERM("small utf8 atom true", "\x83\x77\x04true"),
+    TERM("atom false", "\x83\x64\x00\x05" "false"),
+    TERM("utf8 atom", "\x83\x76\x00\x03" "abc"),
+    TERM("string", "\x83\x6b\x00\x03\x01\x02\x03"),
+    TERM("float", "\x83\x63" "1.50000000000000000000e+00\0\0\0\0\0"),
+    TERM("negative integer", "\x83\x62\xff\xff\xff\xfe"),
+    TERM("small tuple", "\x83\x68\x02\x61\x01\x61\x02"),
+    TERM("small big", "\x83\x6e\x08\x00\x00\x10\x40\xb6\xe8\x76\x1d\x01"),
+    TERM("large big", "\x83\x6f\x00\x00\x00\x08\x00"
+                      "\x00\x10\x40\xb6\xe8\x76\x1d\x01"),
+    TERM("negative big", "\x83\x6e\x01\x01\x05"),
+    TERM("empty big", "\x83\x6e\x00\x00"),
+    TERM("big over 64 bits", "\x83\x6e\x09\x00\x01\x02\x03\x04\x05\x06\x07"
+                             "\x08\x09"),
+    TERM("atom keys", "\x83\x74\x00\x00\x00\x02\x73\x01" "k\x61\x07"
+                      "\x64\x00\x01" "l\x6a"),
+#undef TERM
+  };
+  json_value *want[] = {
+    v_new(json_null),
+    v_bool(TRUE),
+    v_bool(FALSE),
+    V_STR("abc"),
+    V_STR("\x01\x02\x03"),
+    v_dbl(1.5),
+    v_int(-2),
+    v_arr(2, v_int(1), v_int(2)),
+    V_STR("80351110224678912"),
+    V_STR("80351110224678912"),
+    V_STR("-5"),
+    V_STR("0"),
+    v_new(json_null),
+    v_obj(2, "k", v_int(7), "l", v_arr(0)),
+  };
+
+  for (guint i = 0; i < G_N_ELEMENTS(terms); i++) {
+    json_value *dec = decode(terms[i].buf, terms[i].len);
+
+    TEST_CHECK(test_json_equal(want[i], dec, FALSE), "%s: wrong value",
+               terms[i].name);
+    discord_etf_free(dec);
+    discord_etf_free(want[i]);
+
+    for (gsize len = 0; len < terms[i].len; len++) {
+      dec = decode(terms[i].buf, len);
+      TEST_CHECK(dec == NULL, "%s: %"G_GSIZE_FORMAT" bytes decoded",
+                 terms[i].name, len);
+      discord_etf_free(dec);
+    }
+  }
+}
+
+/* Lengths and counts far beyond what's left of the buffer. */
+static void test_bogus(void)
+{
+  static const struct {
+    const char *name;
+    const gchar *buf;
+    gsize len;
+  } terms[] = {
+#define TERM(name, buf) {name, buf, sizeof(buf) - 1}
+    TERM("nothing", ""),
+    TERM("no term", "\x83"),
+    TERM("wrong version", "\x82\x61\x01"),
+    TERM("unknown tag", "\x83\x00"),
+    TERM("binary", "\x83\x6d\xff\xff\xff\xff" "abc"),
+    TERM("binary key", "\x83\x74\x00\x00\x00\x01\x6d\xff\xff\xff\xff" "ab"),
+    TERM("string", "\x83\x6b\xff\xff" "ab"),
+    TERM("atom", "\x83\x64\xff\xff" "ab"),
+    TERM("small atom", "\x83\x73\xff" "ab"),
+    TERM("list", "\x83\x6c\xff\xff\xff\xff\x61\x01\x6a"),
+    TERM("small tuple", "\x83\x68\xff\x61\x01"),
+    TERM("large tuple", "\x83\x69\xff\xff\xff\xff\x61\x01"),
+    TERM("map", "\x83\x74\xff\xff\xff\xff\x6d\x00\x00\x00\x00\x61\x01"),
+    TERM("small big", "\x83\x6e\xff\x00\x01\x02"),
+    TERM("large big", "\x83\x6f\xff\xff\xff\xff\x00\x01\x02"),
+    TERM("large big sign only", "\x83\x6f\xff\xff\xff\xff\x00"),
+    TERM("improper list", "\x83\x6c\x00\x00\x00\x01\x61\x01\x61\x02"),
+    TERM("integer key", "\x83\x74\x00\x00\x00\x01\x61\x01\x61\x02"),
+#undef TERM
+  };
+
+  for (guint i = 0; i < G_N_ELEMENTS(terms); i++) {
+    json_value *dec = decode(terms[i].buf, terms[i].len);
+
+    TEST_CHECK(dec == NULL, "%s: decoded", terms[i].name);
+    discord_etf_free(dec);
+  }
+}
+
+static json_value *nested(guint depth)
+{
+  json_value *js = v_arr(0);
+
+  while (--depth > 0) {
+    js = v_arr(1, js);
+  }
+  return js;
+}
+
+/* MAX_DEPTH values deep is fine, one more is refused instead of recursing
+ * any further. */
+static void test_depth(void)
+{
+  json_value *js = nested(MAX_DEPTH + 1);
+  GString *buf = discord_etf_encode(js);
+  json_value *dec = decode(buf->str, buf->len);
+
+  TEST_CHECK(dec == NULL, "%d nested lists decoded", MAX_DEPTH + 1);
+  discord_etf_free(dec);
+  g_string_free(buf, TRUE);
+  discord_etf_free(js);
+
+  round_trip("nested lists", nested(MAX_DEPTH));
+}
+
+int main(void)
+{
+  test_integers();
+  test_values();
+  test_decode();
+  test_bogus();
+  test_depth();
+
+  printf("%u terms decoded\n", checked);
+  return test_result();
+}
@@ -0,0 +1,240 @@
+/*
+ * Copyright 2015 Artem Savkov <artem.savkov@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "discord-json.h"
+#include "test-util.h"
+
+/* The indexed parser has to build exactly what bitlbee's json-parser does,
+ * or reject what it rejects. Its first pass works on 64 byte blocks and
+ * carries string and escape state from one block to the next, so most of
+ * the cases below are shifted across a block boundary one byte at a time. */
+
+#define JSON_BLOCK 64
+/* Has to match JSON_MAX_DEPTH in discord-json.c. */
+#define MAX_DEPTH 128
+
+static guint compared = 0;
+
+static void compare(const gchar *buf, gsize len, gboolean valid)
+{
+  json_value *ref = json_parse(buf, len);
+  json_value *js = discord_json_parse(buf, len);
+
+  compared++;
+  if (valid && ref == NULL) {
+    test_fail("json-parser rejected %.*s", (int)MIN(len, 200), buf);
+  }
+  TEST_CHECK(test_json_equal(ref, js, FALSE),
+             "indexed parser %s json-parser on %.*s",
+             js == NULL ? "rejected what was accepted by" : "disagrees with",
+             (int)MIN(len, 200), buf);
+
+  json_value_free(ref);
+  discord_json_free(js);
+}
+
+static void compare_str(const gchar *buf, gboolean valid)
+{
+  compare(buf, strlen(buf), valid);
+}
+
+/* Every escape sequence, starting at every offset of two blocks, both in a
+ * value and in a key. Structural characters follow right after so that
+ * getting the end of the string wrong shows. */
+static void test_block_boundaries(void)
+{
+  static const char *escapes[] = {
+    "\\\"", "\\\\", "\\/", "\\b", "\\f", "\\n", "\\r", "\\t",
+    "\\\\\\\"", "\\\\\\\\", "\\\\\\\\\\\"", "\\\"\\\"",
+    "\\u0041", "\\u00e9", "\\u00E9", "\\u20ac", "\\ud83d\\ude00",
+    "\\\"],{:", "\xc3\xa9", "\xf0\x9f\x9a\x80",
+    NULL
+  };
+
+  for (int e = 0; escapes[e] != NULL; e++) {
+    for (int pad = 0; pad < 2 * JSON_BLOCK + 4; pad++) {
+      GString *buf = g_string_new("");
+
+      g_string_append(buf, "[\"");
+      for (int i = 0; i < pad; i++) {
+        g_string_append_c(buf, 'a');
+      }
+      g_string_append_printf(buf, "%s\",{\"k%s\":[\"%s\"]}]", escapes[e],
+                             escapes[e], escapes[e]);
+      compare(buf->str, buf->len, TRUE);
+
+      /* Only the last byte of the string is the escape, then the document
+         ends. */
+      g_string_truncate(buf, 0);
+      g_string_append(buf, "{\"");
+      for (int i = 0; i < pad; i++) {
+        g_string_append_c(buf, 'b');
+      }
+      g_string_append_printf(buf, "\":\"%s\"}", escapes[e]);
+      compare(buf->str, buf->len, TRUE);
+
+      g_string_free(buf, TRUE);
+    }
+  }
+
+  /* Runs of backslashes crossing the boundary, odd ones escape the quote
+     that follows. */
+  for (int n = 1; n < 2 * JSON_BLOCK + 2; n++) {
+    for (int pad = JSON_BLOCK - 8; pad < JSON_BLOCK + 2; pad++) {
+      GString *buf = g_string_new("[\"");
+
+      for (int i = 0; i < pad; i++) {
+        g_string_append_c(buf, ' ');
+      }
+      for (int i = 0; i < 2 * n; i++) {
+        g_string_append_c(buf, '\\');
+      }
+      if (n % 2) {
+        g_string_append(buf, "\\\"");
+      }
+      g_string_append(buf, "\",1]");
+      compare(buf->str, buf->len, TRUE);
+      g_string_free(buf, TRUE);
+    }
+  }
+}
+
+static void test_unicode(void)
+{
+  compare_str("[\"\\u0041\\u0062\\u0063\"]", TRUE);
+  compare_str("[\"\\u007f\\u0080\\u07ff\\u0800\\uffff\"]", TRUE);
+  compare_str("[\"\\u00e9\\u00C9 caf\\u00e9\"]", TRUE);
+  compare_str("[\"\\ud83d\\ude00 \\uD83D\\uDE80\"]", TRUE);
+  compare_str("[\"\\u0000\",\"a\\u0000b\"]", TRUE);
+  compare_str("{\"\\u006bey\":\"\\u0076alue\"}", TRUE);
+  compare_str("[\"z\xc3\xab \xe6\x97\xa5\xe6\x9c\xac \xf0\x9f\x8e\x89\"]",
+              TRUE);
+
+  compare_str("[\"\\u12\"]", FALSE);
+  compare_str("[\"\\u12g4\"]", FALSE);
+  compare_str("[\"\\uzzzz\"]", FALSE);
+  compare_str("[\"\\x41\"]", FALSE);
+  compare_str("[\"\\", FALSE);
+  compare_str("[\"\\u00", FALSE);
+}
+
+/* No prefix of a document is one. */
+static void test_truncated(void)
+{
+  static const char *payloads[] = {"message_create", "typing_start", NULL};
+  const char *doc = "{\"a\":[1,-2.5e3,true,false,null,\"x\\\"y\"],"
+                    "\"b\":{\"c\":{}},\"d\":[]}";
+
+  for (gsize len = 0; len < strlen(doc); len++) {
+    compare(doc, len, FALSE);
+  }
+  compare_str(doc, TRUE);
+
+  for (int i = 0; payloads[i] != NULL; i++) {
+    gsize size;
+    gchar *buf = test_payload(payloads[i], &size);
+
+    for (gsize len = 0; len < size; len++) {
+      compare(buf, len, FALSE);
+    }
+    compare(buf, size, TRUE);
+    g_free(buf);
+  }
+}
+
+static gchar *nested(const char *open, const char *inner, const char *close,
+                     int depth)
+{
+  GString *buf = g_string_new("");
+
+  for (int i = 0; i < depth; i++) {
+    g_string_append(buf, open);
+  }
+  g_string_append(buf, inner);
+  for (int i = 0; i < depth; i++) {
+    g_string_append(buf, close);
+  }
+  return g_string_free(buf, FALSE);
+}
+
+/* Up to MAX_DEPTH values deep both parsers agree, beyond that the indexed
+ * one refuses instead of recursing any further. json-parser has no such
+ * limit, it only gets to see what should be accepted. */
+static void test_depth(void)
+{
+  gchar *buf;
+  json_value *js;
+
+  buf = nested("[", "", "]", MAX_DEPTH);
+  compare_str(buf, TRUE);
+  g_free(buf);
+
+  buf = nested("{\"a\":", "1", "}", MAX_DEPTH - 1);
+  compare_str(buf, TRUE);
+  g_free(buf);
+
+  buf = nested("[", "", "]", MAX_DEPTH + 1);
+  js = discord_json_parse(buf, strlen(buf));
+  TEST_CHECK(js == NULL, "%d nested arrays accepted", MAX_DEPTH + 1);
+  discord_json_free(js);
+  g_free(buf);
+
+  buf = nested("{\"a\":", "1", "}", MAX_DEPTH);
+  js = discord_json_parse(buf, strlen(buf));
+  TEST_CHECK(js == NULL, "%d nested objects accepted", MAX_DEPTH);
+  discord_json_free(js);
+  g_free(buf);
+
+  buf = nested("[", "", "]", 100000);
+  js = discord_json_parse(buf, strlen(buf));
+  TEST_CHECK(js == NULL, "100000 nested arrays accepted");
+  discord_json_free(js);
+  g_free(buf);
+}
+
+static void test_misc(void)
+{
+  compare_str("[]", TRUE);
+  compare_str("{}", TRUE);
+  compare_str(" \t\r\n[ 1 , 2 ]\n ", TRUE);
+  compare_str("[0,-0,12,-12,9007199254740993,1.5,-1.5E-3,2e10,1E+2]", TRUE);
+  compare_str("[true,false,null,\"\",[],{}]", TRUE);
+  compare_str("{\"a\":{\"b\":{\"c\":[{\"d\":null}]}},\"e\":\"f\"}", TRUE);
+
+  compare_str("[1 2]", FALSE);
+  compare_str("{\"a\" 1}", FALSE);
+  compare_str("{\"a\":}", FALSE);
+  compare_str("{1:2}", FALSE);
+  compare_str("[tru]", FALSE);
+  compare_str("[\"a\"", FALSE);
+  compare_str("{\"a\":1}}", FALSE);
+  compare_str("[1]x", FALSE);
+}
+
+int main(void)
+{
+  test_block_boundaries();
+  test_unicode();
+  test_truncated();
+  test_depth();
+  test_misc();
+
+  printf("%u documents compared\n", compared);
+  return test_result();
+}
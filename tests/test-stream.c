@@ -0,0 +1,317 @@
+/*
+ * Copyright 2015 Artem Savkov <artem.savkov@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "discord-json.h"
+#include "test-util.h"
+
+/* The streaming parser sees a READY in whatever pieces it arrives in off
+ * the socket. Whatever the pieces, the tree it finishes with has to be the
+ * one the whole message parses to, minus the values the callback took.
+ * The cuts are made everywhere in the small documents and at a stride, at
+ * every escape and in every chunk size from a list in READY. */
+
+/* Same as the gateway code asks for, see discord_ws_stream_wanted(). */
+#define EMIT_DEPTH 3
+#define STRIDE 2039
+
+/* Escapes, escaped member names and scalars at the end of chunks, shaped
+ * like a READY so that the arrays discord_stream_item() takes apart are
+ * there. */
+static const char escapes_doc[] =
+  "{\"t\":\"READY\",\"s\":1,\"op\":0,\"d\":{"
+  "\"user\":{\"id\":\"80351110224678912\",\"username\":\"a\\\"b\\\\c\\/d\","
+  "\"bio\":\"\\b\\f\\n\\r\\t\\u00e9\\u20AC\\ud83d\\ude00\\\\\\\"\"},"
+  "\"users\":[{\"id\":\"1\",\"username\":\"\\\\\"},{\"id\":\"2\"}],"
+  "\"k\\\"ey\\u0041\":[-1.5e-3,0,true,false,null,[],{}],"
+  "\"guilds\":[{\"id\":\"3\",\"name\":\"x\\\\\\\"y\\n\"},"
+  "{\"id\":\"4\",\"name\":\"\\u0000\",\"unavailable\":true}],"
+  "\"private_channels\":[{\"id\":\"5\",\"recipient_ids\":[\"1\",\"2\"]}],"
+  "\"relationships\":[{\"id\":\"1\",\"type\":1,\"nickname\":\"\\\"\"}],"
+  "\"merged_members\":[[]],\"merged_presences\":{\"guilds\":[[]]},"
+  "\"session_id\":\"\\u0061\\u0062\"}}";
+
+static const char *taken[] = {"guilds", "private_channels", "relationships",
+                              NULL};
+
+typedef struct {
+  json_value *ref;
+  gboolean   drop;
+  guint      dropped;
+} stream_run;
+
+static guint streamed = 0;
+
+static json_value *member(const json_value *js, const char *name)
+{
+  if (js == NULL || js->type != json_object) {
+    return NULL;
+  }
+  for (unsigned int i = 0; i < js->u.object.length; i++) {
+    if (strcmp(js->u.object.values[i].name, name) == 0) {
+      return js->u.object.values[i].value;
+    }
+  }
+  return NULL;
+}
+
+static gboolean is_taken(const gchar *key)
+{
+  for (int i = 0; taken[i] != NULL; i++) {
+    if (g_strcmp0(key, taken[i]) == 0) {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/* Takes the same values discord_stream_item() does, checking each against
+ * the one at the same place in the whole message. */
+static gboolean stream_item(gpointer data, json_value *root, guint depth,
+                            const gchar *key, guint index, json_value *value)
+{
+  stream_run *run = data;
+  json_value *arr;
+
+  TEST_CHECK(depth >= 1 && depth <= EMIT_DEPTH,
+             "value handed out %u levels down", depth);
+  if (!run->drop || depth != EMIT_DEPTH || value->type != json_object ||
+      value->parent->type != json_array || !is_taken(key)) {
+    return FALSE;
+  }
+
+  arr = member(member(run->ref, "d"), key);
+  TEST_CHECK(arr != NULL && index < arr->u.array.length &&
+             test_json_equal(arr->u.array.values[index], value, FALSE),
+             "%s[%u] differs from the one in the whole message", key, index);
+  run->dropped++;
+  return TRUE;
+}
+
+/* Feeds buf cut at the given offsets, returns what the stream finished
+ * with. */
+static json_value *stream(stream_run *run, const gchar *buf, gsize len,
+                          const gsize *cuts, guint ncuts)
+{
+  discord_json_stream *st = discord_json_stream_new(EMIT_DEPTH, stream_item,
+                                                    run);
+  gsize pos = 0;
+
+  streamed++;
+  for (guint i = 0; i <= ncuts; i++) {
+    gsize next = i < ncuts ? cuts[i] : len;
+
+    if (!discord_json_stream_feed(st, buf + pos, next - pos)) {
+      break;
+    }
+    pos = next;
+  }
+  return discord_json_stream_finish(st);
+}
+
+/* What's left of ref once the taken arrays are emptied, without copying
+ * it: lengths are swapped out and back in. */
+static void hide_taken(json_value *ref, unsigned int *saved)
+{
+  for (int i = 0; taken[i] != NULL; i++) {
+    json_value *arr = member(member(ref, "d"), taken[i]);
+
+    if (arr != NULL && arr->type == json_array) {
+      unsigned int len = arr->u.array.length;
+
+      arr->u.array.length = saved[i];
+      saved[i] = len;
+    }
+  }
+}
+
+static guint count_taken(const json_value *ref)
+{
+  guint n = 0;
+
+  for (int i = 0; taken[i] != NULL; i++) {
+    json_value *arr = member(member(ref, "d"), taken[i]);
+
+    for (unsigned int j = 0; arr != NULL && arr->type == json_array &&
+                             j < arr->u.array.length; j++) {
+      n += arr->u.array.values[j]->type == json_object;
+    }
+  }
+  return n;
+}
+
+/* Both with the callback keeping everything and with it taking what the
+ * gateway code takes. */
+static void check_cuts(const char *name, json_value *ref, const gchar *buf,
+                       gsize len, const gsize *cuts, guint ncuts)
+{
+  for (int drop = 0; drop < 2; drop++) {
+    stream_run run = {ref, drop, 0};
+    json_value *js = stream(&run, buf, len, cuts, ncuts);
+    unsigned int saved[G_N_ELEMENTS(taken)] = {0};
+    gboolean equal;
+
+    if (drop) {
+      hide_taken(ref, saved);
+    }
+    equal = test_json_equal(ref, js, FALSE);
+    if (drop) {
+      hide_taken(ref, saved);
+    }
+
+    TEST_CHECK(equal, "%s cut %u time(s), first at %"G_GSIZE_FORMAT
+               "%s: differs from a single parse", name, ncuts,
+               ncuts > 0 ? cuts[0] : len, drop ? ", values taken" : "");
+    TEST_CHECK(!drop || run.dropped == count_taken(ref),
+               "%s: %u values taken, expected %u", name, run.dropped,
+               count_taken(ref));
+    discord_json_free(js);
+  }
+}
+
+static json_value *reference(const char *name, const gchar *buf, gsize len)
+{
+  json_value *ref = json_parse(buf, len);
+
+  if (ref == NULL) {
+    test_fail("json-parser rejected %s", name);
+  }
+  return ref;
+}
+
+/* Every single cut, a byte at a time and, with pairs set, every pair of
+ * cuts close enough together to take an escape sequence apart in three. */
+static void test_small(const char *name, const gchar *buf, gsize len,
+                       gboolean pairs)
+{
+  json_value *ref = reference(name, buf, len);
+  gsize *cuts = g_new(gsize, len);
+
+  check_cuts(name, ref, buf, len, NULL, 0);
+  for (gsize a = 1; a < len; a++) {
+    check_cuts(name, ref, buf, len, &a, 1);
+    for (gsize b = a + 1; pairs && b < len && b <= a + 8; b++) {
+      gsize two[] = {a, b};
+
+      check_cuts(name, ref, buf, len, two, 2);
+    }
+  }
+  for (gsize i = 0; i + 1 < len; i++) {
+    cuts[i] = i + 1;
+  }
+  check_cuts(name, ref, buf, len, cuts, len - 1);
+
+  g_free(cuts);
+  json_value_free(ref);
+}
+
+static void test_payloads(void)
+{
+  static const char *payloads[] = {"hello", "typing_start", "presence_update",
+                                   "message_create", NULL};
+
+  for (int i = 0; payloads[i] != NULL; i++) {
+    gsize len;
+    gchar *buf = test_payload(payloads[i], &len);
+
+    test_small(payloads[i], buf, len, FALSE);
+    g_free(buf);
+  }
+  test_small("escapes", escapes_doc, strlen(escapes_doc), TRUE);
+}
+
+static void test_ready(void)
+{
+  static const gsize steps[] = {1, 2, 3, 7, 64, 100, 1000, 4093, 65536};
+  gsize len;
+  gchar *buf = test_payload("ready", &len);
+  json_value *ref = reference("ready", buf, len);
+  gsize *cuts = g_new(gsize, len);
+
+  TEST_CHECK(count_taken(ref) > 0, "ready has nothing to take");
+  check_cuts("ready", ref, buf, len, NULL, 0);
+
+  /* Right before, inside and right after every escape. */
+  for (gsize i = 0; i < len; i++) {
+    if (buf[i] != '\\') {
+      continue;
+    }
+    for (gsize c = i; c <= i + 2 && c < len; c++) {
+      check_cuts("ready", ref, buf, len, &c, 1);
+    }
+    i++;
+  }
+
+  for (gsize c = 1; c < len; c += STRIDE) {
+    check_cuts("ready", ref, buf, len, &c, 1);
+  }
+
+  /* Fixed size chunks, the first one shorter so that the cuts move. */
+  for (guint s = 0; s < G_N_ELEMENTS(steps); s++) {
+    for (gsize first = 1; first <= steps[s] && first <= 4; first++) {
+      guint n = 0;
+
+      for (gsize c = first; c < len; c += steps[s]) {
+        cuts[n++] = c;
+      }
+      check_cuts("ready", ref, buf, len, cuts, n);
+    }
+  }
+
+  g_free(cuts);
+  json_value_free(ref);
+  g_free(buf);
+}
+
+/* A message cut off anywhere is no message. Freeing the stream halfway is
+ * what happens when the connection drops, see discord_ws_close(). */
+static void test_truncated(void)
+{
+  gsize len;
+  gchar *buf = test_payload("ready", &len);
+  json_value *ref = reference("ready", buf, len);
+
+  for (gsize c = 0; c < len; c += STRIDE) {
+    for (int drop = 0; drop < 2; drop++) {
+      stream_run run = {ref, drop, 0};
+      discord_json_stream *st;
+      json_value *js = stream(&run, buf, c, NULL, 0);
+
+      TEST_CHECK(js == NULL, "ready cut off at %"G_GSIZE_FORMAT
+                 " was accepted", c);
+      discord_json_free(js);
+
+      st = discord_json_stream_new(EMIT_DEPTH, stream_item, &run);
+      discord_json_stream_feed(st, buf, c);
+      discord_json_stream_free(st);
+    }
+  }
+
+  json_value_free(ref);
+  g_free(buf);
+}
+
+int main(void)
+{
+  test_payloads();
+  test_ready();
+  test_truncated();
+
+  printf("%u streams compared\n", streamed);
+  return test_result();
+}
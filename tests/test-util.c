@@ -0,0 +1,145 @@
+/*
+ * Copyright 2015 Artem Savkov <artem.savkov@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test-util.h"
+
+static guint failures = 0;
+
+gchar *test_payload(const char *name, gsize *len)
+{
+  gchar *path = g_strdup_printf("%s/%s.json", PAYLOAD_DIR, name);
+  gchar *buf = NULL;
+
+  if (!g_file_get_contents(path, &buf, len, NULL)) {
+    fprintf(stderr, "FAIL: can't read %s\n", path);
+    exit(1);
+  }
+  g_free(path);
+  return buf;
+}
+
+static gboolean test_etf_integer(const json_value *a, const json_value *b)
+{
+  gchar *s;
+  gboolean ret;
+
+  if (a->type != json_integer || b->type != json_string) {
+    return FALSE;
+  }
+  s = g_strdup_printf("%"G_GINT64_FORMAT, (gint64)a->u.integer);
+  ret = strcmp(s, b->u.string.ptr) == 0;
+  g_free(s);
+  return ret;
+}
+
+gboolean test_json_equal(const json_value *a, const json_value *b,
+                         gboolean etf)
+{
+  if (a == NULL || b == NULL) {
+    return a == b;
+  }
+  if (a->type != b->type) {
+    return etf && test_etf_integer(a, b);
+  }
+
+  switch (a->type) {
+    case json_object:
+      if (a->u.object.length != b->u.object.length) {
+        return FALSE;
+      }
+      for (unsigned int i = 0; i < a->u.object.length; i++) {
+        json_object_entry *ea = &a->u.object.values[i];
+        json_object_entry *eb = &b->u.object.values[i];
+
+        if (ea->name_length != eb->name_length ||
+            memcmp(ea->name, eb->name, ea->name_length) != 0 ||
+            !test_json_equal(ea->value, eb->value, etf) ||
+            eb->value->parent != b) {
+          return FALSE;
+        }
+      }
+      return TRUE;
+    case json_array:
+      if (a->u.array.length != b->u.array.length) {
+        return FALSE;
+      }
+      for (unsigned int i = 0; i < a->u.array.length; i++) {
+        if (!test_json_equal(a->u.array.values[i], b->u.array.values[i],
+                             etf) ||
+            b->u.array.values[i]->parent != b) {
+          return FALSE;
+        }
+      }
+      return TRUE;
+    case json_integer:
+      return a->u.integer == b->u.integer;
+    case json_double:
+      return a->u.dbl == b->u.dbl ||
+             fabs(a->u.dbl - b->u.dbl) <= 1e-12 * fabs(a->u.dbl);
+    case json_string:
+      return a->u.string.length == b->u.string.length &&
+             memcmp(a->u.string.ptr, b->u.string.ptr,
+                    a->u.string.length) == 0 &&
+             b->u.string.ptr[b->u.string.length] == '\0';
+    case json_boolean:
+      return !a->u.boolean == !b->u.boolean;
+    default:
+      return TRUE;
+  }
+}
+
+void test_fail(const char *fmt, ...)
+{
+  va_list args;
+
+  fputs("FAIL: ", stderr);
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+  fputc('\n', stderr);
+  failures++;
+}
+
+int test_result(void)
+{
+  if (failures > 0) {
+    fprintf(stderr, "%u check(s) failed\n", failures);
+    return 1;
+  }
+  return 0;
+}
+
+gdouble test_bench(test_bench_func func, const gchar *buf, gsize len,
+                   gint64 budget)
+{
+  gint64 start = g_get_monotonic_time();
+  gint64 elapsed;
+  guint runs = 0;
+
+  do {
+    func(buf, len);
+    runs++;
+    elapsed = g_get_monotonic_time() - start;
+  } while (elapsed < budget);
+
+  return (gdouble)elapsed / runs;
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright 2015 Artem Savkov <artem.savkov@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <glib.h>
+#include <json.h>
+
+/* Helpers shared by the test programs. A failed check is reported and
+ * counted, the program carries on and test_result() turns the count into
+ * the exit status automake expects. */
+
+/* Reads tests/payloads/<name>.json, NUL terminated. A missing payload is a
+ * failed test, the program exits. */
+gchar *test_payload(const char *name, gsize *len);
+
+/* Same shape and values. Doubles only have to agree to rounding, parsers
+ * are free to get the last bit differently. With etf set, integers in a
+ * may be decimal strings in b: that's how the ETF decoder hands out
+ * anything that doesn't fit into 32 bits. */
+gboolean test_json_equal(const json_value *a, const json_value *b,
+                         gboolean etf);
+
+void test_fail(const char *fmt, ...) G_GNUC_PRINTF(1, 2);
+int test_result(void);
+
+#define TEST_CHECK(cond, ...) \
+  do { \
+    if (!(cond)) { \
+      test_fail(__VA_ARGS__); \
+    } \
+  } while (0)
+
+/* Microseconds per run of func over buf, running it for about budget
+ * microseconds in total. */
+typedef void (*test_bench_func)(const gchar *buf, gsize len);
+gdouble test_bench(test_bench_func func, const gchar *buf, gsize len,
+                   gint64 budget);
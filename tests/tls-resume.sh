@@ -0,0 +1,138 @@
+#!/bin/bash
+# Copyright 2016 Artem Savkov <artem.savkov@gmail.com>
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Logs an account into a local TLS server twice with tls_transport set to
+# gnutls and checks "discord stats" reports the second handshake as
+# resumed. The server is openssl s_server with a certificate from a CA made
+# up for the test, handed to bitlbee as CAfile. It never answers the
+# websocket upgrade, only the handshakes matter. make check sets BITLBEE,
+# OPENSSL and PLUGIN_DIR.
+
+: "${BITLBEE:=bitlbee}"
+: "${OPENSSL:=openssl}"
+: "${PLUGIN_DIR:=../src/.libs}"
+
+skip() {
+  echo "SKIP: $*"
+  exit 77
+}
+
+command -v "$BITLBEE" >/dev/null 2>&1 || skip "bitlbee not found"
+command -v "$OPENSSL" >/dev/null 2>&1 || skip "openssl not found"
+[ -f "$PLUGIN_DIR/discord.so" ] || skip "no discord.so in $PLUGIN_DIR"
+
+dir=$(mktemp -d) || exit 1
+tls_port=$((20000 + $$ % 20000))
+irc_port=$((tls_port + 1))
+pids=
+
+cleanup() {
+  exec 3>&- 4>&-
+  [ -n "$pids" ] && kill $pids 2>/dev/null
+  wait 2>/dev/null
+  rm -rf "$dir"
+}
+trap cleanup EXIT
+
+fail() {
+  echo "FAIL: $*"
+  for log in server.log irc.log bitlbee.log; do
+    echo "== $log"
+    cat "$dir/$log" 2>/dev/null
+  done
+  exit 1
+}
+
+# Waits up to 10 seconds for a line matching $2 in log $1, $3 times.
+wait_for() {
+  for i in $(seq 20); do
+    [ "$(grep -c -e "$2" "$dir/$1")" -ge "${3:-1}" ] && return 0
+    sleep 0.5
+  done
+  return 1
+}
+
+irc() {
+  printf '%s\r\n' "$*" >&3
+}
+
+cd "$dir" || exit 1
+"$OPENSSL" req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=test-ca \
+  -keyout ca.key -out ca.pem >/dev/null 2>&1 &&
+"$OPENSSL" req -newkey rsa:2048 -nodes -subj /CN=localhost \
+  -keyout server.key -out server.csr >/dev/null 2>&1 &&
+printf 'subjectAltName=DNS:localhost\n' >server.ext &&
+"$OPENSSL" x509 -req -days 1 -in server.csr -CA ca.pem -CAkey ca.key \
+  -CAcreateserial -extfile server.ext -out server.pem >/dev/null 2>&1 ||
+  fail "can't create the test certificates"
+
+# s_server drops the connection once its stdin ends, a fifo that's kept
+# open for writing never does.
+mkfifo server.in || exit 1
+exec 4<>server.in
+"$OPENSSL" s_server -accept "$tls_port" -cert server.pem \
+  -key server.key <server.in >server.log 2>&1 &
+pids="$pids $!"
+wait_for server.log "^ACCEPT" || fail "openssl s_server didn't start"
+
+cat >bitlbee.conf <<CONF
+[settings]
+RunMode = Daemon
+DaemonInterface = 127.0.0.1
+DaemonPort = $irc_port
+AuthMode = Open
+ConfigDir = $dir
+PidFile = $dir/bitlbee.pid
+PluginDir = $PLUGIN_DIR
+CAfile = $dir/ca.pem
+CONF
+"$BITLBEE" -n -c bitlbee.conf >bitlbee.log 2>&1 &
+pids="$pids $!"
+
+connected=
+for i in $(seq 20); do
+  { exec 3<>"/dev/tcp/127.0.0.1/$irc_port"; } 2>/dev/null && connected=1 &&
+    break
+  sleep 0.5
+done
+[ -n "$connected" ] || fail "can't connect to bitlbee"
+cat <&3 >irc.log &
+pids="$pids $!"
+
+irc "NICK tester"
+irc "USER tester 0 * :tester"
+wait_for irc.log " 001 " || fail "not registered with bitlbee"
+
+irc "PRIVMSG root :account add discord tester@example.com secret"
+irc "PRIVMSG root :account discord set token_cache test"
+irc "PRIVMSG root :account discord set gateway_cache wss://localhost:$tls_port/"
+irc "PRIVMSG root :account discord set tls_transport gnutls"
+irc "PRIVMSG root :account discord on"
+wait_for server.log "^GET " || fail "first connection not made"
+
+# The session tickets arrive after the handshake and are read while the
+# plugin waits for the upgrade reply. account off saves the session again.
+irc "PRIVMSG root :discord stats"
+wait_for irc.log "tls: 1 handshakes, 0 resumed" ||
+  fail "first handshake not counted"
+irc "PRIVMSG root :account discord off"
+irc "PRIVMSG root :account discord on"
+wait_for server.log "^GET " 2 || fail "second connection not made"
+
+irc "PRIVMSG root :discord stats"
+wait_for irc.log "tls: [0-9]* handshakes, [1-9][0-9]* resumed" ||
+  fail "second handshake not resumed"
+grep -o "tls: .*" irc.log | tr -d '\r'